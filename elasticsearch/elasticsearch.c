@@ -24,7 +24,7 @@
  */
 
 /*
-*	cc elasticsearch.c http.c -lgit2 -lcurl -ljson-c -o elasticsearch
+*	cc elasticsearch.c http.c -lgit2 -lcurl -ljson-c -lpthread -o elasticsearch
 */
 
 #include <math.h>
@@ -38,23 +38,27 @@
 #define GIT2_INDEX_NAME "git2_odb"
 #define GIT2_TYPE_NAME "git2_odb"
 
+/* idle connections kept open to elasticsearch */
+#define GIT2_HTTP_POOL_SIZE 8
+
 typedef struct {
 	git_odb_backend parent;
 	const char *hostname;
 	const char *index_uri;
 	const char *type_uri;
+	struct http_pool *pool;
 } elasticsearch_backend;
 
 char *join(const char* s[], int size);
 char *concat(const char* s1, const char* s2);
 
-char *create_document(char *type_uri, char *id, int size, int type, char *data);
-char *create_index(char *index_uri);
-char *get_document(char *type_uri, char *id);
-char *get_index(char *index_uri);
-char *update_document(char *type_uri, char *id, int size, int type, char *data);
-char *delete_document(char *type_uri, char *id);
-char *delete_index(char *index_uri);
+char *create_document(struct http_pool *pool, char *type_uri, char *id, int size, int type, char *data);
+char *create_index(struct http_pool *pool, char *index_uri);
+char *get_document(struct http_pool *pool, char *type_uri, char *id);
+char *get_index(struct http_pool *pool, char *index_uri);
+char *update_document(struct http_pool *pool, char *type_uri, char *id, int size, int type, char *data);
+char *delete_document(struct http_pool *pool, char *type_uri, char *id);
+char *delete_index(struct http_pool *pool, char *index_uri);
 
 int elasticsearch_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid){
 	elasticsearch_backend *backend;
@@ -67,7 +71,7 @@ int elasticsearch_backend__read_header(size_t *len_p, git_otype *type_p, git_odb
 
 	/* get the document */
 	const char *query = join((const char*[3]){backend->index_uri,"/",(char *)oid->id},3);
-	const char *content = get_http_json(query);
+	const char *content = get_http_json(backend->pool, query);
 	
 	/* fail if the object wasn't returned */
 	if (strcmp(content,"")==0){
@@ -117,14 +121,15 @@ void elasticsearch_backend__free(git_odb_backend *_backend){
 	assert(_backend);
 	backend = (elasticsearch_backend *)_backend;
 
+	http_pool_free(backend->pool);
 	free(backend);
 }
 
 static int init_db(elasticsearch_backend *backend){
-	int result;
+	int result = 0;
 
 	/* check whether or not the index exists */
-	const char* content = get_http_json(backend->index_uri);
+	const char* content = get_http_json(backend->pool, backend->index_uri);
 
     json_object *json;                                      /* json response */
     enum json_tokener_error jerr = json_tokener_success;    /* json parse error */
@@ -154,7 +159,7 @@ static int init_db(elasticsearch_backend *backend){
 					"} "
 				"} "
 			"}";
-		put_http_json(backend->index_uri, mapping);
+		put_http_json(backend->pool, backend->index_uri, mapping);
 	}
 
 	return result;
@@ -171,6 +176,14 @@ int git_odb_backend_elasticsearch(git_odb_backend **backend_out, const char *hos
 		return GIT_ERROR;
 	}
 
+	/* open the connection pool */
+	backend->pool = http_pool_new(GIT2_HTTP_POOL_SIZE);
+	if (backend->pool == NULL) {
+		free(backend);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
 	/* set the backend hostname */
 	backend->hostname = hostname;
 	backend->index_uri = join((const char*[4]){"http://",hostname,"/",GIT2_INDEX_NAME},4);
@@ -216,6 +229,7 @@ int main(int argc, char *argv[]) {
 	char *index_name;
 	char *index_uri;
 	char *type_uri;
+	struct http_pool *pool = http_pool_new(1);
 
 	printf("\n%s\n\n","Starting Tests...");
 
@@ -223,112 +237,113 @@ int main(int argc, char *argv[]) {
 	test_num = "1";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Create Index - Already Exists: ", create_index(index_uri));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Create Index - Already Exists: ", create_index(pool,index_uri));
+	delete_index(pool,index_uri);
 
 	/* create index - standard */
 	test_num = "2";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
-	printf("%s\n\n%s\n\n","Create Index - Standard: ", create_index(index_uri));
-	delete_index(index_uri);
+	printf("%s\n\n%s\n\n","Create Index - Standard: ", create_index(pool,index_uri));
+	delete_index(pool,index_uri);
 
 	/* create document - already exists */
 	test_num = "3";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	create_document(type_uri,index_name,1,2,index_name);
-	printf("%s\n\n%s\n\n","Create Document - Already Exists: ", create_document(type_uri,index_name,1,2,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	create_document(pool,type_uri,index_name,1,2,index_name);
+	printf("%s\n\n%s\n\n","Create Document - Already Exists: ", create_document(pool,type_uri,index_name,1,2,index_name));
+	delete_index(pool,index_uri);
 
 	/* create document - standard */
 	test_num = "4";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Create Document - Standard: ", create_document(type_uri,index_name,1,2,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Create Document - Standard: ", create_document(pool,type_uri,index_name,1,2,index_name));
+	delete_index(pool,index_uri);
 
 	/* get document - doesn't exist */
 	test_num = "5";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Get Document - Doesn't Exist: ", get_document(type_uri,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Get Document - Doesn't Exist: ", get_document(pool,type_uri,index_name));
+	delete_index(pool,index_uri);
 
 	/* get document - standard */
 	test_num = "6";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	create_document(type_uri,index_name,1,2,index_name);
-	printf("%s\n\n%s\n\n","Get Document - Standard: ", get_document(type_uri,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	create_document(pool,type_uri,index_name,1,2,index_name);
+	printf("%s\n\n%s\n\n","Get Document - Standard: ", get_document(pool,type_uri,index_name));
+	delete_index(pool,index_uri);
 
 	/* get index - doesn't exist */
 	test_num = "7";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
-	printf("%s\n\n%s\n\n","Get Index - Doesn't Exist: ", get_index(index_uri));
+	printf("%s\n\n%s\n\n","Get Index - Doesn't Exist: ", get_index(pool,index_uri));
 
 	/* get index - standard */
 	test_num = "8";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Get Index - Standard: ", get_index(index_uri));
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Get Index - Standard: ", get_index(pool,index_uri));
 
 	/* update document - doesn't exist */
 	test_num = "9";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Update Document - Doesn't Exist: ", update_document(type_uri,index_name,1,2,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Update Document - Doesn't Exist: ", update_document(pool,type_uri,index_name,1,2,index_name));
+	delete_index(pool,index_uri);
 
 	/* update document - standard */
 	test_num = "10";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	create_document(type_uri,index_name,1,2,index_name);
-	printf("%s\n\n%s\n\n","Update Document - Standard: ", update_document(type_uri,index_name,1,2,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	create_document(pool,type_uri,index_name,1,2,index_name);
+	printf("%s\n\n%s\n\n","Update Document - Standard: ", update_document(pool,type_uri,index_name,1,2,index_name));
+	delete_index(pool,index_uri);
 
 	/* delete document - doesn't exit */
 	test_num = "11";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	printf("%s\n\n%s\n\n","Delete Document - Doesn't Exist: ", delete_document(type_uri,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	printf("%s\n\n%s\n\n","Delete Document - Doesn't Exist: ", delete_document(pool,type_uri,index_name));
+	delete_index(pool,index_uri);
 
 	/* delete document - standard */
 	test_num = "12";
 	index_name = join((const char*[2]){"test",test_num},2);
 	index_uri = join((const char*[4]){"http://",hostname,"/",index_name},4);
 	type_uri = join((const char*[3]){index_uri,"/",index_name},3);
-	create_index(index_uri);
-	create_document(type_uri,index_name,1,2,index_name);
-	printf("%s\n\n%s\n\n","Delete Document - Standard: ", delete_document(type_uri,index_name));
-	delete_index(index_uri);
+	create_index(pool,index_uri);
+	create_document(pool,type_uri,index_name,1,2,index_name);
+	printf("%s\n\n%s\n\n","Delete Document - Standard: ", delete_document(pool,type_uri,index_name));
+	delete_index(pool,index_uri);
 
 	/* delete index - deoesn't exist */
 	/* delete index - standard */
 
+	http_pool_free(pool);
 }
 
-char *create_document(char *type_uri,char *id, int size, int type, char *data){
+char *create_document(struct http_pool *pool, char *type_uri,char *id, int size, int type, char *data){
 	int type_len = (int)((ceil(log10(type))+1)*sizeof(char));
 	int size_len = (int)((ceil(log10(size))+1)*sizeof(char));
 	char type_c[type_len];
@@ -343,10 +358,10 @@ char *create_document(char *type_uri,char *id, int size, int type, char *data){
 			"\"data\" : \"", data, "\"",
 		"}"
 	},11);
-	return put_http_json(join((const char*[3]){type_uri,"/",id},3),doc);
+	return put_http_json(pool, join((const char*[3]){type_uri,"/",id},3),doc);
 }
 
-char *create_index(char *index_uri){
+char *create_index(struct http_pool *pool, char *index_uri){
 	static const char *mapping =
 		"{ "
 			"\"mappings\" : { "
@@ -359,27 +374,27 @@ char *create_index(char *index_uri){
 				"} "
 			"} "
 		"}";
-	return put_http_json(index_uri, mapping);
+	return put_http_json(pool, index_uri, mapping);
 }
 
-char *get_document(char *type_uri, char *id) {
-	return get_http_json(join((const char*[3]){type_uri,"/",id},3));
+char *get_document(struct http_pool *pool, char *type_uri, char *id) {
+	return get_http_json(pool, join((const char*[3]){type_uri,"/",id},3));
 }
 
-char *get_index(char *index_uri){
-	return get_http_json(index_uri);
+char *get_index(struct http_pool *pool, char *index_uri){
+	return get_http_json(pool, index_uri);
 }
 
-char *update_document(char *type_uri, char *id, int size, int type, char *data){
-	return create_document(type_uri, id, size, type, data);
+char *update_document(struct http_pool *pool, char *type_uri, char *id, int size, int type, char *data){
+	return create_document(pool, type_uri, id, size, type, data);
 }
 
-char *delete_document(char *type_uri, char *id){
-	return delete_http_json(join((const char*[3]){type_uri,"/",id},3));
+char *delete_document(struct http_pool *pool, char *type_uri, char *id){
+	return delete_http_json(pool, join((const char*[3]){type_uri,"/",id},3));
 }
 
-char *delete_index(char *index_uri){
-	return delete_http_json(index_uri);
+char *delete_index(struct http_pool *pool, char *index_uri){
+	return delete_http_json(pool, index_uri);
 }
 
 char *concat(const char* s1, const char* s2){
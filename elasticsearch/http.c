@@ -10,38 +10,191 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include "http.h"
 
-/* call http get with json content headers */
-char *get_http_json(const char *url) {
+/* idle handles plus what they share; a handle keeps its own connection
+   open while idle, so taking it again reuses that connection */
+struct http_pool {
+    CURLSH *share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+    pthread_mutex_t lock;
+    struct curl_slist *json_headers;
+    CURL **idle;
+    int idle_count;
+    int size;
+};
+
+/* what init_payload falls back to when out of memory, never freed */
+static char empty_payload[] = "";
+
+static pthread_once_t http_global_once = PTHREAD_ONCE_INIT;
+
+/* curl_global_init isn't thread safe, so it runs once for every pool */
+static void http_global_init(void) {
+    curl_global_init(CURL_GLOBAL_ALL);
+}
+
+/* lock callbacks of the share, one mutex for each kind of data */
+static void http_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+    struct http_pool *pool = (struct http_pool *) userp;
+    pthread_mutex_lock(&pool->share_locks[data]);
+}
+
+static void http_share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+    struct http_pool *pool = (struct http_pool *) userp;
+    pthread_mutex_unlock(&pool->share_locks[data]);
+}
+
+/* create a pool keeping up to size idle handles */
+struct http_pool *http_pool_new(int size) {
     char *headers[] = {"Accept: application/json","Content-Type: application/json"};
-    return request_http(url, "GET", headers, 2, NULL);
+
+    pthread_once(&http_global_once, http_global_init);
+
+    struct http_pool *pool = (struct http_pool *) calloc(1, sizeof(struct http_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->size = size > 0 ? size : 1;
+    pool->idle = (CURL **) calloc(pool->size, sizeof(CURL *));
+    pool->share = curl_share_init();
+    pool->json_headers = init_headers(headers, 2);
+
+    if (pool->idle == NULL || pool->share == NULL || pool->json_headers == NULL) {
+        if (pool->share != NULL) {
+            curl_share_cleanup(pool->share);
+        }
+        curl_slist_free_all(pool->json_headers);
+        free(pool->idle);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&pool->share_locks[i], NULL);
+    }
+
+    /* share dns lookups and tls sessions; connections stay with the
+       handle that opened them, sharing them isn't safe across threads */
+    curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, http_share_lock);
+    curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+    curl_share_setopt(pool->share, CURLSHOPT_USERDATA, (void *) pool);
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    return pool;
+}
+
+/* close every connection of the pool and free it */
+void http_pool_free(struct http_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    /* the handles go first, the share can't be cleaned up while in use */
+    for (int i = 0; i < pool->idle_count; i++) {
+        curl_easy_cleanup(pool->idle[i]);
+    }
+
+    curl_share_cleanup(pool->share);
+    curl_slist_free_all(pool->json_headers);
+
+    pthread_mutex_destroy(&pool->lock);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&pool->share_locks[i]);
+    }
+
+    free(pool->idle);
+    free(pool);
+}
+
+/* take an idle handle, or a new one if there is none */
+static CURL *http_pool_acquire(struct http_pool *pool) {
+    CURL *handle = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count > 0) {
+        handle = pool->idle[--pool->idle_count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (handle == NULL) {
+        handle = curl_easy_init();
+        if (handle == NULL) {
+            return NULL;
+        }
+    }
+
+    /* the options every request has, set again as release resets them */
+    curl_easy_setopt(handle, CURLOPT_SHARE, pool->share);
+
+    /* set calback function */
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_http_response);
+
+    /* set timeout, without signals as there may be other threads */
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 5);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+
+    /* keep idle connections alive */
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1);
+
+    /* enable location redirects */
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
+
+    return handle;
+}
+
+/* put a handle back for the next request, keeping its connection open */
+static void http_pool_release(struct http_pool *pool, CURL *handle) {
+    /* forget the options of this request, but not the connection */
+    curl_easy_reset(handle);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count < pool->size) {
+        pool->idle[pool->idle_count++] = handle;
+        handle = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* more handles than the pool keeps were busy at once */
+    if (handle != NULL) {
+        curl_easy_cleanup(handle);
+    }
+}
+
+/* call http get with json content headers */
+char *get_http_json(struct http_pool *pool, const char *url) {
+    return request_http(pool, url, "GET", pool->json_headers, NULL);
 }
 
 /* call http delete */
-char *delete_http_json(const char *url) {
-    char *headers[] = {"Accept: application/json","Content-Type: application/json"};    
-    return request_http(url, "DELETE", headers, 2, NULL);
+char *delete_http_json(struct http_pool *pool, const char *url) {
+    return request_http(pool, url, "DELETE", pool->json_headers, NULL);
 }
 
 /* call http post with json content headers */
-char *post_http_json(const char *url, const char *body) {
-    char *headers[] = {"Accept: application/json","Content-Type: application/json"};
-    return request_http(url, "POST", headers, 2, body); 
+char *post_http_json(struct http_pool *pool, const char *url, const char *body) {
+    return request_http(pool, url, "POST", pool->json_headers, body); 
 }
 
 /* call http put with json content headers */
-char *put_http_json(const char *url, const char *body) {
-    char *headers[] = {"Accept: application/json","Content-Type: application/json"};
-    return request_http(url, "PUT", headers, 2, body); 
+char *put_http_json(struct http_pool *pool, const char *url, const char *body) {
+    return request_http(pool, url, "PUT", pool->json_headers, body); 
 }
 
 /* fetch and return url body via curl */
-char *request_http(const char *url, const char *action, char **headers, int headers_count, const char *body) {
+char *request_http(struct http_pool *pool, const char *url, const char *action, struct curl_slist *headers, const char *body) {
 
-    /* init curl handle */
-    CURL *handle = curl_easy_init();
+    /* take a curl handle from the pool */
+    CURL *handle = http_pool_acquire(pool);
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR: Failed to fetch url (%s) - no curl handle", url);
+        return "";
+    }
 
     struct http_payload curl_fetch;         /* curl fetch struct */
     struct http_payload *cf = &curl_fetch;  /* pointer to fetch struct */
@@ -53,7 +206,10 @@ char *request_http(const char *url, const char *action, char **headers, int head
     curl_easy_setopt(handle, CURLOPT_URL, url);
 
     /* set curl headers */
-    init_headers(handle, headers, headers_count);
+    if (headers != NULL)
+    {
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+    }
 
     /* set request body */
     if (body != NULL)
@@ -64,29 +220,24 @@ char *request_http(const char *url, const char *action, char **headers, int head
     /* set http action */
     curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, action);
 
-    /* set calback function */
-    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_http_response);
-
     /* pass fetch struct pointer */
     curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *) cf);
 
-    /* set timeout */
-    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 5);
-
-    /* enable location redirects */
-    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
-
     /* perform http request */
     int curl_result = curl_easy_perform(handle);
 
-    /* cleanup curl handle */
-    curl_easy_cleanup(handle);
+    /* hand the curl handle back */
+    http_pool_release(pool, handle);
 
     /* make the http request */
     if (curl_result != CURLE_OK || cf->size < 1) {
         /* log error */
         fprintf(stderr, "ERROR: Failed to fetch url (%s) - curl said: %s",
             url, curl_easy_strerror(curl_result));
+        /* drop whatever init_payload or a partial response allocated */
+        if (cf->payload != empty_payload) {
+            free(cf->payload);
+        }
         /* return error */
         return "";
     }
@@ -97,10 +248,14 @@ char *request_http(const char *url, const char *action, char **headers, int head
 
 int main_test(int argc, char *argv[]) {
 
-    printf("%s\n", get_http_json("http://google.com"));
+    struct http_pool *pool = http_pool_new(1);
+
+    printf("%s\n", get_http_json(pool, "http://google.com"));
 
     char *body = "{\"title\":\"testies\", \"body\":\"testies ... testies ... 1,2,3\", \"userId\":133}";
-    printf("%s\n", post_http_json("http://jsonplaceholder.typicode.com/posts/", body));
+    printf("%s\n", post_http_json(pool, "http://jsonplaceholder.typicode.com/posts/", body));
+
+    http_pool_free(pool);
 
     /* exit */
     return 0;
@@ -113,24 +268,27 @@ void init_payload(struct http_payload *body) {
 
     /* check payload */
     if (body->payload == NULL) {
-        body->payload = "";
+        body->payload = empty_payload;
     }
 
     /* init size */
     body->size = 0;
 }
 
-/* set headers from string array */
-void init_headers(CURL *handle, char **headers, int headers_count) {
+/* build a header list from string array */
+struct curl_slist *init_headers(char **headers, int headers_count) {
     struct curl_slist *curl_headers = NULL;
     for(int i=0;i<headers_count;i++)
     {
-        curl_headers = curl_slist_append(curl_headers, headers[i]);
-    }
-    if(curl_headers != NULL) 
-    {
-        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, curl_headers);
+        struct curl_slist *appended = curl_slist_append(curl_headers, headers[i]);
+        if (appended == NULL)
+        {
+            curl_slist_free_all(curl_headers);
+            return NULL;
+        }
+        curl_headers = appended;
     }
+    return curl_headers;
 }
 
 /* callback for curl fetch */
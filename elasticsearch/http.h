@@ -8,7 +8,6 @@
 
 #ifndef FUNCTIONS_H_INCLUDED
 #define FUNCTIONS_H_INCLUDED
-#endif
 
 #include <curl/curl.h>
 
@@ -18,35 +17,46 @@ struct http_payload {
     size_t size;
 };
 
+/* pool of curl handles that keep their connections open between
+   requests, and share DNS and TLS sessions with each other */
+struct http_pool;
+
+/* create a pool keeping up to size idle handles, NULL if out of memory */
+struct http_pool *http_pool_new(int size);
+
+/* close every connection of the pool and free it */
+void http_pool_free(struct http_pool *pool);
+
 /* function to write the response into the struct */
 size_t write_http_response (void *contents, 
     size_t size, 
     size_t nmemb, 
     void *userp);
 
-/* function to initialize headers from a string */
-void init_headers(CURL *handle, 
-    char **headers, 
+/* function to build a header list from strings, freed with curl_slist_free_all */
+struct curl_slist *init_headers(char **headers, 
     int headers_count);
 
 /* initialize the http payload */
 void init_payload (struct http_payload *body);
 
 /* make http request */
-char *request_http(const char *url, 
+char *request_http(struct http_pool *pool, 
+    const char *url, 
     const char *action, 
-    char **headers, 
-    int headers_count, 
+    struct curl_slist *headers, 
     const char *body);
 
 /* call http get with json content headers */
-char *get_http_json(const char *url);
+char *get_http_json(struct http_pool *pool, const char *url);
 
 /* call http delete */
-char *delete_http_json(const char *url);
+char *delete_http_json(struct http_pool *pool, const char *url);
 
 /* call http post with json content headers */
-char *post_http_json(const char *url, const char *body);
+char *post_http_json(struct http_pool *pool, const char *url, const char *body);
 
 /* call http put with json content headers */
-char *put_http_json(const char *url, const char *body);
\ No newline at end of file
+char *put_http_json(struct http_pool *pool, const char *url, const char *body);
+
+#endif
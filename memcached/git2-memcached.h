@@ -0,0 +1,131 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDE_git2_memcached_h__
+#define INCLUDE_git2_memcached_h__
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+int git_odb_backend_memcached(git_odb_backend **backend_out, const char *host, int port);
+
+/* one server of a memcached pool */
+typedef struct {
+	const char *host;
+	unsigned int port;
+
+	/* its share of the objects, relative to the other servers; 0 is 1 */
+	unsigned int weight;
+} git_odb_memcached_server;
+
+/*
+ * Spread objects over a pool of servers by ketama consistent hashing of
+ * their oid, so that a server coming or going only moves its own share.
+ * Every object is also stored on the next `replicas` servers, and read
+ * from any of them. A server that fails failure_limit times in a row is
+ * taken out of the pool and tried again later; 0 keeps it in.
+ */
+int git_odb_backend_memcached_servers(git_odb_backend **backend_out, const git_odb_memcached_server *servers,
+	size_t count, unsigned int replicas, unsigned int failure_limit);
+
+/* what git_odb_backend_memcached_read_many fetches for every object */
+typedef enum {
+	GIT_ODB_MEMCACHED_EXISTS = 0,
+	GIT_ODB_MEMCACHED_HEADER = 1,
+	GIT_ODB_MEMCACHED_DATA = 2,
+} git_odb_memcached_fetch_t;
+
+/*
+ * Called once for every distinct oid. type and len are set for
+ * GIT_ODB_MEMCACHED_HEADER and _DATA, and data, which is the callback's
+ * to free, for _DATA only. Returning non-zero stops the callbacks, and
+ * read_many returns that value.
+ */
+typedef int (*git_odb_memcached_read_cb)(const git_oid *oid, int found, git_otype type, size_t len,
+	void *data, void *payload);
+
+/*
+ * Look up many objects with one multi-get per few hundred of them on
+ * each server. Found objects are passed to cb as their replies come in,
+ * the ones that were missed after all replies are in.
+ */
+int git_odb_backend_memcached_read_many(git_odb_backend *backend, const git_oid *oids, size_t count,
+	git_odb_memcached_fetch_t what, git_odb_memcached_read_cb cb, void *payload);
+
+/*
+ * Objects over chunk_size bytes, by default a little under the 1MiB item
+ * size limit memcached starts with, are stored as several items of that
+ * size; 0 stores every object as one item, which fails for those the
+ * server can't take. Losing any one of the items loses the object.
+ */
+int git_odb_backend_memcached_chunking(git_odb_backend *backend, size_t chunk_size);
+
+/* called for every object written while warming that isn't on its server */
+typedef int (*git_odb_memcached_missing_cb)(const git_oid *oid, void *payload);
+
+/*
+ * Until warm_end, writes go out buffered and without waiting for the
+ * server to reply, so a batch of objects is written at the speed of the
+ * network. Errors the server would have replied with are lost meanwhile;
+ * warm_end sends what is still buffered and, given a callback, then looks
+ * up every object written since warm_begin and passes it those that
+ * didn't make it, to write again. Only the type of an object is looked
+ * up, so with chunking off one too big for the server isn't caught.
+ * Returning non-zero from the callback stops it, and warm_end returns
+ * that value. git_odb_write doesn't look the object up on the server
+ * first meanwhile, so every write goes out even if the object is there.
+ */
+int git_odb_backend_memcached_warm_begin(git_odb_backend *backend);
+int git_odb_backend_memcached_warm_end(git_odb_backend *backend, git_odb_memcached_missing_cb cb, void *payload);
+
+/* what a memcached odb cache has done since it was created */
+typedef struct {
+	size_t hits;
+	size_t misses;
+
+	/* objects copied into the cache after a miss or a write */
+	size_t fills;
+
+	/* objects not copied for being bigger than max_size */
+	size_t skipped;
+
+	/* cache reads and writes that failed, which are otherwise ignored */
+	size_t cache_errors;
+} git_odb_memcached_cache_stats;
+
+/*
+ * Put the memcached backend `cache` in front of any other backend:
+ * reads that miss the cache are served by `backing` and the object is
+ * copied into the cache, and with write_through every write goes to
+ * both. Objects over max_size bytes are never cached; 0 caches them all.
+ * Both backends belong to the new one from then on. The counters aren't
+ * locked, so with many threads they are only approximate.
+ */
+int git_odb_backend_memcached_cache(git_odb_backend **backend_out, git_odb_backend *cache,
+	git_odb_backend *backing, size_t max_size, int write_through);
+
+int git_odb_backend_memcached_cache_stats(git_odb_memcached_cache_stats *out, git_odb_backend *backend);
+
+#endif
@@ -24,15 +24,28 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <git2.h>
-#include "git2/odb_backend.h"
+#include <git2/sys/odb_backend.h>
 #include <libmemcached/memcached.h>
+#include "git2-memcached.h"
 
 typedef struct {
 	git_odb_backend parent;
 	memcached_st *db;
+
+	// objects bigger than this are split up, see memcached_backend__write_chunks
+	size_t chunk_size;
+
+	// set between git_odb_backend_memcached_warm_begin and _end, which
+	// check the objects written meanwhile once they are all out
+	int warming;
+	uint64_t noreply, buffering;
+	git_oid *warmed;
+	size_t warmed_count, warmed_alloc, unflushed;
 } memcached_backend;
 
 // Since memcached is just a key/value store, we'll use key suffixes
@@ -48,203 +61,887 @@ static const char *size_suffix = ":size";
 // the raw object data
 static const char *data_suffix = ":data";
 
-static char *memcached_backend__build_key(const unsigned char *id, const char *suffix, size_t *out_len)
+// one piece of an object too big for a single item, see below
+static const char *chunk_suffix = ":c";
+
+// every key is the raw oid followed by one of the suffixes above; the oid
+// alone is the group key that picks the server, so that all keys of an
+// object live on the same one and losing a server loses whole objects only
+#define MEMCACHED_SUFFIX_LEN 5
+#define MEMCACHED_KEY_LEN (GIT_OID_RAWSZ + MEMCACHED_SUFFIX_LEN)
+
+// the most fields one operation asks for at once
+#define MEMCACHED_MAX_FIELDS 2
+
+// chunk keys are the raw oid, the suffix, and the chunk size and index big-endian
+#define MEMCACHED_CHUNK_SUFFIX_LEN 2
+#define MEMCACHED_CHUNK_KEY_LEN (GIT_OID_RAWSZ + MEMCACHED_CHUNK_SUFFIX_LEN + 8)
+
+// the default item size limit is 1MiB, which has to hold the key and the item header too
+#define MEMCACHED_CHUNK_SIZE (1000 * 1024)
+
+// seconds before a server taken off the ring for failing is tried again
+#define MEMCACHED_RETRY_SECONDS 30
+
+// item flags of :data
+#define MEMCACHED_FLAG_CHUNKED 0x01
+
+// objects written while warming before the buffered requests are sent
+#define MEMCACHED_WARM_FLUSH 256
+
+typedef struct {
+	uint64_t len;
+	uint32_t chunk_size;
+	uint32_t count;
+} memcached_chunk_manifest;
+
+static int memcached_backend__error(memcached_backend *backend, memcached_return ret)
 {
-	char *new_key;
+	giterr_set_str(GITERR_ODB, memcached_strerror(backend->db, ret));
+	return GIT_ERROR;
+}
 
-	*out_len = 20+strlen(suffix);
-	new_key = malloc(*out_len);
-	if (!new_key)
-		return NULL;
+static int memcached_backend__corrupted(void)
+{
+	giterr_set_str(GITERR_ODB, "Memcached odb storage corrupted");
+	return GIT_ERROR;
+}
 
-	memcpy(new_key, id, 20);
-	memcpy(new_key+20, suffix, strlen(suffix));
+static int memcached_backend__not_found(void)
+{
+	giterr_set_str(GITERR_ODB, "Memcached odb couldn't find object");
+	return GIT_ENOTFOUND;
+}
 
-	return new_key;
+static void memcached_backend__build_key(char *key, const git_oid *oid, const char *suffix)
+{
+	memcpy(key, oid->id, GIT_OID_RAWSZ);
+	memcpy(key + GIT_OID_RAWSZ, suffix, MEMCACHED_SUFFIX_LEN);
 }
 
-int memcached_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+static void memcached_backend__free_values(char **values, size_t count)
 {
-	memcached_backend *backend;
-	memcached_return ret = 0;
-	char *type_key, *size_key;
-	size_t type_key_len, type_value_len, size_key_len, *size_value, size_value_len;
-	uint32_t type_flags, size_flags;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(values[i]);
+		values[i] = NULL;
+	}
+}
+
+// fetch several fields of one object with a single multi-get, which the
+// binary protocol sends as one pipelined burst; values[i] is left NULL for
+// a field that wasn't found, and is otherwise malloc'd and owned by the caller
+// along with its length and item flags
+static int memcached_backend__fetch(memcached_backend *backend, const git_oid *oid,
+	const char **suffixes, size_t count, char **values, size_t *lengths, uint32_t *flags)
+{
+	char keys[MEMCACHED_MAX_FIELDS][MEMCACHED_KEY_LEN];
+	const char *key_ptrs[MEMCACHED_MAX_FIELDS];
+	size_t key_lens[MEMCACHED_MAX_FIELDS];
+	memcached_result_st result;
+	memcached_return ret;
+	const char *key;
+	size_t i;
 	int status;
 
-	assert(len_p && type_p && _backend && oid);
+	assert(count <= MEMCACHED_MAX_FIELDS);
 
-	backend = (memcached_backend *)_backend;
+	for (i = 0; i < count; i++) {
+		memcached_backend__build_key(keys[i], oid, suffixes[i]);
+		key_ptrs[i] = keys[i];
+		key_lens[i] = MEMCACHED_KEY_LEN;
+		values[i] = NULL;
+		lengths[i] = 0;
+		flags[i] = 0;
+	}
+
+	ret = memcached_mget_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ, key_ptrs, key_lens, count);
+	if (ret != MEMCACHED_SUCCESS)
+		return memcached_backend__error(backend, ret);
+
+	if (memcached_result_create(backend->db, &result) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	status = GIT_OK;
+
+	// always read every reply, or the next request on the connection would get them
+	while (memcached_fetch_result(backend->db, &result, &ret) != NULL) {
+		if (status != GIT_OK || memcached_result_key_length(&result) != MEMCACHED_KEY_LEN)
+			continue;
 
-	type_key = memcached_backend__build_key(oid->id, type_suffix, &type_key_len);
-	if (type_key == NULL)
-		return GIT_ENOMEM;
+		key = memcached_result_key_value(&result);
 
-	size_key = memcached_backend__build_key(oid->id, size_suffix, &size_key_len);
-	if (size_key == NULL)
-		return GIT_ENOMEM;
+		for (i = 0; i < count; i++) {
+			if (values[i] != NULL || memcmp(key, keys[i], MEMCACHED_KEY_LEN) != 0)
+				continue;
 
+			lengths[i] = memcached_result_length(&result);
+			flags[i] = memcached_result_flags(&result);
+			values[i] = memcached_result_take_value(&result);
 
-	memset(type_p, 0, sizeof(type_p));
-	type_p = (git_otype *)memcached_get(backend->db, type_key, type_key_len, &type_value_len, &type_flags, &ret);
-	if (type_p == NULL) {
-		status = GIT_ENOTFOUND;
-		goto read_header_cleanup;
+			// an empty value has no buffer to take
+			if (values[i] == NULL)
+				values[i] = calloc(1, 1);
+			if (values[i] == NULL) {
+				giterr_set_oom();
+				status = GIT_ERROR;
+			}
+
+			break;
+		}
 	}
 
-	memset(size_value, 0, sizeof(size_value));
-	memset(len_p, 0, sizeof(len_p));
-	size_value = (size_t *)memcached_get(backend->db, size_key, size_key_len, &size_value_len, &size_flags, &ret);
-	if (size_value == NULL) {
-		if (type_p)
-			free(type_p);
+	memcached_result_free(&result);
 
-		status = GIT_ENOTFOUND;
-	} else {
-		*len_p = *size_value;
-		status = GIT_SUCCESS;
+	if (status == GIT_OK && ret != MEMCACHED_END && ret != MEMCACHED_NOTFOUND && ret != MEMCACHED_SUCCESS)
+		status = memcached_backend__error(backend, ret);
+
+	if (status != GIT_OK)
+		memcached_backend__free_values(values, count);
+
+	return status;
+}
+
+// Objects bigger than what fits in one item are stored as chunks of
+// chunk_size bytes under keys of their own, and :data holds a manifest
+// instead, marked by MEMCACHED_FLAG_CHUNKED. Chunk keys name the chunk
+// size, so objects written with different sizes can't be mixed up.
+
+static void memcached_backend__build_chunk_key(char *key, const git_oid *oid, uint32_t chunk_size, uint32_t index)
+{
+	size_t i;
+
+	memcpy(key, oid->id, GIT_OID_RAWSZ);
+	memcpy(key + GIT_OID_RAWSZ, chunk_suffix, MEMCACHED_CHUNK_SUFFIX_LEN);
+
+	for (i = 0; i < 4; i++) {
+		key[MEMCACHED_CHUNK_KEY_LEN - 8 + i] = (char)(chunk_size >> (24 - 8 * i));
+		key[MEMCACHED_CHUNK_KEY_LEN - 4 + i] = (char)(index >> (24 - 8 * i));
+	}
+}
+
+// drop every key of an object, so that it reads as missing
+static void memcached_backend__invalidate(memcached_backend *backend, const git_oid *oid)
+{
+	char key[MEMCACHED_KEY_LEN];
+
+	memcached_backend__build_key(key, oid, type_suffix);
+	memcached_delete_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ, key, MEMCACHED_KEY_LEN, 0);
+	memcached_backend__build_key(key, oid, size_suffix);
+	memcached_delete_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ, key, MEMCACHED_KEY_LEN, 0);
+	memcached_backend__build_key(key, oid, data_suffix);
+	memcached_delete_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ, key, MEMCACHED_KEY_LEN, 0);
+}
+
+// all chunks in one multi-get; a chunk that was evicted makes the whole
+// object a miss, and it is dropped so that the next lookup doesn't try again
+static int memcached_backend__read_chunks(void **data_p, size_t *len_p, memcached_backend *backend,
+	const git_oid *oid, const char *manifest_value, size_t manifest_len)
+{
+	memcached_chunk_manifest manifest;
+	memcached_result_st result;
+	memcached_return ret;
+	char (*keys)[MEMCACHED_CHUNK_KEY_LEN];
+	const char **key_ptrs;
+	size_t *key_lens, i, offset, expected, received;
+	unsigned char *got;
+	const char *key;
+	char *data;
+	uint32_t index;
+	int status;
+
+	if (manifest_len != sizeof(manifest))
+		return memcached_backend__corrupted();
+
+	memcpy(&manifest, manifest_value, sizeof(manifest));
+
+	if (manifest.chunk_size == 0 || manifest.count == 0 ||
+		(manifest.len + manifest.chunk_size - 1) / manifest.chunk_size != manifest.count)
+		return memcached_backend__corrupted();
+
+	keys = malloc(manifest.count * MEMCACHED_CHUNK_KEY_LEN);
+	key_ptrs = malloc(manifest.count * sizeof(char *));
+	key_lens = malloc(manifest.count * sizeof(size_t));
+	got = calloc(manifest.count, 1);
+	data = malloc(manifest.len);
+
+	status = GIT_ERROR;
+	if (keys == NULL || key_ptrs == NULL || key_lens == NULL || got == NULL || data == NULL) {
+		giterr_set_oom();
+		goto cleanup;
 	}
 
-read_header_cleanup:
-	free(type_key);
-	free(size_key);
+	for (i = 0; i < manifest.count; i++) {
+		memcached_backend__build_chunk_key(keys[i], oid, manifest.chunk_size, (uint32_t)i);
+		key_ptrs[i] = keys[i];
+		key_lens[i] = MEMCACHED_CHUNK_KEY_LEN;
+	}
+
+	ret = memcached_mget_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ, key_ptrs, key_lens, manifest.count);
+	if (ret != MEMCACHED_SUCCESS) {
+		memcached_backend__error(backend, ret);
+		goto cleanup;
+	}
+
+	if (memcached_result_create(backend->db, &result) == NULL) {
+		giterr_set_oom();
+		goto cleanup;
+	}
+
+	received = 0;
+
+	while (memcached_fetch_result(backend->db, &result, &ret) != NULL) {
+		if (memcached_result_key_length(&result) != MEMCACHED_CHUNK_KEY_LEN)
+			continue;
+
+		key = memcached_result_key_value(&result);
+		index = 0;
+		for (i = 0; i < 4; i++)
+			index = (index << 8) | (unsigned char)key[MEMCACHED_CHUNK_KEY_LEN - 4 + i];
+
+		if (index >= manifest.count || got[index] ||
+			memcmp(key, keys[index], MEMCACHED_CHUNK_KEY_LEN) != 0)
+			continue;
+
+		offset = (size_t)index * manifest.chunk_size;
+		expected = index == manifest.count - 1 ? manifest.len - offset : manifest.chunk_size;
+		if (memcached_result_length(&result) != expected)
+			continue;
+
+		memcpy(data + offset, memcached_result_value(&result), expected);
+		got[index] = 1;
+		received++;
+	}
+
+	memcached_result_free(&result);
+
+	if (ret != MEMCACHED_END && ret != MEMCACHED_NOTFOUND && ret != MEMCACHED_SUCCESS) {
+		memcached_backend__error(backend, ret);
+		goto cleanup;
+	}
+
+	if (received != manifest.count) {
+		memcached_backend__invalidate(backend, oid);
+		status = memcached_backend__not_found();
+		goto cleanup;
+	}
+
+	*data_p = data;
+	*len_p = manifest.len;
+	data = NULL;
+	status = GIT_OK;
+
+cleanup:
+	free(keys);
+	free(key_ptrs);
+	free(key_lens);
+	free(got);
+	free(data);
 	return status;
 }
 
-int memcached_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+// the chunks go out buffered, as one burst with no waiting on each reply;
+// one that didn't make it is caught by read_chunks
+static int memcached_backend__write_chunks(memcached_chunk_manifest *manifest, memcached_backend *backend,
+	const git_oid *oid, const void *data, size_t len)
+{
+	char key[MEMCACHED_CHUNK_KEY_LEN];
+	memcached_return ret;
+	uint64_t buffering;
+	size_t offset, chunk;
+	uint32_t index;
+	int status;
+
+	manifest->len = len;
+	manifest->chunk_size = (uint32_t)backend->chunk_size;
+	manifest->count = (uint32_t)((len + backend->chunk_size - 1) / backend->chunk_size);
+
+	buffering = memcached_behavior_get(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+
+	status = GIT_OK;
+
+	for (index = 0, offset = 0; offset < len; index++, offset += chunk) {
+		chunk = len - offset < backend->chunk_size ? len - offset : backend->chunk_size;
+
+		memcached_backend__build_chunk_key(key, oid, manifest->chunk_size, index);
+		ret = memcached_set_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ,
+			key, MEMCACHED_CHUNK_KEY_LEN, (const char *)data + offset, chunk, 0, 0);
+		if (ret != MEMCACHED_SUCCESS && ret != MEMCACHED_BUFFERED) {
+			status = memcached_backend__error(backend, ret);
+			break;
+		}
+	}
+
+	ret = memcached_flush_buffers(backend->db);
+	if (ret != MEMCACHED_SUCCESS && status == GIT_OK)
+		status = memcached_backend__error(backend, ret);
+
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, buffering);
+	return status;
+}
+
+int memcached_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
 {
+	const char *suffixes[] = { type_suffix, size_suffix };
+
 	memcached_backend *backend;
-	memcached_return ret = 0;
-	char *type_key, *data_key;
-	size_t type_key_len, data_key_len, type_value_len;
-	uint32_t type_flags, data_flags;
+	char *values[2];
+	size_t lengths[2];
+	uint32_t flags[2];
 	int status;
-	void *type_buffer, *data_buffer;
 
-	assert(data_p && len_p && type_p && _backend && oid);
+	assert(len_p && type_p && _backend && oid);
 
 	backend = (memcached_backend *)_backend;
 
-	type_key = memcached_backend__build_key(oid->id, type_suffix, &type_key_len);
-	if (type_key == NULL)
-		return GIT_ENOMEM;
+	status = memcached_backend__fetch(backend, oid, suffixes, 2, values, lengths, flags);
+	if (status != GIT_OK)
+		return status;
 
-	data_key = memcached_backend__build_key(oid->id, data_suffix, &data_key_len);
-	if (data_key == NULL)
-		return GIT_ENOMEM;
+	if (values[0] == NULL || values[1] == NULL) {
+		status = memcached_backend__not_found();
+	} else if (lengths[0] != sizeof(git_otype) || lengths[1] != sizeof(size_t)) {
+		status = memcached_backend__corrupted();
+	} else {
+		memcpy(type_p, values[0], sizeof(git_otype));
+		memcpy(len_p, values[1], sizeof(size_t));
+		status = GIT_OK;
+	}
 
+	memcached_backend__free_values(values, 2);
+	return status;
+}
 
-	type_buffer = (void *)memcached_get(backend->db, type_key, type_key_len, &type_value_len, &type_flags, &ret);
-	if (type_buffer == NULL) {
-		status = GIT_ENOTFOUND;
-		goto read_cleanup;
-	}
+int memcached_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	const char *suffixes[] = { type_suffix, data_suffix };
+
+	memcached_backend *backend;
+	char *values[2];
+	size_t lengths[2];
+	uint32_t flags[2];
+	int status;
 
-	data_buffer = (void *)memcached_get(backend->db, data_key, data_key_len, len_p, &data_flags, &ret);
-	if (data_buffer == NULL && *len_p > 0) {
+	assert(data_p && len_p && type_p && _backend && oid);
 
-		if (type_buffer)
-			free(type_buffer);
+	backend = (memcached_backend *)_backend;
 
-		status = GIT_ENOTFOUND;
-	} else {
-		*type_p = *(git_otype *)type_buffer;
-		free(type_buffer);
+	status = memcached_backend__fetch(backend, oid, suffixes, 2, values, lengths, flags);
+	if (status != GIT_OK)
+		return status;
 
-		*data_p = data_buffer;
-		status = GIT_SUCCESS;
+	if (values[0] == NULL || values[1] == NULL) {
+		status = memcached_backend__not_found();
+	} else if (lengths[0] != sizeof(git_otype)) {
+		status = memcached_backend__corrupted();
+	} else if (flags[1] & MEMCACHED_FLAG_CHUNKED) {
+		memcpy(type_p, values[0], sizeof(git_otype));
+		status = memcached_backend__read_chunks(data_p, len_p, backend, oid, values[1], lengths[1]);
+	} else {
+		memcpy(type_p, values[0], sizeof(git_otype));
+		*data_p = values[1];
+		*len_p = lengths[1];
+		values[1] = NULL;
+		status = GIT_OK;
 	}
 
-read_cleanup:
-	free(type_key);
-	free(data_key);
+	memcached_backend__free_values(values, 2);
 	return status;
 }
 
 int memcached_backend__exists(git_odb_backend *_backend, const git_oid *oid)
 {
+	const char *suffixes[] = { type_suffix };
+
 	memcached_backend *backend;
-	memcached_return ret = 0;
+	char *value;
+	size_t length;
+	uint32_t flags;
 	int found;
-	char *type_key;
-	size_t type_key_len;
 
 	assert(_backend && oid);
 
 	backend = (memcached_backend *)_backend;
-	found = 0;
 
-	type_key = memcached_backend__build_key(oid->id, type_suffix, &type_key_len);
-	if (type_key == NULL)
-		return GIT_ENOMEM;
+	// only a read can tell; probing with an ADD, as this used to, left an
+	// empty :type behind for every object that wasn't there
+	if (memcached_backend__fetch(backend, oid, suffixes, 1, &value, &length, &flags) != GIT_OK)
+		return 0;
 
-	// use the ADD command with a value of zero length to check for the existence of a key
-	// this is because it will let us know if the key already exists
-	// and do nothing in that case.
-	// we use SET for storing the object so this zero-length value will be overwritten
-	// by the actual value we want to store
-	ret = memcached_add(backend->db, type_key, type_key_len, "", 0, 0, 0);
-	if (ret == MEMCACHED_DATA_EXISTS) {
-		// object exists
-		found = 1;
-	}
+	found = value != NULL;
+	free(value);
 
-	free(type_key);
 	return found;
 }
 
-int memcached_backend__write(git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+// git_odb_write asks before every write whether the object is there
+// already. While warming that would wait on the server once per object,
+// so the answer is no: writing an object again is harmless, and warm_end
+// checks what was written anyway. Otherwise it is just exists.
+int memcached_backend__freshen(git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_backend *backend;
+
+	assert(_backend && oid);
+
+	backend = (memcached_backend *)_backend;
+
+	if (backend->warming)
+		return GIT_ENOTFOUND;
+
+	return memcached_backend__exists(_backend, oid) ? GIT_OK : GIT_ENOTFOUND;
+}
+
+// remember an object written while warming, for warm_end to check, and
+// send what has been buffered every so often
+static int memcached_backend__warmed(memcached_backend *backend, const git_oid *oid)
+{
+	memcached_return ret;
+	git_oid *warmed;
+	size_t alloc;
+
+	if (backend->warmed_count == backend->warmed_alloc) {
+		alloc = backend->warmed_alloc ? backend->warmed_alloc * 2 : MEMCACHED_WARM_FLUSH;
+		warmed = realloc(backend->warmed, alloc * sizeof(git_oid));
+		if (warmed == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		backend->warmed = warmed;
+		backend->warmed_alloc = alloc;
+	}
+
+	git_oid_cpy(&backend->warmed[backend->warmed_count++], oid);
+
+	if (++backend->unflushed < MEMCACHED_WARM_FLUSH)
+		return GIT_OK;
+
+	backend->unflushed = 0;
+
+	ret = memcached_flush_buffers(backend->db);
+	if (ret != MEMCACHED_SUCCESS)
+		return memcached_backend__error(backend, ret);
+
+	return GIT_OK;
+}
+
+int memcached_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
 {
 	memcached_backend *backend;
 	memcached_return ret = 0;
-	char *type_key, *size_key, *data_key;
-	size_t type_key_len, size_key_len, data_key_len;
+	memcached_chunk_manifest manifest;
+	char type_key[MEMCACHED_KEY_LEN], size_key[MEMCACHED_KEY_LEN], data_key[MEMCACHED_KEY_LEN];
 	int status;
 
 	assert(oid && _backend && data);
 
 	backend = (memcached_backend *)_backend;
 
-	if ((status = git_odb_hash(oid, data, len, type)) < 0)
+	memcached_backend__build_key(type_key, oid, type_suffix);
+	memcached_backend__build_key(size_key, oid, size_suffix);
+	memcached_backend__build_key(data_key, oid, data_suffix);
+
+	// the chunks go first, then :data pointing at them, and :type last:
+	// that is the one exists looks at, so an object isn't found before
+	// the rest of it is there
+	if (backend->chunk_size > 0 && len > backend->chunk_size &&
+		(status = memcached_backend__write_chunks(&manifest, backend, oid, data, len)) != GIT_OK)
 		return status;
 
-	type_key = memcached_backend__build_key(oid->id, type_suffix, &type_key_len);
-	if (type_key == NULL)
-		return GIT_ENOMEM;
+	if (backend->chunk_size > 0 && len > backend->chunk_size)
+		ret = memcached_set_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ,
+			data_key, MEMCACHED_KEY_LEN, (const char *)&manifest, sizeof(manifest), 0, MEMCACHED_FLAG_CHUNKED);
+	else
+		ret = memcached_set_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ,
+			data_key, MEMCACHED_KEY_LEN, (const char *)data, len, 0, 0);
 
-	size_key = memcached_backend__build_key(oid->id, size_suffix, &size_key_len);
-	if (size_key == NULL)
-		return GIT_ENOMEM;
+	if (ret != MEMCACHED_SUCCESS && ret != MEMCACHED_BUFFERED)
+		return memcached_backend__error(backend, ret);
 
-	data_key = memcached_backend__build_key(oid->id, data_suffix, &data_key_len);
-	if (data_key == NULL)
-		return GIT_ENOMEM;
+	ret = memcached_set_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ,
+		size_key, MEMCACHED_KEY_LEN, (const char *)&len, sizeof(len), 0, 0);
+	if (ret != MEMCACHED_SUCCESS && ret != MEMCACHED_BUFFERED)
+		return memcached_backend__error(backend, ret);
 
+	ret = memcached_set_by_key(backend->db, (const char *)oid->id, GIT_OID_RAWSZ,
+		type_key, MEMCACHED_KEY_LEN, (const char *)&type, sizeof(type), 0, 0);
+	if (ret != MEMCACHED_SUCCESS && ret != MEMCACHED_BUFFERED)
+		return memcached_backend__error(backend, ret);
 
-	ret = memcached_set(backend->db, type_key, type_key_len, (const char *)&type, sizeof(type), 0, 0);
-	if (ret != MEMCACHED_SUCCESS) {
-		status = GIT_ERROR;
-		goto write_cleanup;
+	if (backend->warming)
+		return memcached_backend__warmed(backend, oid);
+
+	return GIT_OK;
+}
+
+// Batch reads: the oids are grouped by the server they live on, as a
+// multi-get by group key only goes to one, and within the group sorted
+// and deduplicated so that the replies, which come back in whatever order
+// the server sends them, can be matched to their object with a binary
+// search.
+
+// the most oids fetched with one multi-get
+#define MEMCACHED_BATCH_OIDS 512
+
+#define MEMCACHED_HAVE_TYPE 0x01
+#define MEMCACHED_HAVE_SIZE 0x02
+#define MEMCACHED_HAVE_DATA 0x04
+
+typedef struct {
+	git_oid oid;
+	memcached_server_instance_st server;
+	git_otype type;
+	size_t len;
+	char *data;
+	unsigned int have;
+	int chunked;
+	int reported;
+} memcached_batch_entry;
+
+typedef struct {
+	memcached_batch_entry *entries;
+	size_t count;
+	unsigned int wanted;
+	git_odb_memcached_read_cb cb;
+	void *payload;
+	int error;
+} memcached_batch;
+
+static int memcached_backend__batch_compare(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const memcached_batch_entry *)a)->oid, &((const memcached_batch_entry *)b)->oid);
+}
+
+static int memcached_backend__batch_server_compare(const void *_a, const void *_b)
+{
+	const memcached_batch_entry *a = _a, *b = _b;
+
+	if (a->server != b->server)
+		return (uintptr_t)a->server < (uintptr_t)b->server ? -1 : 1;
+
+	return git_oid_cmp(&a->oid, &b->oid);
+}
+
+static void memcached_backend__batch_report(memcached_batch *batch, memcached_batch_entry *entry, int found)
+{
+	entry->reported = 1;
+
+	if (batch->error == 0)
+		batch->error = batch->cb(&entry->oid, found, entry->type, entry->len, entry->data, batch->payload);
+	else
+		free(entry->data);
+
+	entry->data = NULL;
+}
+
+static memcached_return memcached_backend__batch_result(const memcached_st *db, memcached_result_st *result, void *context)
+{
+	memcached_batch *batch = context;
+	memcached_batch_entry key, *entry;
+	const char *suffix;
+	size_t length;
+
+	if (memcached_result_key_length(result) != MEMCACHED_KEY_LEN)
+		return MEMCACHED_SUCCESS;
+
+	memcpy(key.oid.id, memcached_result_key_value(result), GIT_OID_RAWSZ);
+	suffix = memcached_result_key_value(result) + GIT_OID_RAWSZ;
+	length = memcached_result_length(result);
+
+	entry = bsearch(&key, batch->entries, batch->count, sizeof(memcached_batch_entry), &memcached_backend__batch_compare);
+	if (entry == NULL || entry->reported)
+		return MEMCACHED_SUCCESS;
+
+	if (memcmp(suffix, type_suffix, MEMCACHED_SUFFIX_LEN) == 0 && length == sizeof(git_otype)) {
+		memcpy(&entry->type, memcached_result_value(result), sizeof(git_otype));
+		entry->have |= MEMCACHED_HAVE_TYPE;
+	} else if (memcmp(suffix, size_suffix, MEMCACHED_SUFFIX_LEN) == 0 && length == sizeof(size_t)) {
+		memcpy(&entry->len, memcached_result_value(result), sizeof(size_t));
+		entry->have |= MEMCACHED_HAVE_SIZE;
+	} else if (memcmp(suffix, data_suffix, MEMCACHED_SUFFIX_LEN) == 0 && entry->data == NULL) {
+		entry->data = memcached_result_take_value(result);
+		if (entry->data == NULL)
+			entry->data = calloc(1, 1);
+		if (entry->data == NULL)
+			return MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+
+		entry->len = length;
+		entry->chunked = (memcached_result_flags(result) & MEMCACHED_FLAG_CHUNKED) != 0;
+		entry->have |= MEMCACHED_HAVE_DATA;
 	}
 
-	ret = memcached_set(backend->db, size_key, size_key_len, (const char *)&len, sizeof(len), 0, 0);
-	if (ret != MEMCACHED_SUCCESS) {
-		status = GIT_ERROR;
-		goto write_cleanup;
+	// chunked objects are put together once the multi-get is done
+	if ((entry->have & batch->wanted) == batch->wanted && !entry->chunked)
+		memcached_backend__batch_report(batch, entry, 1);
+
+	return MEMCACHED_SUCCESS;
+}
+
+static int memcached_backend__batch_fetch(memcached_backend *backend, memcached_batch *batch)
+{
+	memcached_execute_fn callbacks[] = { &memcached_backend__batch_result };
+	const char *suffixes[2];
+	char (*keys)[MEMCACHED_KEY_LEN];
+	const char **key_ptrs;
+	size_t *key_lens, fields, count, i, j;
+	memcached_return ret;
+	int status;
+
+	fields = 0;
+	suffixes[fields++] = type_suffix;
+	if (batch->wanted & MEMCACHED_HAVE_SIZE)
+		suffixes[fields++] = size_suffix;
+	if (batch->wanted & MEMCACHED_HAVE_DATA)
+		suffixes[fields++] = data_suffix;
+
+	count = batch->count * fields;
+	keys = malloc(count * MEMCACHED_KEY_LEN);
+	key_ptrs = malloc(count * sizeof(char *));
+	key_lens = malloc(count * sizeof(size_t));
+
+	status = GIT_ERROR;
+	if (keys == NULL || key_ptrs == NULL || key_lens == NULL) {
+		giterr_set_oom();
+		goto cleanup;
 	}
 
-	ret = memcached_set(backend->db, data_key, data_key_len, (const char *)data, len, 0, 0);
+	for (i = 0; i < batch->count; i++) {
+		for (j = 0; j < fields; j++) {
+			memcached_backend__build_key(keys[i * fields + j], &batch->entries[i].oid, suffixes[j]);
+			key_ptrs[i * fields + j] = keys[i * fields + j];
+			key_lens[i * fields + j] = MEMCACHED_KEY_LEN;
+		}
+	}
+
+	ret = memcached_mget_by_key(backend->db, (const char *)batch->entries[0].oid.id, GIT_OID_RAWSZ,
+		key_ptrs, key_lens, count);
 	if (ret != MEMCACHED_SUCCESS) {
-		status = GIT_ERROR;
-		goto write_cleanup;
+		memcached_backend__error(backend, ret);
+		goto cleanup;
+	}
+
+	ret = memcached_fetch_execute(backend->db, callbacks, batch, 1);
+	if (ret != MEMCACHED_SUCCESS && ret != MEMCACHED_END && ret != MEMCACHED_NOTFOUND) {
+		memcached_backend__error(backend, ret);
+		goto cleanup;
+	}
+
+	status = GIT_OK;
+
+cleanup:
+	free(keys);
+	free(key_ptrs);
+	free(key_lens);
+	return status;
+}
+
+int git_odb_backend_memcached_read_many(git_odb_backend *_backend, const git_oid *oids, size_t count,
+	git_odb_memcached_fetch_t what, git_odb_memcached_read_cb cb, void *payload)
+{
+	memcached_backend *backend;
+	memcached_batch_entry *entries, *entry;
+	memcached_batch batch;
+	memcached_return ret;
+	size_t unique, done, i, len;
+	void *data;
+	int status;
+
+	assert(_backend && cb && (oids || !count));
+
+	backend = (memcached_backend *)_backend;
+
+	entries = calloc(count ? count : 1, sizeof(memcached_batch_entry));
+	if (entries == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < count; i++)
+		git_oid_cpy(&entries[i].oid, &oids[i]);
+
+	qsort(entries, count, sizeof(memcached_batch_entry), &memcached_backend__batch_compare);
+
+	for (unique = 0, i = 0; i < count; i++) {
+		if (unique == 0 || git_oid_cmp(&entries[unique - 1].oid, &entries[i].oid) != 0)
+			entries[unique++] = entries[i];
+	}
+
+	for (i = 0; i < unique; i++) {
+		entries[i].server = memcached_server_by_key(backend->db, (const char *)entries[i].oid.id, GIT_OID_RAWSZ, &ret);
+		if (entries[i].server == NULL) {
+			free(entries);
+			return memcached_backend__error(backend, ret);
+		}
+	}
+
+	qsort(entries, unique, sizeof(memcached_batch_entry), &memcached_backend__batch_server_compare);
+
+	memset(&batch, 0, sizeof(batch));
+	batch.cb = cb;
+	batch.payload = payload;
+	batch.wanted = MEMCACHED_HAVE_TYPE;
+	if (what == GIT_ODB_MEMCACHED_HEADER)
+		batch.wanted |= MEMCACHED_HAVE_SIZE;
+	else if (what == GIT_ODB_MEMCACHED_DATA)
+		batch.wanted |= MEMCACHED_HAVE_DATA;
+
+	status = GIT_OK;
+
+	for (done = 0; done < unique && status == GIT_OK && batch.error == 0; done += batch.count) {
+		batch.entries = entries + done;
+		batch.count = 1;
+		while (done + batch.count < unique && batch.count < MEMCACHED_BATCH_OIDS &&
+			batch.entries[batch.count].server == batch.entries[0].server)
+			batch.count++;
+
+		status = memcached_backend__batch_fetch(backend, &batch);
+
+		for (i = 0; i < batch.count && status == GIT_OK && batch.error == 0; i++) {
+			entry = &batch.entries[i];
+			if (entry->reported || (entry->have & batch.wanted) != batch.wanted)
+				continue;
+
+			status = memcached_backend__read_chunks(&data, &len, backend, &entry->oid, entry->data, entry->len);
+			free(entry->data);
+			entry->data = NULL;
+
+			if (status == GIT_OK) {
+				entry->data = data;
+				entry->len = len;
+				memcached_backend__batch_report(&batch, entry, 1);
+			} else if (status == GIT_ENOTFOUND) {
+				status = GIT_OK;
+			}
+		}
+
+		// misses are only known once every reply is in
+		for (i = 0; i < batch.count; i++) {
+			entry = &batch.entries[i];
+			if (entry->reported)
+				continue;
+
+			if (status == GIT_OK) {
+				entry->type = GIT_OBJ_BAD;
+				entry->len = 0;
+				memcached_backend__batch_report(&batch, entry, 0);
+			} else {
+				free(entry->data);
+			}
+		}
+	}
+
+	free(entries);
+
+	return status != GIT_OK ? status : batch.error;
+}
+
+int git_odb_backend_memcached_chunking(git_odb_backend *_backend, size_t chunk_size)
+{
+	memcached_backend *backend;
+
+	assert(_backend);
+
+	if (chunk_size > UINT32_MAX) {
+		giterr_set_str(GITERR_INVALID, "Memcached odb chunk size is too big");
+		return GIT_ERROR;
+	}
+
+	backend = (memcached_backend *)_backend;
+	backend->chunk_size = chunk_size;
+
+	return GIT_OK;
+}
+
+// Warming: the sets go out buffered and without asking for a reply, so
+// writing a batch of objects costs what sending them does rather than
+// three round trips each. A set the server turned down goes unnoticed
+// that way, hence the check of every object written once it's over.
+
+int git_odb_backend_memcached_warm_begin(git_odb_backend *_backend)
+{
+	memcached_backend *backend;
+
+	assert(_backend);
+
+	backend = (memcached_backend *)_backend;
+
+	if (backend->warming) {
+		giterr_set_str(GITERR_INVALID, "Memcached odb is already warming");
+		return GIT_ERROR;
+	}
+
+	backend->noreply = memcached_behavior_get(backend->db, MEMCACHED_BEHAVIOR_NOREPLY);
+	backend->buffering = memcached_behavior_get(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+
+	backend->warming = 1;
+	backend->warmed_count = 0;
+	backend->unflushed = 0;
+
+	return GIT_OK;
+}
+
+typedef struct {
+	git_odb_memcached_missing_cb cb;
+	void *payload;
+} memcached_warm_check;
+
+static int memcached_backend__warm_check(const git_oid *oid, int found, git_otype type, size_t len,
+	void *data, void *payload)
+{
+	memcached_warm_check *check = payload;
+
+	free(data);
+
+	return found ? 0 : check->cb(oid, check->payload);
+}
+
+int git_odb_backend_memcached_warm_end(git_odb_backend *_backend, git_odb_memcached_missing_cb cb, void *payload)
+{
+	memcached_backend *backend;
+	memcached_warm_check check;
+	memcached_return ret;
+	int status;
+
+	assert(_backend);
+
+	backend = (memcached_backend *)_backend;
+
+	if (!backend->warming) {
+		giterr_set_str(GITERR_INVALID, "Memcached odb is not warming");
+		return GIT_ERROR;
 	}
 
-	status = GIT_SUCCESS;
+	status = GIT_OK;
+
+	ret = memcached_flush_buffers(backend->db);
+	if (ret != MEMCACHED_SUCCESS)
+		status = memcached_backend__error(backend, ret);
+
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_NOREPLY, backend->noreply);
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, backend->buffering);
+	backend->warming = 0;
+
+	if (status == GIT_OK && cb != NULL) {
+		check.cb = cb;
+		check.payload = payload;
+
+		status = git_odb_backend_memcached_read_many(_backend, backend->warmed, backend->warmed_count,
+			GIT_ODB_MEMCACHED_EXISTS, &memcached_backend__warm_check, &check);
+	}
+
+	free(backend->warmed);
+	backend->warmed = NULL;
+	backend->warmed_count = 0;
+	backend->warmed_alloc = 0;
 
-write_cleanup:
-	free(type_key);
-	free(size_key);
-	free(data_key);
 	return status;
 }
 
@@ -257,27 +954,50 @@ void memcached_backend__free(git_odb_backend *_backend)
 	if (backend->db)
 		memcached_free(backend->db);
 
+	free(backend->warmed);
 	free(backend);
 }
 
-int git_odb_backend_memcached(git_odb_backend **backend_out, const char *host, int port)
+int git_odb_backend_memcached_servers(git_odb_backend **backend_out, const git_odb_memcached_server *servers,
+	size_t count, unsigned int replicas, unsigned int failure_limit)
 {
 	memcached_backend *backend;
 	memcached_return ret = 0;
 	uint64_t set = 1;
+	int weighted = 0;
+	size_t i;
+
+	assert(backend_out && (servers || !count));
+
+	if (count == 0) {
+		giterr_set_str(GITERR_INVALID, "Memcached odb needs at least one server");
+		return GIT_ERROR;
+	}
 
 	backend = calloc(1, sizeof (memcached_backend));
-	if (backend == NULL)
-		return GIT_ENOMEM;
+	if (backend == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
 
+	backend->chunk_size = MEMCACHED_CHUNK_SIZE;
 
 	backend->db = memcached_create(NULL);
-	if (backend->db == NULL)
+	if (backend->db == NULL) {
+		giterr_set_oom();
 		goto cleanup;
+	}
 
-	ret = memcached_server_add(backend->db, host, port);
-	if (ret != MEMCACHED_SUCCESS)
-		goto cleanup;
+	for (i = 0; i < count; i++) {
+		weighted |= servers[i].weight > 1;
+
+		ret = memcached_server_add_with_weight(backend->db, servers[i].host, servers[i].port,
+			servers[i].weight ? servers[i].weight : 1);
+		if (ret != MEMCACHED_SUCCESS) {
+			memcached_backend__error(backend, ret);
+			goto cleanup;
+		}
+	}
 
 	// requires memcached 1.3+
 	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, set);
@@ -285,17 +1005,316 @@ int git_odb_backend_memcached(git_odb_backend **backend_out, const char *host, i
 	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_NO_BLOCK, set);
 	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_TCP_NODELAY, set);
 
+	// ketama moves only the keys of a server that comes or goes
+	memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_DISTRIBUTION, MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA);
+	if (weighted)
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED, set);
+
+	// every write goes to the next servers on the ring too; reads pick any copy
+	if (replicas > 0) {
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS, replicas);
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_RANDOMIZE_REPLICA_READ, set);
+	}
+
+	// take a server off the ring after this many failures in a row, and try
+	// it again after a while; its keys go to the next server meanwhile
+	if (failure_limit > 0) {
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT, failure_limit);
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS, set);
+		memcached_behavior_set(backend->db, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, MEMCACHED_RETRY_SECONDS);
+	}
+
+	backend->parent.version = GIT_ODB_BACKEND_VERSION;
 	backend->parent.read = &memcached_backend__read;
 	backend->parent.read_header = &memcached_backend__read_header;
 	backend->parent.write = &memcached_backend__write;
 	backend->parent.exists = &memcached_backend__exists;
+	backend->parent.freshen = &memcached_backend__freshen;
 	backend->parent.free = &memcached_backend__free;
 
 	*backend_out = (git_odb_backend *) backend;
 
-	return GIT_SUCCESS;
+	return GIT_OK;
 
 cleanup:
+	if (backend->db)
+		memcached_free(backend->db);
+
 	free(backend);
 	return GIT_ERROR;
 }
+
+// A cache in front of another backend: reads try memcached first and
+// fall back to the backing backend, copying what they find into the
+// cache; writes go to the backing backend and, when writing through, to
+// the cache as well. The backing backend is the one that must have the
+// object, so its errors are the ones returned, while those of the cache
+// are only counted.
+
+typedef struct {
+	git_odb_backend parent;
+	git_odb_backend *cache;
+	git_odb_backend *backing;
+
+	// objects bigger than this are never cached; 0 caches everything
+	size_t max_size;
+	int write_through;
+
+	git_odb_memcached_cache_stats stats;
+} memcached_cache_backend;
+
+static int memcached_cache_backend__cacheable(memcached_cache_backend *backend, size_t len)
+{
+	return backend->max_size == 0 || len <= backend->max_size;
+}
+
+static void memcached_cache_backend__fill(memcached_cache_backend *backend, const git_oid *oid,
+	const void *data, size_t len, git_otype type)
+{
+	if (!memcached_cache_backend__cacheable(backend, len)) {
+		backend->stats.skipped++;
+		return;
+	}
+
+	// a cache that can't be written to is only a slower one
+	if (backend->cache->write(backend->cache, oid, data, len, type) == GIT_OK) {
+		backend->stats.fills++;
+	} else {
+		backend->stats.cache_errors++;
+		giterr_clear();
+	}
+}
+
+// whether a read from the cache found the object; a cache that failed is
+// counted and treated as having missed
+static int memcached_cache_backend__hit(memcached_cache_backend *backend, int error)
+{
+	if (error == GIT_OK) {
+		backend->stats.hits++;
+		return 1;
+	}
+
+	if (error != GIT_ENOTFOUND)
+		backend->stats.cache_errors++;
+
+	backend->stats.misses++;
+	giterr_clear();
+	return 0;
+}
+
+int memcached_cache_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_cache_backend *backend;
+	int error;
+
+	assert(data_p && len_p && type_p && _backend && oid);
+
+	backend = (memcached_cache_backend *)_backend;
+
+	if (memcached_cache_backend__hit(backend, backend->cache->read(data_p, len_p, type_p, backend->cache, oid)))
+		return GIT_OK;
+
+	error = backend->backing->read(data_p, len_p, type_p, backend->backing, oid);
+	if (error == GIT_OK)
+		memcached_cache_backend__fill(backend, oid, *data_p, *len_p, *type_p);
+
+	return error;
+}
+
+int memcached_cache_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	memcached_cache_backend *backend;
+	int error;
+
+	assert(out_oid && data_p && len_p && type_p && _backend && short_oid);
+
+	backend = (memcached_cache_backend *)_backend;
+
+	// memcached can't look keys up by prefix, but a full oid is a plain read
+	if (len >= GIT_OID_HEXSZ) {
+		error = memcached_cache_backend__read(data_p, len_p, type_p, _backend, short_oid);
+		if (error == GIT_OK)
+			git_oid_cpy(out_oid, short_oid);
+		return error;
+	}
+
+	error = backend->backing->read_prefix(out_oid, data_p, len_p, type_p, backend->backing, short_oid, len);
+	if (error == GIT_OK)
+		memcached_cache_backend__fill(backend, out_oid, *data_p, *len_p, *type_p);
+
+	return error;
+}
+
+int memcached_cache_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_cache_backend *backend;
+
+	assert(len_p && type_p && _backend && oid);
+
+	backend = (memcached_cache_backend *)_backend;
+
+	// a header alone isn't enough to fill the cache with, so a miss doesn't
+	if (memcached_cache_backend__hit(backend, backend->cache->read_header(len_p, type_p, backend->cache, oid)))
+		return GIT_OK;
+
+	return backend->backing->read_header(len_p, type_p, backend->backing, oid);
+}
+
+int memcached_cache_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_cache_backend *backend;
+
+	assert(_backend && oid);
+
+	backend = (memcached_cache_backend *)_backend;
+
+	if (memcached_cache_backend__hit(backend, backend->cache->exists(backend->cache, oid) ? GIT_OK : GIT_ENOTFOUND))
+		return 1;
+
+	return backend->backing->exists(backend->backing, oid);
+}
+
+int memcached_cache_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+	memcached_cache_backend *backend;
+	int error;
+
+	assert(oid && _backend && data);
+
+	backend = (memcached_cache_backend *)_backend;
+
+	error = backend->backing->write(backend->backing, oid, data, len, type);
+	if (error == GIT_OK && backend->write_through)
+		memcached_cache_backend__fill(backend, oid, data, len, type);
+
+	return error;
+}
+
+// everything the cache can't answer goes straight to the backing backend
+
+int memcached_cache_backend__exists_prefix(git_oid *out_oid, git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->exists_prefix(out_oid, backend->backing, short_oid, len);
+}
+
+int memcached_cache_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->readstream(stream_out, backend->backing, oid);
+}
+
+int memcached_cache_backend__writestream(git_odb_stream **stream_out, git_odb_backend *_backend, git_off_t len, git_otype type)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->writestream(stream_out, backend->backing, len, type);
+}
+
+int memcached_cache_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->foreach(backend->backing, cb, payload);
+}
+
+int memcached_cache_backend__refresh(git_odb_backend *_backend)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->refresh(backend->backing);
+}
+
+int memcached_cache_backend__freshen(git_odb_backend *_backend, const git_oid *oid)
+{
+	memcached_cache_backend *backend = (memcached_cache_backend *)_backend;
+	return backend->backing->freshen(backend->backing, oid);
+}
+
+void memcached_cache_backend__free(git_odb_backend *_backend)
+{
+	memcached_cache_backend *backend;
+	assert(_backend);
+	backend = (memcached_cache_backend *) _backend;
+
+	backend->cache->free(backend->cache);
+	backend->backing->free(backend->backing);
+
+	free(backend);
+}
+
+int git_odb_backend_memcached_cache(git_odb_backend **backend_out, git_odb_backend *cache,
+	git_odb_backend *backing, size_t max_size, int write_through)
+{
+	memcached_cache_backend *backend;
+
+	assert(backend_out && cache && backing);
+
+	if (cache->free != &memcached_backend__free) {
+		giterr_set_str(GITERR_INVALID, "Memcached odb cache must be a memcached backend");
+		return GIT_ERROR;
+	}
+
+	backend = calloc(1, sizeof (memcached_cache_backend));
+	if (backend == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	backend->cache = cache;
+	backend->backing = backing;
+	backend->max_size = max_size;
+	backend->write_through = write_through;
+
+	backend->parent.version = GIT_ODB_BACKEND_VERSION;
+	backend->parent.read = &memcached_cache_backend__read;
+	backend->parent.read_header = &memcached_cache_backend__read_header;
+	backend->parent.write = &memcached_cache_backend__write;
+	backend->parent.exists = &memcached_cache_backend__exists;
+	backend->parent.free = &memcached_cache_backend__free;
+
+	if (backing->read_prefix)
+		backend->parent.read_prefix = &memcached_cache_backend__read_prefix;
+	if (backing->exists_prefix)
+		backend->parent.exists_prefix = &memcached_cache_backend__exists_prefix;
+	if (backing->readstream)
+		backend->parent.readstream = &memcached_cache_backend__readstream;
+	if (backing->foreach)
+		backend->parent.foreach = &memcached_cache_backend__foreach;
+	if (backing->refresh)
+		backend->parent.refresh = &memcached_cache_backend__refresh;
+	if (backing->freshen)
+		backend->parent.freshen = &memcached_cache_backend__freshen;
+
+	// a streamed write never goes through our write, so it could only be
+	// passed on when there's nothing to write through
+	if (backing->writestream && !write_through)
+		backend->parent.writestream = &memcached_cache_backend__writestream;
+
+	*backend_out = (git_odb_backend *) backend;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_memcached_cache_stats(git_odb_memcached_cache_stats *out, git_odb_backend *_backend)
+{
+	assert(out && _backend);
+
+	if (_backend->free != &memcached_cache_backend__free) {
+		giterr_set_str(GITERR_INVALID, "Not a memcached odb cache");
+		return GIT_ERROR;
+	}
+
+	*out = ((memcached_cache_backend *)_backend)->stats;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_memcached(git_odb_backend **backend_out, const char *host, int port)
+{
+	git_odb_memcached_server server;
+
+	server.host = host;
+	server.port = port;
+	server.weight = 1;
+
+	return git_odb_backend_memcached_servers(backend_out, &server, 1, 0, 0);
+}
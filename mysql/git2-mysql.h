@@ -0,0 +1,99 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDE_git2_mysql_h__
+#define INCLUDE_git2_mysql_h__
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+/* one MySQL server and the range of first oid bytes it stores */
+typedef struct {
+  unsigned char first;
+  unsigned char last;
+  const char *host;
+  const char *user;
+  const char *passwd;
+  const char *db;
+  unsigned int port;
+  const char *unix_socket;
+  unsigned long client_flag;
+} git_odb_mysql_shard;
+
+int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag);
+
+/*
+ * Upgrade an object table created by an older version of this backend
+ * to the current schema, which answers header lookups from an index
+ * alone. The table is rebuilt in place while reads and writes go on;
+ * it stays unpartitioned. Nothing happens if it is already current.
+ */
+int git_odb_backend_mysql_migrate(git_odb_backend *backend);
+
+/*
+ * Look up count objects in a few round trips instead of one each.
+ * found_out[i] is set to 1 if oids[i] exists and 0 otherwise; len_out
+ * and type_out are optional, and filled in the order of oids for the
+ * objects that were found. Sharded backends ask every shard involved
+ * at once, including the one a range is being moved away from.
+ */
+int git_odb_backend_mysql_read_header_many(int *found_out, size_t *len_out, git_otype *type_out,
+        git_odb_backend *backend, const git_oid *oids, size_t count);
+
+/* read_header_many without the lengths and types */
+int git_odb_backend_mysql_exists_many(int *found_out, git_odb_backend *backend,
+        const git_oid *oids, size_t count);
+
+/*
+ * Store objects of at least threshold bytes as deduplicated chunks, 0 is
+ * off. Objects bigger than 256KiB are chunked whatever the threshold.
+ */
+int git_odb_backend_mysql_chunking(git_odb_backend *backend, size_t threshold);
+
+/* spread objects over several servers, every first oid byte on exactly one */
+int git_odb_backend_mysql_sharded(git_odb_backend **backend_out,
+        const git_odb_mysql_shard *shards, size_t count);
+
+/* move the first oid bytes first..last to shard `to`, see mysql.c */
+int git_odb_backend_mysql_shard_move(git_odb_backend *backend, unsigned char first,
+        unsigned char last, size_t to, int remove_source);
+
+/*
+ * A refdb in the same database as the odb, with the reflog in a table
+ * of its own. Writes that expect an old value only go through if the
+ * ref still has it, and fail with GIT_EMODIFIED otherwise, also when
+ * another writer holds the ref; a ref and its log entry are changed in
+ * one transaction. A write is a single round trip, the CALL of a stored
+ * procedure that is created next to the tables, so the first connection
+ * needs the CREATE ROUTINE privilege.
+ */
+int git_refdb_backend_mysql(git_refdb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag);
+
+#endif
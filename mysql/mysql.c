@@ -24,9 +24,16 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <git2/sys/refs.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include "git2-mysql.h"
 
 /* MySQL C Api docs:
  *   http://dev.mysql.com/doc/refman/5.1/en/c-api-function-overview.html
@@ -35,426 +42,4143 @@
  *   http://dev.mysql.com/doc/refman/5.1/en/c-api-prepared-statement-function-overview.html
  */
 #include <mysql.h>
+#include <mysqld_error.h>
 
 #define GIT2_TABLE_NAME "git2_odb"
+#define GIT2_CHUNKS_TABLE_NAME "git2_odb_chunks"
+#define GIT2_REFS_TABLE_NAME "git2_refs"
+#define GIT2_REFLOG_TABLE_NAME "git2_reflog"
+#define GIT2_REFS_WRITE_PROCEDURE "git2_refs_write"
+
+// InnoDB can't index keys longer than 767 bytes without large prefixes
+#define GIT2_REF_NAME_MAX 767
+#define GIT2_REF_TARGET_MAX 1024
 #define GIT2_STORAGE_ENGINE "InnoDB"
 
+// stored in the table comment, see init_db
+#define GIT2_SCHEMA_V2 "git2_odb schema v2"
+
+// build with -DGIT2_PARTITIONS=<n> to spread newly created tables over
+// n partitions hashed on the oid
+#define GIT2_STR(x) #x
+#define GIT2_XSTR(x) GIT2_STR(x)
+#ifdef GIT2_PARTITIONS
+# define GIT2_PARTITION_CLAUSE " PARTITION BY KEY (`oid`) PARTITIONS " GIT2_XSTR(GIT2_PARTITIONS)
+#else
+# define GIT2_PARTITION_CLAUSE ""
+#endif
+
+// objects are sent to and read from the server in pieces of at most this
+// size, which keeps every packet well under the default max_allowed_packet
+#define GIT2_STREAM_CHUNK_SIZE (256 * 1024)
+
+// number of oids looked up per `IN (...)` query by the batch calls
+#define GIT2_BATCH_SIZE 128
+
+// rows copied or deleted per query when moving objects between shards
+#define GIT2_MOVE_PAGE_SIZE 256
+
+// big objects can be stored as content-defined chunks, see chunk_cut.
+// Such an object has GIT2_CHUNKED set in its `type` and its `data` is a
+// manifest of GIT2_MANIFEST_ENTRY byte entries: the chunk's hash followed
+// by its length, big endian. Objects bigger than GIT2_STREAM_CHUNK_SIZE
+// are always stored that way, whatever the chunking threshold: COMPRESS
+// and UNCOMPRESS can't handle more than max_allowed_packet, and a chunk
+// is fetched in one piece where a blob would have to be read whole.
+#define GIT2_CHUNKED 0x80
+#define GIT2_CHUNK_MIN (16 * 1024)
+#define GIT2_CHUNK_MAX (256 * 1024)
+#define GIT2_CHUNK_MASK 0xffff000000000000ULL
+#define GIT2_MANIFEST_ENTRY (GIT_OID_RAWSZ + 4)
+
 typedef struct {
   git_odb_backend parent;
   MYSQL *db;
   MYSQL_STMT *st_read;
   MYSQL_STMT *st_write;
   MYSQL_STMT *st_read_header;
+  MYSQL_STMT *st_read_header_many;
+  int schema_version;
+
+  // objects of at least this many bytes are chunked, 0 turns it off;
+  // the chunk statements are prepared on first use
+  size_t chunk_threshold;
+  MYSQL_STMT *st_chunk_exists;
+  MYSQL_STMT *st_chunk_read;
+  MYSQL_STMT *st_chunk_write;
+
+  // second connection, opened on first use, for long running scans
+  MYSQL *db_scan;
+
+  // a connection serves one thread at a time; a sharded backend takes
+  // this around every use of db, from whichever thread it runs on
+  pthread_mutex_t lock;
+
+  // kept around so we can open more connections later on
+  char *host;
+  char *user;
+  char *passwd;
+  char *dbname;
+  unsigned int port;
+  char *unix_socket;
+  unsigned long client_flag;
 } mysql_backend;
 
-int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
-{
+typedef struct {
+  git_odb_stream parent;
+  MYSQL_STMT *st;
+  MYSQL_BIND bind_buffers[4];
+  git_oid oid;
+  unsigned long oid_len;
+  unsigned char type;
+  unsigned long long size;
+  char *buffer;
+  unsigned long buffer_len;
+  size_t buffer_size;
+  int sent_long_data;
+} mysql_writestream;
+
+typedef struct {
+  git_odb_stream parent;
+  mysql_backend *backend;
+  git_otype type;
+  size_t size;
+  char *buffer;
+  size_t buffer_len;
+  unsigned char *manifest;
+  size_t manifest_len;
+  size_t manifest_size;
+} mysql_chunkstream;
+
+typedef struct {
+  git_odb_stream parent;
+  MYSQL_STMT *st;
+  unsigned long offset;
+  unsigned long data_len;
+
+  // chunked objects are read one chunk at a time
   mysql_backend *backend;
+  unsigned char *manifest;
+  unsigned long manifest_len;
+  size_t next_chunk;
+  char *chunk;
+  size_t chunk_len;
+  size_t chunk_offset;
+} mysql_readstream;
+
+typedef struct {
+  git_odb_stream parent;
+  git_odb_stream *stream;
+  mysql_backend *shard;
+} mysql_sharded_readstream;
+
+typedef struct {
+  git_odb_backend parent;
+  mysql_backend **shards;
+  size_t count;
+
+  // shard index by first oid byte, and while a range is being moved the
+  // shard it is moving away from, or -1; read under map_lock and changed
+  // under its write side, by one move at a time
+  unsigned char owner[256];
+  short previous[256];
+  pthread_rwlock_t map_lock;
+  pthread_mutex_t move_lock;
+} mysql_sharded_backend;
+
+typedef struct {
+  mysql_backend *shard;
+  git_oid *oids;
+  size_t *index;
+  size_t count;
+  int *found;
+  size_t *len;
+  git_otype *type;
   int error;
-  MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[1];
+  int started;
+  pthread_t thread;
+} shard_batch;
 
-  assert(len_p && type_p && _backend && oid);
+typedef struct {
+  git_refdb_backend parent;
+  MYSQL *db;
+  MYSQL_STMT *st_lookup;
+  MYSQL_STMT *st_write;
+  MYSQL_STMT *st_delete;
+  MYSQL_STMT *st_delete_cas;
+  MYSQL_STMT *st_rename;
+  MYSQL_STMT *st_lock;
+  MYSQL_STMT *st_has_log;
+  MYSQL_STMT *st_reflog_append;
+  MYSQL_STMT *st_reflog_rename;
+  MYSQL_STMT *st_reflog_delete;
 
-  backend = (mysql_backend *)_backend;
-  error = GIT_ERROR;
+  // refs locked by the git_transaction in flight, which all share one
+  // database transaction that is committed when the last one is unlocked
+  size_t txn_depth;
+  int txn_failed;
+} mysql_refdb_backend;
+
+typedef struct {
+  git_reference_iterator parent;
+  MYSQL_RES *res;
+  char *glob;
+} mysql_refdb_iterator;
+
+static const char *sql_read =
+  "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+
+// not INSERT IGNORE, which would also turn a NULL from COMPRESS into an
+// empty blob and report success
+static const char *sql_write =
+  "INSERT INTO `" GIT2_TABLE_NAME "` VALUES (?, ?, ?, COMPRESS(?))"
+  " ON DUPLICATE KEY UPDATE `oid` = `oid`;";
+
+static MYSQL_STMT *init_statement(MYSQL *db, const char *sql)
+{
+  MYSQL_STMT *st;
+  my_bool truth = 1;
+
+  st = mysql_stmt_init(db);
+  if (st == NULL)
+    return NULL;
+
+  if (mysql_stmt_attr_set(st, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0 ||
+      mysql_stmt_prepare(st, sql, strlen(sql)) != 0) {
+    mysql_stmt_close(st);
+    return NULL;
+  }
+
+  return st;
+}
+
+static void close_statement(MYSQL_STMT *st)
+{
+  if (st)
+    mysql_stmt_close(st);
+}
+
+static void free_statements(mysql_backend *backend)
+{
+  if (backend->st_read)
+    mysql_stmt_close(backend->st_read);
+  if (backend->st_read_header)
+    mysql_stmt_close(backend->st_read_header);
+  if (backend->st_read_header_many)
+    mysql_stmt_close(backend->st_read_header_many);
+  if (backend->st_write)
+    mysql_stmt_close(backend->st_write);
+  if (backend->st_chunk_exists)
+    mysql_stmt_close(backend->st_chunk_exists);
+  if (backend->st_chunk_read)
+    mysql_stmt_close(backend->st_chunk_read);
+  if (backend->st_chunk_write)
+    mysql_stmt_close(backend->st_chunk_write);
+
+  backend->st_read = NULL;
+  backend->st_read_header = NULL;
+  backend->st_read_header_many = NULL;
+  backend->st_write = NULL;
+  backend->st_chunk_exists = NULL;
+  backend->st_chunk_read = NULL;
+  backend->st_chunk_write = NULL;
+}
+
+static char *strdup_or_null(const char *str)
+{
+  return str ? strdup(str) : NULL;
+}
+
+static MYSQL *connect_db(const char *host, const char *user, const char *passwd, const char *dbname,
+        unsigned int port, const char *unix_socket, unsigned long client_flag)
+{
+  MYSQL *db;
+  my_bool reconnect;
+
+  db = mysql_init(NULL);
+  if (db == NULL)
+    return NULL;
+
+  reconnect = 1;
+  // allow libmysql to reconnect gracefully
+  if (mysql_options(db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
+    goto cleanup;
+
+  // make the connection
+  if (mysql_real_connect(db, host, user, passwd, dbname, port, unix_socket, client_flag) != db)
+    goto cleanup;
+
+  return db;
+
+cleanup:
+  mysql_close(db);
+  return NULL;
+}
+
+static MYSQL *open_connection(mysql_backend *backend)
+{
+  return connect_db(backend->host, backend->user, backend->passwd, backend->dbname,
+    backend->port, backend->unix_socket, backend->client_flag);
+}
+
+// send a parameter to the server in GIT2_STREAM_CHUNK_SIZE pieces
+// instead of as part of one big execute packet
+static int send_long_data(MYSQL_STMT *st, unsigned int param, const char *data, size_t len)
+{
+  size_t chunk;
+
+  while (len > 0) {
+    chunk = len < GIT2_STREAM_CHUNK_SIZE ? len : GIT2_STREAM_CHUNK_SIZE;
+    if (mysql_stmt_send_long_data(st, param, data, chunk) != 0)
+      return GIT_ERROR;
+
+    data += chunk;
+    len -= chunk;
+  }
+
+  return GIT_OK;
+}
+
+// head followed by an IN list of count placeholders, e.g. "... IN (?, ?);"
+static char *build_in_query(const char *head, size_t count)
+{
+  char *sql, *p;
+  size_t head_len, i;
+
+  head_len = strlen(head);
+
+  sql = malloc(head_len + count * 3 + 3);
+  if (sql == NULL)
+    return NULL;
+
+  memcpy(sql, head, head_len);
+  p = sql + head_len;
+
+  *p++ = '(';
+  for (i = 0; i < count; i++) {
+    if (i > 0) {
+      *p++ = ',';
+      *p++ = ' ';
+    }
+    *p++ = '?';
+  }
+  *p++ = ')';
+  *p++ = ';';
+  *p = '\0';
+
+  return sql;
+}
+
+// writing an object that is already there leaves it alone; `size` is the
+// object's size, which for a chunked object is not the length of its
+// manifest
+static int write_object(mysql_backend *backend, const git_oid *oid, const void *data, size_t data_len,
+        size_t size, unsigned char type)
+{
+  MYSQL_BIND bind_buffers[4];
+  unsigned long oid_len, length;
+  unsigned long long size_value;
+  int error;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
-  memset(result_buffers, 0, sizeof(result_buffers));
 
-  // bind the oid passed to the statement
+  // bind the oid
+  oid_len = GIT_OID_RAWSZ;
   bind_buffers[0].buffer = (void*)oid->id;
-  bind_buffers[0].buffer_length = 20;
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &oid_len;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
-    return 0;
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
-    return 0;
+  // bind the type
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[1].is_unsigned = 1;
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
-    return 0;
+  // bind the size of the object
+  size_value = size;
+  bind_buffers[2].buffer = &size_value;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  bind_buffers[2].is_unsigned = 1;
 
-  // this should either be 0 or 1
-  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
-    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-    result_buffers[0].buffer = type_p;
-    result_buffers[0].buffer_length = sizeof(*type_p);
-    memset(type_p, 0, sizeof(*type_p));
+  // bind the data
+  length = (unsigned long)data_len;
+  bind_buffers[3].buffer = (void*)data;
+  bind_buffers[3].buffer_length = data_len;
+  bind_buffers[3].length = &length;
+  bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
 
-    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-    result_buffers[1].buffer = len_p;
-    result_buffers[1].buffer_length = sizeof(*len_p);
-    memset(len_p, 0, sizeof(*len_p));
+  // the manifest of a big chunked object goes out in pieces so a single
+  // packet never has to hold it whole; the bound buffer is ignored for a
+  // parameter sent as long data. An object that is already there affects
+  // no rows, which is fine: its content is the same by definition.
+  error = GIT_OK;
+  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0 ||
+      (data_len > GIT2_STREAM_CHUNK_SIZE && send_long_data(backend->st_write, 3, data, data_len) < 0) ||
+      mysql_stmt_execute(backend->st_write) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_stmt_error(backend->st_write));
+    error = GIT_ERROR;
+  }
 
-    if(mysql_stmt_bind_result(backend->st_read_header, result_buffers) != 0)
-      return GIT_ERROR;
+  // reset the statement for further use, whatever happened
+  mysql_stmt_reset(backend->st_write);
+  return error;
+}
 
-    // this should populate the buffers at *type_p and *len_p
-    if(mysql_stmt_fetch(backend->st_read_header) != 0)
-      return GIT_ERROR;
+/* Chunked objects */
 
-    error = GIT_OK;
-  } else {
-    error = GIT_ENOTFOUND;
+// random values, one per byte, for the gear hash in chunk_cut; changing
+// them changes every cut point and with it all chunk hashes
+static const uint64_t gear[256] = {
+  0xc513696e9525d4b9ULL, 0x68ad612b2ec03031ULL, 0x73c1c40cc44af9f3ULL, 0xe64b60ba89f68688ULL,
+  0x657a5167d77092eeULL, 0x452a7c4aeef65b13ULL, 0xcdbaaf14945006e1ULL, 0x2f41b198a6b229eaULL,
+  0x5c8f81dc7af18ad8ULL, 0xf7a628d01aad865bULL, 0x0970ab185c7fb7beULL, 0x978f7631563e25afULL,
+  0x45e0c8c12439df46ULL, 0x6807e9bf0bc7c9a5ULL, 0xa8e71fc75dbc721aULL, 0x1ab15655a61d16beULL,
+  0xcf0ad8c55a1054d3ULL, 0x6d60415b2efd28d4ULL, 0xf5e597caf0b0f657ULL, 0xeeecfc4eaac0ea96ULL,
+  0x958f8295b7795599ULL, 0x2447f53caf4f2b88ULL, 0x8bbfd1d8fe7a07fbULL, 0x89620893c5dc1874ULL,
+  0xfb96408da1dbe77eULL, 0x4f2fc0c06fb38965ULL, 0x1a6e1f951ea06756ULL, 0x086e16299ba31c08ULL,
+  0x7f365cd93cb15a89ULL, 0x843c61d9443e34dcULL, 0x6e888a82b3352749ULL, 0x21869aeb67d84c9bULL,
+  0x7c95bc9ee31aec55ULL, 0x9d6729d431072052ULL, 0x7f3ed53c5b6a8091ULL, 0xea5cdce76c774819ULL,
+  0xbb1e6329b8dafadbULL, 0xef7d1c7e48adc7e1ULL, 0x083185d5c432d8c9ULL, 0xbbeb146c0db518b1ULL,
+  0x9ae8fff7b9158a9eULL, 0x451bc5c3375f67f5ULL, 0xb3e012cacccda41eULL, 0xc06a98dbb2c15099ULL,
+  0x1bfba4d4877349abULL, 0xd80598656d9bad40ULL, 0x24de5032dfc45b1cULL, 0x02cd687034ee3652ULL,
+  0x551146f4181b359eULL, 0xc95e9b192771a6ccULL, 0xd3610d7f57fcae46ULL, 0xd6b9738ca07ca178ULL,
+  0x3f351cd182e4a31aULL, 0x8df329543d3278bfULL, 0x270d4c1ab2b10a4bULL, 0xcc50678a82d1f972ULL,
+  0x0f3d06f8352dcc38ULL, 0x00f951f2654c27f1ULL, 0xc4d45c54a5055b3eULL, 0x31f284f96163e432ULL,
+  0x46155132e19ae919ULL, 0xe936f68c8cfe7592ULL, 0x31bc084b7eeb899bULL, 0x4a345ca2f484f152ULL,
+  0x5c440fffcf7c8e13ULL, 0xff28c5b2519bc27aULL, 0xafb8000ad2f8070bULL, 0x83eea21d31a9fce5ULL,
+  0xca213d12fe695c39ULL, 0x5a70b080f628e865ULL, 0xa1cdbb0b61ea733cULL, 0x8f60dab02d09d77aULL,
+  0x55060771c059b72aULL, 0x5d65a70c67bac02eULL, 0x75efad1a4cc5f176ULL, 0x9588e4bf26e0c9fdULL,
+  0x89e4d997cb623417ULL, 0xd4a4aa87034041a4ULL, 0xda1f1441a2442fcfULL, 0xf587fdcf5c014bc6ULL,
+  0xa7809d4bfc208d16ULL, 0xc789cf3950a7b07cULL, 0x24cd29cd50d6f329ULL, 0xa1a0c4422671bfefULL,
+  0x206e5f59a89c8d72ULL, 0x8c96a945e68241a8ULL, 0x3cf90eef52402e58ULL, 0xbbcb3485aef944a5ULL,
+  0x0b0d22981596d9f7ULL, 0x3e3b2c03acc0b276ULL, 0x2ec8ed552dfb3fe7ULL, 0x37984e0c76ba4e2fULL,
+  0x15edc12c13ea1125ULL, 0x3a5e9034d799af0aULL, 0x6e2d90aa6abf2ffbULL, 0xcdcd7a9833a1e7edULL,
+  0x5a7e558b98f7dcd1ULL, 0x330eb926de808796ULL, 0xed31ee80831cd4c6ULL, 0xc522614a985b6726ULL,
+  0xa9f01943ad4092d0ULL, 0x36edb23d428cb06eULL, 0x4e175cd80ea3c656ULL, 0x4a3a61032a70a1edULL,
+  0xb2b6e6a14f87ed2cULL, 0xf54b2cc8564a5e52ULL, 0x25afef0f8a3272edULL, 0x9f2c059db009325eULL,
+  0x8015ebb6f004a198ULL, 0xeddbdd7b729976a6ULL, 0xa211d3217b6b89d5ULL, 0x2248c47b6847c427ULL,
+  0x1131e4e9d5465033ULL, 0x4c5d57ef56071ffaULL, 0xd764bff6a8cd017eULL, 0xab237667fd135f6fULL,
+  0xb10b08eb7a1b72bfULL, 0x16837e8b82df4e7aULL, 0x57d90cb859a243c5ULL, 0x7dd92d72b1cb568dULL,
+  0xd5fc7199aaed5b4eULL, 0x1478d4b0e52b7a07ULL, 0xdc808592e6d93259ULL, 0x4bdc54e75de6abbbULL,
+  0x2a0c191b611abd90ULL, 0x5524a0d23ed08b01ULL, 0x738aac7435fab934ULL, 0xf6a7a10b8d654aa4ULL,
+  0x88e42515e9f4cbb6ULL, 0x76aabb99ebd42ab5ULL, 0x951bfb25efcb3ecfULL, 0x854a25b35cd40ca5ULL,
+  0xaffbbc1529ec22b9ULL, 0x3a95abab3780f8e0ULL, 0x692480342b79e3f5ULL, 0xec84bf3422453ceeULL,
+  0xf0baa596a2c77137ULL, 0xf9f620b586f34483ULL, 0xd6d2b80c08af9ae3ULL, 0xaebb96b4254e9e44ULL,
+  0x5524dbec0670a0e4ULL, 0x40c87bac381ebe98ULL, 0x8fc49835e2a5802eULL, 0xca7ca0f00f88821dULL,
+  0x40ad48c5a5c733c0ULL, 0x6365925313ecba9cULL, 0xbd846af98fb315e8ULL, 0xf5d6056f3366c8b1ULL,
+  0xc8d26f034608e0a1ULL, 0x36e093ce70457f86ULL, 0x4c2209510d9831d6ULL, 0xbf616bc1ba17adeaULL,
+  0x8f409c6595c89902ULL, 0x8e56af78786c9fccULL, 0x763a967a981a8703ULL, 0x4f8735c465ab3c1dULL,
+  0xdc725e65c120893cULL, 0x60ea49b203493a90ULL, 0x17ae392b680f40afULL, 0x16ef8b7ecc70772fULL,
+  0xc98339bacede02a3ULL, 0x2c78250c5b8430d9ULL, 0x820c4483e544ea08ULL, 0x839fa77dec87a327ULL,
+  0xd646afc65733bff3ULL, 0x54610a261f718bc8ULL, 0x0d8e964d848b463dULL, 0x5d581c2098b80f0fULL,
+  0x2ede117ff483be25ULL, 0xfeb5370e629c7c2bULL, 0x190773e4cc857363ULL, 0xe4e8fcf53de54e31ULL,
+  0x7e50c93303af013fULL, 0x40fab6afc9fb44a1ULL, 0x22cd1e72e5c23250ULL, 0xc4b2e245615e4787ULL,
+  0xc7a5549034fa0fbeULL, 0x0c65cba6ae1fac6dULL, 0xccaba21ac683e351ULL, 0xa0388392467f3d37ULL,
+  0x85810edae7f49759ULL, 0x781920a680ba2da0ULL, 0x74f1b1b009615c71ULL, 0x542639760c52c89cULL,
+  0x0ab1f61e417aa513ULL, 0x615fef6e6f7a9a1bULL, 0x0cf512183def9e57ULL, 0x384b99e10944e31cULL,
+  0x84b3b0107ff8dc58ULL, 0x08eab3ca988373baULL, 0x2bee6c776df9aeb5ULL, 0xd1f1eb7445515034ULL,
+  0xb6cb3259b66a916dULL, 0xba0038c889c141f8ULL, 0x652d7f24c858bd05ULL, 0xb9ea513f51822352ULL,
+  0xe7e57335197169f4ULL, 0x43596c11e2db4f12ULL, 0x336e72a09d8e5a89ULL, 0xd3e54e1d925fdab6ULL,
+  0x0cb2a9d4f0c15780ULL, 0x4f02460c13deda23ULL, 0x2aab9eb1f1e38f09ULL, 0x49fa22315602f7e4ULL,
+  0xa9159d8ba39095daULL, 0x76e8b855281ab5a9ULL, 0x0e7562cb85457314ULL, 0xee569a5ec88e3166ULL,
+  0x2cb8208f007f0c55ULL, 0x914a2d8a04b5126eULL, 0x689a2c8185db9a0bULL, 0x0dab987717b5e482ULL,
+  0x2d06212974a569c0ULL, 0x82255498708395e3ULL, 0x167085f059459a8cULL, 0x0ff6edef7e9164bdULL,
+  0x74128654cef244caULL, 0xfef783d924144b07ULL, 0xe07ab01922f86c63ULL, 0xe4673da47da0398bULL,
+  0xf3e24c15f2989d38ULL, 0x3222c0dae3a190cbULL, 0xac082095fca47642ULL, 0xabe398ec5d971e9fULL,
+  0xc15e41f43a69d475ULL, 0x3874140b4737846cULL, 0x0a92e416fd036fccULL, 0x7342dcdc0b51dd7bULL,
+  0xfbdaae0e71af851cULL, 0x4fb1e152974d3b1bULL, 0x0e2af0a60facaeb8ULL, 0xeaac5c5dbf6f2b2bULL,
+  0x163b3a065d4d247fULL, 0x41489c424e85fb4cULL, 0xd6b9c758c7b12ef7ULL, 0xffdb09aabb1ae2c8ULL,
+  0x5afd5b0169897230ULL, 0x9667b05eec15d047ULL, 0xe70af0a64cfa47d8ULL, 0xa65597d0fc3ba9a4ULL,
+  0x6a2002f06e486717ULL, 0xd550fe0a913c159bULL, 0x542fb8b585815155ULL, 0x08fdfb9a3c95eda2ULL,
+  0x1f36a824c810f1caULL, 0x9039c0fbdc86bce5ULL, 0x8380175c78801b1fULL, 0x8d4c988986262ba6ULL,
+  0x8e8e2d7f5277b9cbULL, 0x00348bd62d6523a7ULL, 0x5da47be1baad863fULL, 0x0efa09747afe336dULL,
+  0xc07d7b9d9ecd9c9aULL, 0x8e9182cd7c16b44cULL, 0xe2ee0b35c2cc7ed4ULL, 0xe77a8d7b33e73bdbULL
+};
+
+// length of the chunk at the start of data: cut where the gear hash of
+// the bytes right before the cut point hits the mask, but no shorter than
+// GIT2_CHUNK_MIN and no longer than GIT2_CHUNK_MAX. Since the cut points
+// depend on the content alone, an edit only changes the chunks around it.
+static size_t chunk_cut(const unsigned char *data, size_t len)
+{
+  uint64_t hash;
+  size_t i;
+
+  if (len <= GIT2_CHUNK_MIN)
+    return len;
+  if (len > GIT2_CHUNK_MAX)
+    len = GIT2_CHUNK_MAX;
+
+  hash = 0;
+  for (i = GIT2_CHUNK_MIN; i < len; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if ((hash & GIT2_CHUNK_MASK) == 0)
+      return i + 1;
   }
 
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
-    return 0;
+  return len;
+}
 
-  return error;
+static void manifest_entry(const unsigned char *manifest, size_t i, git_oid *hash_out, size_t *len_out)
+{
+  const unsigned char *entry = manifest + i * GIT2_MANIFEST_ENTRY;
+
+  git_oid_fromraw(hash_out, entry);
+  *len_out = ((size_t)entry[GIT_OID_RAWSZ] << 24) | ((size_t)entry[GIT_OID_RAWSZ + 1] << 16) |
+    ((size_t)entry[GIT_OID_RAWSZ + 2] << 8) | (size_t)entry[GIT_OID_RAWSZ + 3];
 }
 
-int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+static void manifest_append(unsigned char *manifest, size_t *manifest_len, const git_oid *hash, size_t len)
 {
-  mysql_backend *backend;
+  unsigned char *entry = manifest + *manifest_len;
+
+  memcpy(entry, hash->id, GIT_OID_RAWSZ);
+  entry[GIT_OID_RAWSZ] = (unsigned char)(len >> 24);
+  entry[GIT_OID_RAWSZ + 1] = (unsigned char)(len >> 16);
+  entry[GIT_OID_RAWSZ + 2] = (unsigned char)(len >> 8);
+  entry[GIT_OID_RAWSZ + 3] = (unsigned char)len;
+
+  *manifest_len += GIT2_MANIFEST_ENTRY;
+}
+
+static int init_chunk_statements(mysql_backend *backend)
+{
+  // chunks are keyed by their own hash and shared by every object, and
+  // every version of an object, that contains them
+  static const char *sql_create =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_CHUNKS_TABLE_NAME "` ("
+    "  `hash` binary(20) NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  PRIMARY KEY (`hash`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " ROW_FORMAT=DYNAMIC DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+  static const char *sql_chunk_exists =
+    "SELECT `hash` FROM `" GIT2_CHUNKS_TABLE_NAME "` WHERE `hash` IN ";
+
+  static const char *sql_chunk_read =
+    "SELECT `hash`, UNCOMPRESS(`data`) FROM `" GIT2_CHUNKS_TABLE_NAME "` WHERE `hash` IN ";
+
+  static const char *sql_chunk_write =
+    "INSERT INTO `" GIT2_CHUNKS_TABLE_NAME "` VALUES (?, COMPRESS(?))"
+    " ON DUPLICATE KEY UPDATE `hash` = `hash`;";
+
+  char *sql;
+
+  if (backend->st_chunk_write != NULL)
+    return GIT_OK;
+
+  if (mysql_real_query(backend->db, sql_create, strlen(sql_create)) != 0)
+    goto on_error;
+
+  sql = build_in_query(sql_chunk_exists, GIT2_BATCH_SIZE);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  backend->st_chunk_exists = init_statement(backend->db, sql);
+  free(sql);
+  if (backend->st_chunk_exists == NULL)
+    goto on_error;
+
+  sql = build_in_query(sql_chunk_read, GIT2_BATCH_SIZE);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  backend->st_chunk_read = init_statement(backend->db, sql);
+  free(sql);
+  if (backend->st_chunk_read == NULL)
+    goto on_error;
+
+  // prepared last, it tells whether the others are there
+  backend->st_chunk_write = init_statement(backend->db, sql_chunk_write);
+  if (backend->st_chunk_write == NULL)
+    goto on_error;
+
+  return GIT_OK;
+
+on_error:
+  giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+  close_statement(backend->st_chunk_exists);
+  close_statement(backend->st_chunk_read);
+  backend->st_chunk_exists = NULL;
+  backend->st_chunk_read = NULL;
+  return GIT_ERROR;
+}
+
+// binds count <= GIT2_BATCH_SIZE hashes to an IN statement, padding a
+// short batch by repeating its last hash
+static void bind_hashes(MYSQL_BIND *bind_buffers, unsigned long *hash_len, const git_oid *hashes, size_t count)
+{
+  size_t i;
+
+  *hash_len = GIT_OID_RAWSZ;
+  for (i = 0; i < GIT2_BATCH_SIZE; i++) {
+    const git_oid *hash = &hashes[i < count ? i : count - 1];
+
+    bind_buffers[i].buffer = (void*)hash->id;
+    bind_buffers[i].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[i].length = hash_len;
+    bind_buffers[i].buffer_type = MYSQL_TYPE_BLOB;
+  }
+}
+
+// tells which of count <= GIT2_BATCH_SIZE chunks are stored already
+static int chunks_exist(int *found_out, mysql_backend *backend, const git_oid *hashes, size_t count)
+{
+  MYSQL_BIND bind_buffers[GIT2_BATCH_SIZE];
+  MYSQL_BIND result_buffers[1];
+  unsigned long hash_len, row_hash_len;
+  unsigned char row_hash[GIT_OID_RAWSZ];
+  size_t i;
   int error;
-  MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[3];
-  unsigned long data_len;
 
-  assert(len_p && type_p && _backend && oid);
+  assert(count > 0 && count <= GIT2_BATCH_SIZE);
+
+  memset(found_out, 0, count * sizeof(*found_out));
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  bind_hashes(bind_buffers, &hash_len, hashes, count);
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = row_hash;
+  result_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  result_buffers[0].length = &row_hash_len;
 
-  backend = (mysql_backend *)_backend;
   error = GIT_ERROR;
 
+  if (mysql_stmt_bind_param(backend->st_chunk_exists, bind_buffers) != 0 ||
+      mysql_stmt_execute(backend->st_chunk_exists) != 0 ||
+      mysql_stmt_store_result(backend->st_chunk_exists) != 0 ||
+      mysql_stmt_bind_result(backend->st_chunk_exists, result_buffers) != 0)
+    goto done;
+
+  while ((error = mysql_stmt_fetch(backend->st_chunk_exists)) == 0) {
+    for (i = 0; i < count; i++) {
+      if (memcmp(hashes[i].id, row_hash, GIT_OID_RAWSZ) == 0)
+        found_out[i] = 1;
+    }
+  }
+
+  error = (error == MYSQL_NO_DATA) ? GIT_OK : GIT_ERROR;
+
+done:
+  mysql_stmt_free_result(backend->st_chunk_exists);
+  mysql_stmt_reset(backend->st_chunk_exists);
+  return error;
+}
+
+// fetches count <= GIT2_BATCH_SIZE chunks in one round trip, chunk i
+// into dest[i]; every chunk must be there with the length it should have
+static int read_chunks(mysql_backend *backend, const git_oid *hashes, char **dest, const size_t *lengths, size_t count)
+{
+  MYSQL_BIND bind_buffers[GIT2_BATCH_SIZE];
+  MYSQL_BIND result_buffers[2];
+  unsigned long hash_len, row_hash_len, data_len;
+  unsigned char row_hash[GIT_OID_RAWSZ];
+  int seen[GIT2_BATCH_SIZE];
+  char *first;
+  size_t i;
+  int error, fetch;
+
+  assert(count > 0 && count <= GIT2_BATCH_SIZE);
+
+  memset(seen, 0, sizeof(seen));
   memset(bind_buffers, 0, sizeof(bind_buffers));
   memset(result_buffers, 0, sizeof(result_buffers));
 
-  // bind the oid passed to the statement
-  bind_buffers[0].buffer = (void*)oid->id;
-  bind_buffers[0].buffer_length = 20;
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_hashes(bind_buffers, &hash_len, hashes, count);
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = row_hash;
+  result_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  result_buffers[0].length = &row_hash_len;
+
+  // fetched straight into place with mysql_stmt_fetch_column below
+  result_buffers[1].buffer_type = MYSQL_TYPE_LONG_BLOB;
+  result_buffers[1].buffer = 0;
+  result_buffers[1].buffer_length = 0;
+  result_buffers[1].length = &data_len;
+
+  error = GIT_ERROR;
+
+  if (mysql_stmt_bind_param(backend->st_chunk_read, bind_buffers) != 0 ||
+      mysql_stmt_execute(backend->st_chunk_read) != 0 ||
+      mysql_stmt_store_result(backend->st_chunk_read) != 0 ||
+      mysql_stmt_bind_result(backend->st_chunk_read, result_buffers) != 0)
+    goto done;
+
+  while ((fetch = mysql_stmt_fetch(backend->st_chunk_read)) == 0 || fetch == MYSQL_DATA_TRUNCATED) {
+    first = NULL;
+
+    // an object can contain the same chunk more than once
+    for (i = 0; i < count; i++) {
+      if (memcmp(hashes[i].id, row_hash, GIT_OID_RAWSZ) != 0)
+        continue;
+
+      if (data_len != lengths[i])
+        goto corrupt;
+
+      if (first != NULL) {
+        memcpy(dest[i], first, data_len);
+      } else if (data_len > 0) {
+        MYSQL_BIND column;
+
+        memset(&column, 0, sizeof(column));
+        column.buffer_type = MYSQL_TYPE_LONG_BLOB;
+        column.buffer = dest[i];
+        column.buffer_length = data_len;
+        column.length = &data_len;
+
+        if (mysql_stmt_fetch_column(backend->st_chunk_read, &column, 1, 0) != 0)
+          goto done;
+      }
+
+      first = dest[i];
+      seen[i] = 1;
+    }
+  }
+
+  if (fetch != MYSQL_NO_DATA)
+    goto done;
+
+  for (i = 0; i < count; i++) {
+    if (!seen[i])
+      goto corrupt;
+  }
+
+  error = GIT_OK;
+  goto done;
+
+corrupt:
+  giterr_set_str(GITERR_ODB, "MySQL odb chunk is missing or has the wrong size");
+
+done:
+  mysql_stmt_free_result(backend->st_chunk_read);
+  mysql_stmt_reset(backend->st_chunk_read);
+  return error;
+}
+
+static int write_chunk(mysql_backend *backend, const git_oid *hash, const char *data, size_t len)
+{
+  MYSQL_BIND bind_buffers[2];
+  unsigned long hash_len, data_len;
+  int error;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  hash_len = GIT_OID_RAWSZ;
+  bind_buffers[0].buffer = (void*)hash->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &hash_len;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0)
-    return 0;
+
+  // chunks are never bigger than GIT2_STREAM_CHUNK_SIZE, so no long data
+  data_len = (unsigned long)len;
+  bind_buffers[1].buffer = (void*)data;
+  bind_buffers[1].buffer_length = len;
+  bind_buffers[1].length = &data_len;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+  error = GIT_OK;
+
+  if (mysql_stmt_bind_param(backend->st_chunk_write, bind_buffers) != 0 ||
+      mysql_stmt_execute(backend->st_chunk_write) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_stmt_error(backend->st_chunk_write));
+    error = GIT_ERROR;
+  }
+
+  mysql_stmt_reset(backend->st_chunk_write);
+  return error;
+}
+
+// reassembles a chunked object of len bytes from its manifest, fetching
+// its chunks GIT2_BATCH_SIZE at a time
+static int read_chunked(void **data_p, mysql_backend *backend, const unsigned char *manifest,
+        size_t manifest_len, size_t len)
+{
+  git_oid hashes[GIT2_BATCH_SIZE];
+  char *dest[GIT2_BATCH_SIZE];
+  size_t lengths[GIT2_BATCH_SIZE];
+  size_t count, offset, i, n;
+  char *data;
+
+  if (manifest_len % GIT2_MANIFEST_ENTRY != 0) {
+    giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+    return GIT_ERROR;
+  }
+
+  if (init_chunk_statements(backend) < 0)
+    return GIT_ERROR;
+
+  data = malloc(len > 0 ? len : 1);
+  if (data == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  count = manifest_len / GIT2_MANIFEST_ENTRY;
+  offset = 0;
+
+  for (i = 0; i < count; i += n) {
+    for (n = 0; n < GIT2_BATCH_SIZE && i + n < count; n++) {
+      manifest_entry(manifest, i + n, &hashes[n], &lengths[n]);
+      if (lengths[n] > len - offset)
+        goto corrupt;
+
+      dest[n] = data + offset;
+      offset += lengths[n];
+    }
+
+    if (read_chunks(backend, hashes, dest, lengths, n) < 0)
+      goto on_error;
+  }
+
+  if (offset != len)
+    goto corrupt;
+
+  *data_p = data;
+  return GIT_OK;
+
+corrupt:
+  giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+on_error:
+  free(data);
+  return GIT_ERROR;
+}
+
+// cuts data into chunks, stores those that aren't there yet and then the
+// manifest; chunks go in first so a manifest never refers to a chunk that
+// isn't stored
+static int write_chunked(mysql_backend *backend, const git_oid *oid, const char *data, size_t len, git_otype type)
+{
+  git_oid hashes[GIT2_BATCH_SIZE];
+  size_t offsets[GIT2_BATCH_SIZE];
+  size_t lengths[GIT2_BATCH_SIZE];
+  int found[GIT2_BATCH_SIZE];
+  unsigned char *manifest;
+  size_t manifest_len, offset, i, n;
+  int error;
+
+  if (init_chunk_statements(backend) < 0)
+    return GIT_ERROR;
+
+  // all chunks but the last are at least GIT2_CHUNK_MIN long
+  manifest = malloc((len / GIT2_CHUNK_MIN + 1) * GIT2_MANIFEST_ENTRY);
+  if (manifest == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  manifest_len = 0;
+  offset = 0;
+  error = GIT_ERROR;
+
+  while (offset < len) {
+    for (n = 0; n < GIT2_BATCH_SIZE && offset < len; n++) {
+      offsets[n] = offset;
+      lengths[n] = chunk_cut((const unsigned char *)data + offset, len - offset);
+
+      if (git_odb_hash(&hashes[n], data + offset, lengths[n], GIT_OBJ_BLOB) < 0)
+        goto cleanup;
+
+      manifest_append(manifest, &manifest_len, &hashes[n], lengths[n]);
+      offset += lengths[n];
+    }
+
+    // only chunks the server doesn't have yet go over the wire
+    if (chunks_exist(found, backend, hashes, n) < 0)
+      goto cleanup;
+
+    for (i = 0; i < n; i++) {
+      if (!found[i] && write_chunk(backend, &hashes[i], data + offsets[i], lengths[i]) < 0)
+        goto cleanup;
+    }
+  }
+
+  error = write_object(backend, oid, manifest, manifest_len, len, (unsigned char)(type | GIT2_CHUNKED));
+
+cleanup:
+  free(manifest);
+  return error;
+}
+
+int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_backend *backend;
+  int error;
+  MYSQL_BIND bind_buffers[1];
+  MYSQL_BIND result_buffers[2];
+
+  assert(len_p && type_p && _backend && oid);
+
+  backend = (mysql_backend *)_backend;
+  error = GIT_ERROR;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  // bind the oid passed to the statement
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
+    return 0;
+
+  // execute the statement
+  if (mysql_stmt_execute(backend->st_read_header) != 0)
+    return 0;
+
+  if (mysql_stmt_store_result(backend->st_read_header) != 0)
+    return 0;
+
+  // this should either be 0 or 1
+  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
+  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+    result_buffers[0].buffer = type_p;
+    result_buffers[0].buffer_length = sizeof(*type_p);
+    memset(type_p, 0, sizeof(*type_p));
+
+    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+    result_buffers[1].buffer = len_p;
+    result_buffers[1].buffer_length = sizeof(*len_p);
+    memset(len_p, 0, sizeof(*len_p));
+
+    if(mysql_stmt_bind_result(backend->st_read_header, result_buffers) != 0)
+      return GIT_ERROR;
+
+    // this should populate the buffers at *type_p and *len_p
+    if(mysql_stmt_fetch(backend->st_read_header) != 0)
+      return GIT_ERROR;
+
+    *type_p = (git_otype)(*type_p & ~GIT2_CHUNKED);
+    error = GIT_OK;
+  } else {
+    error = GIT_ENOTFOUND;
+  }
+
+  // reset the statement for further use
+  if (mysql_stmt_reset(backend->st_read_header) != 0)
+    return 0;
+
+  return error;
+}
+
+int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_backend *backend;
+  int error;
+  MYSQL_BIND bind_buffers[1];
+  MYSQL_BIND result_buffers[3];
+  unsigned long data_len;
+
+  assert(len_p && type_p && _backend && oid);
+
+  backend = (mysql_backend *)_backend;
+  error = GIT_ERROR;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  // bind the oid passed to the statement
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0)
+    return 0;
 
   // execute the statement
   if (mysql_stmt_execute(backend->st_read) != 0)
     return 0;
 
-  if (mysql_stmt_store_result(backend->st_read) != 0)
-    return 0;
+  if (mysql_stmt_store_result(backend->st_read) != 0)
+    return 0;
+
+  // this should either be 0 or 1
+  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
+  if (mysql_stmt_num_rows(backend->st_read) == 1) {
+    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+    result_buffers[0].buffer = type_p;
+    result_buffers[0].buffer_length = sizeof(*type_p);
+    memset(type_p, 0, sizeof(*type_p));
+
+    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+    result_buffers[1].buffer = len_p;
+    result_buffers[1].buffer_length = sizeof(*len_p);
+    memset(len_p, 0, sizeof(*len_p));
+
+    // by setting buffer and buffer_length to 0, this tells libmysql
+    // we want it to set data_len to the *actual* length of that field
+    // this way we can malloc exactly as much memory as we need for the buffer
+    //
+    // come to think of it, we can probably just use the length set in *len_p
+    // once we fetch the result?
+    result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+    result_buffers[2].buffer = 0;
+    result_buffers[2].buffer_length = 0;
+    result_buffers[2].length = &data_len;
+
+    if(mysql_stmt_bind_result(backend->st_read, result_buffers) != 0)
+      return GIT_ERROR;
+
+    // this should populate the buffers at *type_p, *len_p and &data_len
+    error = mysql_stmt_fetch(backend->st_read);
+    // if(error != 0 || error != MYSQL_DATA_TRUNCATED)
+    //   return GIT_ERROR;
+
+    if (data_len > 0) {
+      *data_p = malloc(data_len);
+      result_buffers[2].buffer = *data_p;
+      result_buffers[2].buffer_length = data_len;
+
+      if (mysql_stmt_fetch_column(backend->st_read, &result_buffers[2], 2, 0) != 0)
+        return GIT_ERROR;
+    }
+
+    error = GIT_OK;
+  } else {
+    error = GIT_ENOTFOUND;
+  }
+
+  // reset the statement for further use
+  if (mysql_stmt_reset(backend->st_read) != 0)
+    return 0;
+
+  // what we got is the manifest of a chunked object, swap it for the data
+  if (error == GIT_OK && (*type_p & GIT2_CHUNKED)) {
+    void *manifest = data_len > 0 ? *data_p : NULL;
+
+    error = read_chunked(data_p, backend, manifest, data_len, *len_p);
+    free(manifest);
+  }
+
+  if (error == GIT_OK)
+    *type_p = (git_otype)(*type_p & ~GIT2_CHUNKED);
+
+  return error;
+}
+
+int mysql_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_backend *backend;
+  int found;
+  MYSQL_BIND bind_buffers[1];
+
+  assert(_backend && oid);
+
+  backend = (mysql_backend *)_backend;
+  found = 0;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  // bind the oid passed to the statement
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
+    return 0;
+
+  // execute the statement
+  if (mysql_stmt_execute(backend->st_read_header) != 0)
+    return 0;
+
+  if (mysql_stmt_store_result(backend->st_read_header) != 0)
+    return 0;
+
+  // now lets see if any rows matched our query
+  // this should either be 0 or 1
+  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
+  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+    found = 1;
+  }
+
+  // reset the statement for further use
+  if (mysql_stmt_reset(backend->st_read_header) != 0)
+    return 0;
+
+  return found;
+}
+
+// looks up one GIT2_BATCH_SIZE slice of the oids in a single round trip
+static int read_header_batch(int *found_out, size_t *len_out, git_otype *type_out,
+        mysql_backend *backend, const git_oid *oids, size_t count)
+{
+  MYSQL_BIND bind_buffers[GIT2_BATCH_SIZE];
+  MYSQL_BIND result_buffers[3];
+  unsigned long oid_len, row_oid_len;
+  unsigned char row_oid[GIT_OID_RAWSZ];
+  unsigned char row_type;
+  unsigned long long row_size;
+  size_t i;
+  int error;
+
+  assert(count > 0 && count <= GIT2_BATCH_SIZE);
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  // the statement always takes a full batch, a short one is padded by
+  // repeating its last oid
+  oid_len = GIT_OID_RAWSZ;
+  for (i = 0; i < GIT2_BATCH_SIZE; i++) {
+    const git_oid *oid = &oids[i < count ? i : count - 1];
+
+    bind_buffers[i].buffer = (void*)oid->id;
+    bind_buffers[i].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[i].length = &oid_len;
+    bind_buffers[i].buffer_type = MYSQL_TYPE_BLOB;
+  }
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = row_oid;
+  result_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  result_buffers[0].length = &row_oid_len;
+
+  result_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  result_buffers[1].buffer = &row_type;
+  result_buffers[1].is_unsigned = 1;
+
+  result_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  result_buffers[2].buffer = &row_size;
+  result_buffers[2].is_unsigned = 1;
+
+  error = GIT_ERROR;
+
+  if (mysql_stmt_bind_param(backend->st_read_header_many, bind_buffers) != 0 ||
+      mysql_stmt_execute(backend->st_read_header_many) != 0 ||
+      mysql_stmt_store_result(backend->st_read_header_many) != 0 ||
+      mysql_stmt_bind_result(backend->st_read_header_many, result_buffers) != 0)
+    goto done;
+
+  // rows come back in index order, not in the order we asked; the same
+  // oid may also have been passed more than once
+  while ((error = mysql_stmt_fetch(backend->st_read_header_many)) == 0) {
+    for (i = 0; i < count; i++) {
+      if (memcmp(oids[i].id, row_oid, GIT_OID_RAWSZ) != 0)
+        continue;
+
+      found_out[i] = 1;
+      if (len_out)
+        len_out[i] = (size_t)row_size;
+      if (type_out)
+        type_out[i] = (git_otype)(row_type & ~GIT2_CHUNKED);
+    }
+  }
+
+  error = (error == MYSQL_NO_DATA) ? GIT_OK : GIT_ERROR;
+
+done:
+  mysql_stmt_free_result(backend->st_read_header_many);
+  mysql_stmt_reset(backend->st_read_header_many);
+  return error;
+}
+
+static int read_header_many(int *found_out, size_t *len_out, git_otype *type_out,
+        mysql_backend *backend, const git_oid *oids, size_t count)
+{
+  size_t start, n;
+
+  memset(found_out, 0, count * sizeof(*found_out));
+
+  for (start = 0; start < count; start += n) {
+    n = count - start;
+    if (n > GIT2_BATCH_SIZE)
+      n = GIT2_BATCH_SIZE;
+
+    if (read_header_batch(found_out + start, len_out ? len_out + start : NULL,
+          type_out ? type_out + start : NULL, backend, oids + start, n) < 0)
+      return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+int mysql_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+  mysql_backend *backend;
+
+  assert(oid && _backend && data);
+
+  backend = (mysql_backend *)_backend;
+
+  if ((backend->chunk_threshold > 0 && len >= backend->chunk_threshold) || len > GIT2_STREAM_CHUNK_SIZE)
+    return write_chunked(backend, oid, data, len, type);
+
+  return write_object(backend, oid, data, len, len, (unsigned char)type);
+}
+
+static int writestream_flush(mysql_writestream *stream)
+{
+  if (stream->buffer_len == 0)
+    return GIT_OK;
+
+  if (send_long_data(stream->st, 3, stream->buffer, stream->buffer_len) < 0)
+    return GIT_ERROR;
+
+  stream->sent_long_data = 1;
+  stream->buffer_len = 0;
+  return GIT_OK;
+}
+
+int mysql_backend__writestream_write(git_odb_stream *_stream, const char *data, size_t len)
+{
+  mysql_writestream *stream;
+  size_t n;
+
+  assert(_stream && data);
+
+  stream = (mysql_writestream *)_stream;
+
+  while (len > 0) {
+    // nothing buffered and at least a full chunk to go: skip the copy
+    if (stream->buffer_len == 0 && len >= stream->buffer_size) {
+      n = len - (len % stream->buffer_size);
+      if (send_long_data(stream->st, 3, data, n) < 0)
+        return GIT_ERROR;
+
+      stream->sent_long_data = 1;
+      data += n;
+      len -= n;
+      continue;
+    }
+
+    n = stream->buffer_size - stream->buffer_len;
+    if (n > len)
+      n = len;
+
+    memcpy(stream->buffer + stream->buffer_len, data, n);
+    stream->buffer_len += n;
+    data += n;
+    len -= n;
+
+    if (stream->buffer_len == stream->buffer_size && writestream_flush(stream) < 0)
+      return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+int mysql_backend__writestream_finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+  mysql_writestream *stream;
+  my_ulonglong affected_rows;
+
+  assert(_stream && oid);
+
+  stream = (mysql_writestream *)_stream;
+
+  // objects smaller than one chunk never hit send_long_data, the
+  // buffer bound to the statement is sent along with the execute
+  if (stream->sent_long_data && writestream_flush(stream) < 0)
+    return GIT_ERROR;
+
+  git_oid_cpy(&stream->oid, oid);
+
+  if (mysql_stmt_execute(stream->st) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_stmt_error(stream->st));
+    return GIT_ERROR;
+  }
+
+  // an object that is already there is left alone
+  affected_rows = mysql_stmt_affected_rows(stream->st);
+  if (affected_rows > 1)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+void mysql_backend__writestream_free(git_odb_stream *_stream)
+{
+  mysql_writestream *stream;
+  assert(_stream);
+  stream = (mysql_writestream *)_stream;
+
+  if (stream->st)
+    mysql_stmt_close(stream->st);
+
+  free(stream->buffer);
+  free(stream);
+}
+
+// stores the chunks that are complete, all that's left if final is set;
+// a chunk whose end isn't known yet stays in the buffer
+static int chunkstream_cut(mysql_chunkstream *stream, int final)
+{
+  git_oid hash;
+  size_t start, n;
+  int found;
+
+  start = 0;
+
+  while (start < stream->buffer_len) {
+    n = chunk_cut((const unsigned char *)stream->buffer + start, stream->buffer_len - start);
+    if (!final && start + n == stream->buffer_len && n < GIT2_CHUNK_MAX)
+      break;
+
+    if (git_odb_hash(&hash, stream->buffer + start, n, GIT_OBJ_BLOB) < 0)
+      return GIT_ERROR;
+
+    if (chunks_exist(&found, stream->backend, &hash, 1) < 0)
+      return GIT_ERROR;
+
+    if (!found && write_chunk(stream->backend, &hash, stream->buffer + start, n) < 0)
+      return GIT_ERROR;
+
+    if (stream->manifest_len == stream->manifest_size) {
+      unsigned char *manifest;
+
+      manifest = realloc(stream->manifest, stream->manifest_size * 2);
+      if (manifest == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+      }
+
+      stream->manifest = manifest;
+      stream->manifest_size *= 2;
+    }
+
+    manifest_append(stream->manifest, &stream->manifest_len, &hash, n);
+    start += n;
+  }
+
+  memmove(stream->buffer, stream->buffer + start, stream->buffer_len - start);
+  stream->buffer_len -= start;
+  return GIT_OK;
+}
+
+int mysql_backend__chunkstream_write(git_odb_stream *_stream, const char *data, size_t len)
+{
+  mysql_chunkstream *stream;
+  size_t n;
+
+  assert(_stream && data);
+
+  stream = (mysql_chunkstream *)_stream;
+
+  while (len > 0) {
+    n = GIT2_CHUNK_MAX - stream->buffer_len;
+    if (n > len)
+      n = len;
+
+    memcpy(stream->buffer + stream->buffer_len, data, n);
+    stream->buffer_len += n;
+    stream->size += n;
+    data += n;
+    len -= n;
+
+    if (stream->buffer_len == GIT2_CHUNK_MAX && chunkstream_cut(stream, 0) < 0)
+      return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+int mysql_backend__chunkstream_finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+  mysql_chunkstream *stream;
+
+  assert(_stream && oid);
+
+  stream = (mysql_chunkstream *)_stream;
+
+  if (chunkstream_cut(stream, 1) < 0)
+    return GIT_ERROR;
+
+  return write_object(stream->backend, oid, stream->manifest, stream->manifest_len,
+    stream->size, (unsigned char)(stream->type | GIT2_CHUNKED));
+}
+
+void mysql_backend__chunkstream_free(git_odb_stream *_stream)
+{
+  mysql_chunkstream *stream;
+  assert(_stream);
+  stream = (mysql_chunkstream *)_stream;
+
+  free(stream->buffer);
+  free(stream->manifest);
+  free(stream);
+}
+
+// a write stream for objects big enough to be chunked: data is cut and
+// stored as it comes in, so only the manifest waits for finalize_write
+static int chunkstream_new(git_odb_stream **stream_out, mysql_backend *backend, git_otype type)
+{
+  mysql_chunkstream *stream;
+
+  if (init_chunk_statements(backend) < 0)
+    return GIT_ERROR;
+
+  stream = calloc(1, sizeof(mysql_chunkstream));
+  if (stream == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  stream->backend = backend;
+  stream->type = type;
+  stream->manifest_size = 64 * GIT2_MANIFEST_ENTRY;
+  stream->buffer = malloc(GIT2_CHUNK_MAX);
+  stream->manifest = malloc(stream->manifest_size);
+  if (stream->buffer == NULL || stream->manifest == NULL) {
+    giterr_set_oom();
+    mysql_backend__chunkstream_free((git_odb_stream *)stream);
+    return GIT_ERROR;
+  }
+
+  stream->parent.backend = (git_odb_backend *)backend;
+  stream->parent.mode = GIT_STREAM_WRONLY;
+  stream->parent.write = &mysql_backend__chunkstream_write;
+  stream->parent.finalize_write = &mysql_backend__chunkstream_finalize_write;
+  stream->parent.free = &mysql_backend__chunkstream_free;
+
+  *stream_out = (git_odb_stream *)stream;
+  return GIT_OK;
+}
+
+int mysql_backend__writestream(git_odb_stream **stream_out, git_odb_backend *_backend, git_off_t size, git_otype type)
+{
+  mysql_backend *backend;
+  mysql_writestream *stream;
+
+  assert(stream_out && _backend && size >= 0);
+
+  backend = (mysql_backend *)_backend;
+
+  if ((backend->chunk_threshold > 0 && (size_t)size >= backend->chunk_threshold) ||
+      (size_t)size > GIT2_STREAM_CHUNK_SIZE)
+    return chunkstream_new(stream_out, backend, type);
+
+  stream = calloc(1, sizeof(mysql_writestream));
+  if (stream == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  // the buffer never grows past one chunk, however big the object is
+  stream->buffer_size = (size > 0 && size < GIT2_STREAM_CHUNK_SIZE) ? (size_t)size : GIT2_STREAM_CHUNK_SIZE;
+  stream->buffer = malloc(stream->buffer_size);
+  if (stream->buffer == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+
+  // every stream gets its own statement so the long data it has sent
+  // can't be mixed up with writes going through st_write meanwhile
+  stream->st = init_statement(backend->db, sql_write);
+  if (stream->st == NULL)
+    goto cleanup;
+
+  stream->size = (unsigned long long)size;
+  stream->oid_len = GIT_OID_RAWSZ;
+
+  // the bound buffers are only read at execute time, so the oid can be
+  // filled in once finalize_write knows it
+  stream->bind_buffers[0].buffer = stream->oid.id;
+  stream->bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  stream->bind_buffers[0].length = &stream->oid_len;
+  stream->bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  stream->bind_buffers[1].buffer = &stream->type;
+  stream->bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  stream->bind_buffers[1].is_unsigned = 1;
+
+  stream->bind_buffers[2].buffer = &stream->size;
+  stream->bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  stream->bind_buffers[2].is_unsigned = 1;
+
+  stream->bind_buffers[3].buffer = stream->buffer;
+  stream->bind_buffers[3].buffer_length = stream->buffer_size;
+  stream->bind_buffers[3].length = &stream->buffer_len;
+  stream->bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+
+  if (mysql_stmt_bind_param(stream->st, stream->bind_buffers) != 0)
+    goto cleanup;
+
+  stream->parent.backend = _backend;
+  stream->parent.mode = GIT_STREAM_WRONLY;
+  stream->parent.write = &mysql_backend__writestream_write;
+  stream->parent.finalize_write = &mysql_backend__writestream_finalize_write;
+  stream->parent.free = &mysql_backend__writestream_free;
+
+  *stream_out = (git_odb_stream *)stream;
+  return GIT_OK;
+
+cleanup:
+  mysql_backend__writestream_free((git_odb_stream *)stream);
+  return GIT_ERROR;
+}
+
+int mysql_backend__readstream_read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+  mysql_readstream *stream;
+  MYSQL_BIND result_buffer;
+  unsigned long remaining, fetched;
+
+  assert(_stream && buffer);
+
+  stream = (mysql_readstream *)_stream;
+
+  remaining = stream->data_len - stream->offset;
+  if (remaining == 0)
+    return 0;
+
+  if (len > remaining)
+    len = remaining;
+  if (len > GIT2_STREAM_CHUNK_SIZE)
+    len = GIT2_STREAM_CHUNK_SIZE;
+
+  memset(&result_buffer, 0, sizeof(result_buffer));
+  result_buffer.buffer_type = MYSQL_TYPE_LONG_BLOB;
+  result_buffer.buffer = buffer;
+  result_buffer.buffer_length = len;
+  result_buffer.length = &fetched;
+
+  // copy the next piece of the column straight into the caller's buffer
+  if (mysql_stmt_fetch_column(stream->st, &result_buffer, 2, stream->offset) != 0)
+    return GIT_ERROR;
+
+  stream->offset += len;
+  return (int)len;
+}
+
+int mysql_backend__readstream_read_chunked(git_odb_stream *_stream, char *buffer, size_t len)
+{
+  mysql_readstream *stream;
+  git_oid hash;
+
+  assert(_stream && buffer);
+
+  stream = (mysql_readstream *)_stream;
+
+  while (stream->chunk_offset == stream->chunk_len) {
+    if (stream->next_chunk * GIT2_MANIFEST_ENTRY >= stream->manifest_len)
+      return 0;
+
+    manifest_entry(stream->manifest, stream->next_chunk++, &hash, &stream->chunk_len);
+    stream->chunk_offset = 0;
+
+    if (stream->chunk_len > GIT2_CHUNK_MAX) {
+      giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+      return GIT_ERROR;
+    }
+
+    if (stream->chunk_len > 0 && read_chunks(stream->backend, &hash, &stream->chunk, &stream->chunk_len, 1) < 0)
+      return GIT_ERROR;
+  }
+
+  if (len > stream->chunk_len - stream->chunk_offset)
+    len = stream->chunk_len - stream->chunk_offset;
+
+  memcpy(buffer, stream->chunk + stream->chunk_offset, len);
+  stream->chunk_offset += len;
+  return (int)len;
+}
+
+void mysql_backend__readstream_free(git_odb_stream *_stream)
+{
+  mysql_readstream *stream;
+  assert(_stream);
+  stream = (mysql_readstream *)_stream;
+
+  if (stream->st)
+    mysql_stmt_close(stream->st);
+
+  free(stream->manifest);
+  free(stream->chunk);
+  free(stream);
+}
+
+int mysql_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_backend *backend;
+  mysql_readstream *stream;
+  int error;
+  MYSQL_BIND bind_buffers[1];
+  MYSQL_BIND result_buffers[3];
+  unsigned long oid_len;
+  unsigned char type;
+  unsigned long long size;
+
+  assert(stream_out && _backend && oid);
+
+  backend = (mysql_backend *)_backend;
+  error = GIT_ERROR;
+
+  stream = calloc(1, sizeof(mysql_readstream));
+  if (stream == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  stream->st = init_statement(backend->db, sql_read);
+  if (stream->st == NULL)
+    goto cleanup;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  // bind the oid passed to the statement
+  oid_len = GIT_OID_RAWSZ;
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &oid_len;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  if (mysql_stmt_bind_param(stream->st, bind_buffers) != 0)
+    goto cleanup;
+
+  if (mysql_stmt_execute(stream->st) != 0)
+    goto cleanup;
+
+  // buffer the row on our side so the connection is free for other
+  // statements while the caller works through the stream
+  if (mysql_stmt_store_result(stream->st) != 0)
+    goto cleanup;
+
+  if (mysql_stmt_num_rows(stream->st) != 1) {
+    error = GIT_ENOTFOUND;
+    goto cleanup;
+  }
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+  result_buffers[0].buffer = &type;
+  result_buffers[0].is_unsigned = 1;
+
+  result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+  result_buffers[1].buffer = &size;
+  result_buffers[1].is_unsigned = 1;
+
+  // leave the data unbound, we only want its length here and fetch it
+  // piece by piece in mysql_backend__readstream_read
+  result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+  result_buffers[2].buffer = 0;
+  result_buffers[2].buffer_length = 0;
+  result_buffers[2].length = &stream->data_len;
+
+  if (mysql_stmt_bind_result(stream->st, result_buffers) != 0)
+    goto cleanup;
+
+  error = mysql_stmt_fetch(stream->st);
+  if (error != 0 && error != MYSQL_DATA_TRUNCATED) {
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  error = GIT_ERROR;
+
+  stream->parent.backend = _backend;
+  stream->parent.mode = GIT_STREAM_RDONLY;
+  stream->parent.declared_size = (git_off_t)size;
+  stream->parent.read = &mysql_backend__readstream_read;
+  stream->parent.free = &mysql_backend__readstream_free;
+
+  // for a chunked object the row holds the manifest, which is small; keep
+  // it and fetch one chunk at a time as the caller reads on
+  if (type & GIT2_CHUNKED) {
+    if (init_chunk_statements(backend) < 0)
+      goto cleanup;
+
+    stream->manifest_len = stream->data_len;
+    stream->manifest = malloc(stream->manifest_len > 0 ? stream->manifest_len : 1);
+    stream->chunk = malloc(GIT2_CHUNK_MAX);
+    if (stream->manifest == NULL || stream->chunk == NULL) {
+      giterr_set_oom();
+      goto cleanup;
+    }
+
+    result_buffers[2].buffer = stream->manifest;
+    result_buffers[2].buffer_length = stream->manifest_len;
+    if (stream->manifest_len > 0 &&
+        mysql_stmt_fetch_column(stream->st, &result_buffers[2], 2, 0) != 0)
+      goto cleanup;
+
+    if (stream->manifest_len % GIT2_MANIFEST_ENTRY != 0) {
+      giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+      goto cleanup;
+    }
+
+    mysql_stmt_close(stream->st);
+    stream->st = NULL;
+
+    stream->backend = backend;
+    stream->parent.read = &mysql_backend__readstream_read_chunked;
+  }
+
+  *stream_out = (git_odb_stream *)stream;
+  return GIT_OK;
+
+cleanup:
+  mysql_backend__readstream_free((git_odb_stream *)stream);
+  return error;
+}
+
+// the next scan opens a new connection
+static void close_scan(mysql_backend *backend)
+{
+  mysql_close(backend->db_scan);
+  backend->db_scan = NULL;
+}
+
+int mysql_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+  // only the oid is selected so InnoDB can walk the narrowest index
+  // that covers it and never reads object data
+  static const char *sql_foreach =
+    "SELECT `oid` FROM `" GIT2_TABLE_NAME "`;";
+
+  // the server waits for us while the callback runs; don't let it give
+  // up on a slow consumer halfway through a big table
+  static const char *sql_timeout =
+    "SET SESSION net_write_timeout = 3600;";
+
+  mysql_backend *backend;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid oid;
+  char sql_kill[64];
+  int error;
+
+  assert(_backend && cb);
+
+  backend = (mysql_backend *)_backend;
+  error = GIT_OK;
+
+  // a streaming result ties up its connection until the last row is
+  // read, so scans get their own and st_read & co. stay usable from cb
+  if (backend->db_scan == NULL) {
+    backend->db_scan = open_connection(backend);
+    if (backend->db_scan == NULL) {
+      giterr_set_str(GITERR_ODB, "MySQL odb failed to open a connection for the scan");
+      return GIT_ERROR;
+    }
+
+    if (mysql_real_query(backend->db_scan, sql_timeout, strlen(sql_timeout)) != 0) {
+      giterr_set_str(GITERR_ODB, mysql_error(backend->db_scan));
+      close_scan(backend);
+      return GIT_ERROR;
+    }
+  }
+
+  if (mysql_real_query(backend->db_scan, sql_foreach, strlen(sql_foreach)) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(backend->db_scan));
+    return GIT_ERROR;
+  }
+
+  // rows are pulled off the wire one by one instead of being stored
+  res = mysql_use_result(backend->db_scan);
+  if (res == NULL) {
+    giterr_set_str(GITERR_ODB, mysql_error(backend->db_scan));
+    return GIT_ERROR;
+  }
+
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (lengths == NULL || lengths[0] != GIT_OID_RAWSZ) {
+      giterr_set_str(GITERR_ODB, "MySQL odb scan returned a malformed oid");
+      error = GIT_ERROR;
+      break;
+    }
+
+    git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+
+    if ((error = cb(&oid, payload)) != 0)
+      break;
+  }
+
+  if (error != 0) {
+    // mysql_free_result would otherwise drain the rest of the table
+    // over the wire. Kill the whole scan connection rather than just the
+    // query: the kill may land after the scan is over, and the connection
+    // is thrown away, so it can't hit anything we send later.
+    snprintf(sql_kill, sizeof(sql_kill), "KILL %lu;", mysql_thread_id(backend->db_scan));
+    pthread_mutex_lock(&backend->lock);
+    mysql_real_query(backend->db, sql_kill, strlen(sql_kill));
+    pthread_mutex_unlock(&backend->lock);
+    mysql_free_result(res);
+    close_scan(backend);
+    return error;
+  }
+
+  if (mysql_errno(backend->db_scan) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(backend->db_scan));
+    error = GIT_ERROR;
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+void mysql_backend__free(git_odb_backend *_backend)
+{
+  mysql_backend *backend;
+  assert(_backend);
+  backend = (mysql_backend *)_backend;
+
+  free_statements(backend);
+
+  if (backend->db)
+    mysql_close(backend->db);
+  if (backend->db_scan)
+    mysql_close(backend->db_scan);
+
+  free(backend->host);
+  free(backend->user);
+  free(backend->passwd);
+  free(backend->dbname);
+  free(backend->unix_socket);
+
+  pthread_mutex_destroy(&backend->lock);
+  free(backend);
+}
+
+static int create_table(MYSQL *db)
+{
+  // schema v2: no secondary indexes beyond the covering `header` index
+  // used by read_header/exists, and DYNAMIC rows so big blobs live off-page
+  static const char *sql_create =
+    "CREATE TABLE `" GIT2_TABLE_NAME "` ("
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `size` bigint(20) unsigned NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  PRIMARY KEY (`oid`),"
+    "  KEY `header` (`oid`, `type`, `size`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " ROW_FORMAT=DYNAMIC DEFAULT CHARSET=utf8 COLLATE=utf8_bin"
+    " COMMENT='" GIT2_SCHEMA_V2 "'"
+    GIT2_PARTITION_CLAUSE ";";
+
+  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int init_db(MYSQL *db, int *version_out)
+{
+  // the schema version is kept in the table comment, tables created
+  // before there was a version have none and are v1
+  static const char *sql_check =
+    "SELECT `TABLE_COMMENT` FROM `information_schema`.`TABLES`"
+    " WHERE `TABLE_SCHEMA` = DATABASE() AND `TABLE_NAME` = '" GIT2_TABLE_NAME "';";
+
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int error;
+  my_ulonglong num_rows;
+
+  if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
+    return GIT_ERROR;
+
+  res = mysql_store_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  num_rows = mysql_num_rows(res);
+  if (num_rows == 0) {
+    /* the table was not found */
+    error = create_table(db);
+    *version_out = 2;
+  } else if (num_rows > 0) {
+    /* the table was found */
+    row = mysql_fetch_row(res);
+    if (row != NULL && row[0] != NULL && strcmp(row[0], GIT2_SCHEMA_V2) == 0)
+      *version_out = 2;
+    else
+      *version_out = 1;
+    error = GIT_OK;
+  } else {
+    error = GIT_ERROR;
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+static int init_statements(mysql_backend *backend)
+{
+  static const char *sql_read_header_v1 =
+    "SELECT `type`, `size` FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+
+  // a plain oid lookup always goes through the primary key, which would
+  // drag the (possibly inline) blob pages into the buffer pool
+  static const char *sql_read_header_v2 =
+    "SELECT `type`, `size` FROM `" GIT2_TABLE_NAME "` FORCE INDEX (`header`) WHERE `oid` = ?;";
+
+  static const char *sql_read_header_many_v1 =
+    "SELECT `oid`, `type`, `size` FROM `" GIT2_TABLE_NAME "` WHERE `oid` IN ";
+
+  static const char *sql_read_header_many_v2 =
+    "SELECT `oid`, `type`, `size` FROM `" GIT2_TABLE_NAME "` FORCE INDEX (`header`) WHERE `oid` IN ";
+
+  char *sql;
+
+  backend->st_read = init_statement(backend->db, sql_read);
+  if (backend->st_read == NULL)
+    return GIT_ERROR;
+
+  backend->st_read_header = init_statement(backend->db,
+    backend->schema_version >= 2 ? sql_read_header_v2 : sql_read_header_v1);
+  if (backend->st_read_header == NULL)
+    return GIT_ERROR;
+
+  backend->st_write = init_statement(backend->db, sql_write);
+  if (backend->st_write == NULL)
+    return GIT_ERROR;
+
+  sql = build_in_query(backend->schema_version >= 2 ? sql_read_header_many_v2 : sql_read_header_many_v1,
+    GIT2_BATCH_SIZE);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  backend->st_read_header_many = init_statement(backend->db, sql);
+  free(sql);
+  if (backend->st_read_header_many == NULL)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+int git_odb_backend_mysql_migrate(git_odb_backend *_backend)
+{
+  // InnoDB online DDL: the table is rebuilt in place while reads and
+  // writes keep going. Partitioning can't be added this way, so only
+  // tables created as v2 get GIT2_PARTITIONS.
+  static const char *sql_migrate =
+    "ALTER TABLE `" GIT2_TABLE_NAME "`"
+    "  DROP INDEX `type`,"
+    "  DROP INDEX `size`,"
+    "  ADD INDEX `header` (`oid`, `type`, `size`),"
+    "  ROW_FORMAT=DYNAMIC,"
+    "  COMMENT='" GIT2_SCHEMA_V2 "',"
+    "  ALGORITHM=INPLACE, LOCK=NONE;";
+
+  mysql_backend *backend;
+
+  assert(_backend);
+
+  backend = (mysql_backend *)_backend;
+
+  if (backend->schema_version >= 2)
+    return GIT_OK;
+
+  if (mysql_real_query(backend->db, sql_migrate, strlen(sql_migrate)) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+    return GIT_ERROR;
+  }
+
+  backend->schema_version = 2;
+
+  // pick up the statements that use the new index
+  free_statements(backend);
+  return init_statements(backend);
+}
+
+int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  mysql_backend *backend;
+  int error;
+
+  backend = calloc(1, sizeof(mysql_backend));
+  if (backend == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  pthread_mutex_init(&backend->lock, NULL);
+
+  backend->host = strdup_or_null(mysql_host);
+  backend->user = strdup_or_null(mysql_user);
+  backend->passwd = strdup_or_null(mysql_passwd);
+  backend->dbname = strdup_or_null(mysql_db);
+  backend->port = mysql_port;
+  backend->unix_socket = strdup_or_null(mysql_unix_socket);
+  backend->client_flag = mysql_client_flag;
+
+  backend->db = open_connection(backend);
+  if (backend->db == NULL)
+    goto cleanup;
+
+  // check for and possibly create the database
+  error = init_db(backend->db, &backend->schema_version);
+  if (error < 0)
+    goto cleanup;
+
+  error = init_statements(backend);
+  if (error < 0)
+    goto cleanup;
+
+  backend->parent.version = GIT_ODB_BACKEND_VERSION;
+  backend->parent.read = &mysql_backend__read;
+  backend->parent.read_header = &mysql_backend__read_header;
+  backend->parent.write = &mysql_backend__write;
+  backend->parent.writestream = &mysql_backend__writestream;
+  backend->parent.readstream = &mysql_backend__readstream;
+  backend->parent.exists = &mysql_backend__exists;
+  backend->parent.foreach = &mysql_backend__foreach;
+  backend->parent.free = &mysql_backend__free;
+
+  *backend_out = (git_odb_backend *)backend;
+  return GIT_OK;
+
+cleanup:
+  mysql_backend__free((git_odb_backend *)backend);
+  return GIT_ERROR;
+}
+
+
+/* Sharded odb */
+
+static mysql_backend *shard_owner(mysql_sharded_backend *backend, const git_oid *oid)
+{
+  unsigned char owner;
+
+  pthread_rwlock_rdlock(&backend->map_lock);
+  owner = backend->owner[oid->id[0]];
+  pthread_rwlock_unlock(&backend->map_lock);
+
+  return backend->shards[owner];
+}
+
+static mysql_backend *shard_previous(mysql_sharded_backend *backend, const git_oid *oid)
+{
+  short previous;
+
+  pthread_rwlock_rdlock(&backend->map_lock);
+  previous = backend->previous[oid->id[0]];
+  pthread_rwlock_unlock(&backend->map_lock);
+
+  return previous < 0 ? NULL : backend->shards[previous];
+}
+
+int mysql_sharded_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_sharded_backend *backend;
+  mysql_backend *shard;
+  int error;
+
+  assert(data_p && len_p && type_p && _backend && oid);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  shard = shard_owner(backend, oid);
+  pthread_mutex_lock(&shard->lock);
+  error = mysql_backend__read(data_p, len_p, type_p, (git_odb_backend *)shard, oid);
+  pthread_mutex_unlock(&shard->lock);
+
+  // the range is being moved and the object may not have been copied yet
+  if (error == GIT_ENOTFOUND && (shard = shard_previous(backend, oid)) != NULL) {
+    pthread_mutex_lock(&shard->lock);
+    error = mysql_backend__read(data_p, len_p, type_p, (git_odb_backend *)shard, oid);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return error;
+}
+
+int mysql_sharded_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_sharded_backend *backend;
+  mysql_backend *shard;
+  int error;
+
+  assert(len_p && type_p && _backend && oid);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  shard = shard_owner(backend, oid);
+  pthread_mutex_lock(&shard->lock);
+  error = mysql_backend__read_header(len_p, type_p, (git_odb_backend *)shard, oid);
+  pthread_mutex_unlock(&shard->lock);
+
+  if (error == GIT_ENOTFOUND && (shard = shard_previous(backend, oid)) != NULL) {
+    pthread_mutex_lock(&shard->lock);
+    error = mysql_backend__read_header(len_p, type_p, (git_odb_backend *)shard, oid);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return error;
+}
+
+// a stream of a chunked object keeps using its shard's connection, so
+// every step of it takes the shard's lock as well
+int mysql_sharded_backend__readstream_read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+  mysql_sharded_readstream *stream;
+  int error;
+
+  assert(_stream && buffer);
+
+  stream = (mysql_sharded_readstream *)_stream;
+
+  pthread_mutex_lock(&stream->shard->lock);
+  error = stream->stream->read(stream->stream, buffer, len);
+  pthread_mutex_unlock(&stream->shard->lock);
+
+  return error;
+}
+
+void mysql_sharded_backend__readstream_free(git_odb_stream *_stream)
+{
+  mysql_sharded_readstream *stream;
+
+  assert(_stream);
+
+  stream = (mysql_sharded_readstream *)_stream;
+
+  pthread_mutex_lock(&stream->shard->lock);
+  stream->stream->free(stream->stream);
+  pthread_mutex_unlock(&stream->shard->lock);
+
+  free(stream);
+}
+
+static int shard_readstream(git_odb_stream **stream_out, mysql_backend *shard, const git_oid *oid)
+{
+  int error;
+
+  pthread_mutex_lock(&shard->lock);
+  error = mysql_backend__readstream(stream_out, (git_odb_backend *)shard, oid);
+  pthread_mutex_unlock(&shard->lock);
+
+  return error;
+}
+
+int mysql_sharded_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_sharded_backend *backend;
+  mysql_sharded_readstream *stream;
+  mysql_backend *shard;
+  git_odb_stream *inner;
+  int error;
+
+  assert(stream_out && _backend && oid);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  stream = calloc(1, sizeof(mysql_sharded_readstream));
+  if (stream == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  shard = shard_owner(backend, oid);
+  error = shard_readstream(&inner, shard, oid);
+
+  if (error == GIT_ENOTFOUND && (shard = shard_previous(backend, oid)) != NULL)
+    error = shard_readstream(&inner, shard, oid);
+
+  if (error < 0) {
+    free(stream);
+    return error;
+  }
+
+  stream->stream = inner;
+  stream->shard = shard;
+
+  stream->parent.backend = _backend;
+  stream->parent.mode = inner->mode;
+  stream->parent.declared_size = inner->declared_size;
+  stream->parent.read = &mysql_sharded_backend__readstream_read;
+  stream->parent.free = &mysql_sharded_backend__readstream_free;
+
+  *stream_out = (git_odb_stream *)stream;
+  return GIT_OK;
+}
+
+int mysql_sharded_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_sharded_backend *backend;
+  mysql_backend *shard;
+  int found;
+
+  assert(_backend && oid);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  shard = shard_owner(backend, oid);
+  pthread_mutex_lock(&shard->lock);
+  found = mysql_backend__exists((git_odb_backend *)shard, oid);
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!found && (shard = shard_previous(backend, oid)) != NULL) {
+    pthread_mutex_lock(&shard->lock);
+    found = mysql_backend__exists((git_odb_backend *)shard, oid);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return found;
+}
+
+int mysql_sharded_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+  mysql_sharded_backend *backend;
+  mysql_backend *shard;
+  int error;
+
+  assert(oid && _backend && data);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  shard = shard_owner(backend, oid);
+  pthread_mutex_lock(&shard->lock);
+  error = mysql_backend__write((git_odb_backend *)shard, oid, data, len, type);
+  pthread_mutex_unlock(&shard->lock);
+
+  return error;
+}
+
+int mysql_sharded_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+  mysql_sharded_backend *backend;
+  size_t i;
+  int error;
+
+  assert(_backend && cb);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  // objects of a range that is being moved can show up twice
+  for (i = 0; i < backend->count; i++) {
+    if ((error = mysql_backend__foreach((git_odb_backend *)backend->shards[i], cb, payload)) != 0)
+      return error;
+  }
+
+  return GIT_OK;
+}
+
+void mysql_sharded_backend__free(git_odb_backend *_backend)
+{
+  mysql_sharded_backend *backend;
+  size_t i;
+
+  assert(_backend);
+  backend = (mysql_sharded_backend *)_backend;
+
+  for (i = 0; i < backend->count; i++) {
+    if (backend->shards[i])
+      mysql_backend__free((git_odb_backend *)backend->shards[i]);
+  }
+
+  free(backend->shards);
+  pthread_rwlock_destroy(&backend->map_lock);
+  pthread_mutex_destroy(&backend->move_lock);
+  free(backend);
+}
+
+static void *shard_batch_run(void *payload)
+{
+  shard_batch *batch = payload;
+
+  pthread_mutex_lock(&batch->shard->lock);
+  batch->error = read_header_many(batch->found, batch->len, batch->type,
+    batch->shard, batch->oids, batch->count);
+  pthread_mutex_unlock(&batch->shard->lock);
+
+  return NULL;
+}
+
+// libmysql keeps state per thread, which threads it didn't start have to
+// set up before their first call and free when done
+static void *shard_batch_thread(void *payload)
+{
+  shard_batch *batch = payload;
+
+  if (mysql_thread_init() != 0) {
+    batch->error = GIT_ERROR;
+    return NULL;
+  }
+
+  shard_batch_run(batch);
+
+  mysql_thread_end();
+  return NULL;
+}
+
+// split the oids that are still missing by the shard they live on (or
+// lived on, before a move) and look them up on every shard at once
+static int sharded_read_header_many(int *found_out, size_t *len_out, git_otype *type_out,
+        mysql_sharded_backend *backend, const git_oid *oids, size_t count, int use_previous)
+{
+  shard_batch *batches;
+  shard_batch *batch;
+  short map[256];
+  size_t i, j;
+  int shard, error;
+
+  batches = calloc(backend->count, sizeof(shard_batch));
+  if (batches == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  error = GIT_ERROR;
+
+  // both passes below must see the same map, whatever a move does to it
+  pthread_rwlock_rdlock(&backend->map_lock);
+  for (i = 0; i < 256; i++)
+    map[i] = use_previous ? backend->previous[i] : backend->owner[i];
+  pthread_rwlock_unlock(&backend->map_lock);
+
+  for (i = 0; i < count; i++) {
+    shard = map[oids[i].id[0]];
+    if (shard >= 0 && !found_out[i])
+      batches[shard].count++;
+  }
+
+  for (i = 0; i < backend->count; i++) {
+    batch = &batches[i];
+    batch->shard = backend->shards[i];
+
+    if (batch->count == 0)
+      continue;
+
+    batch->oids = malloc(batch->count * sizeof(git_oid));
+    batch->index = malloc(batch->count * sizeof(size_t));
+    batch->found = malloc(batch->count * sizeof(int));
+    batch->len = malloc(batch->count * sizeof(size_t));
+    batch->type = malloc(batch->count * sizeof(git_otype));
+    if (!batch->oids || !batch->index || !batch->found || !batch->len || !batch->type) {
+      giterr_set_oom();
+      goto cleanup;
+    }
+
+    batch->count = 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    shard = map[oids[i].id[0]];
+    if (shard < 0 || found_out[i])
+      continue;
+
+    batch = &batches[shard];
+    git_oid_cpy(&batch->oids[batch->count], &oids[i]);
+    batch->index[batch->count++] = i;
+  }
+
+  // every shard has its own connection, so they can all run in parallel,
+  // each once it has its shard's lock; if a thread can't be started the
+  // batch just runs on this one
+  for (i = 0; i < backend->count; i++) {
+    batch = &batches[i];
+    if (batch->count == 0)
+      continue;
+
+    batch->started = (pthread_create(&batch->thread, NULL, shard_batch_thread, batch) == 0);
+    if (!batch->started)
+      shard_batch_run(batch);
+  }
+
+  for (i = 0; i < backend->count; i++) {
+    if (batches[i].started)
+      pthread_join(batches[i].thread, NULL);
+  }
+
+  error = GIT_OK;
+
+  for (i = 0; i < backend->count; i++) {
+    batch = &batches[i];
+
+    if (batch->count > 0 && batch->error < 0) {
+      giterr_set_str(GITERR_ODB, "MySQL odb shard lookup failed");
+      error = GIT_ERROR;
+      continue;
+    }
+
+    for (j = 0; j < batch->count; j++) {
+      if (!batch->found[j])
+        continue;
+
+      found_out[batch->index[j]] = 1;
+      if (len_out)
+        len_out[batch->index[j]] = batch->len[j];
+      if (type_out)
+        type_out[batch->index[j]] = batch->type[j];
+    }
+  }
+
+cleanup:
+  for (i = 0; i < backend->count; i++) {
+    free(batches[i].oids);
+    free(batches[i].index);
+    free(batches[i].found);
+    free(batches[i].len);
+    free(batches[i].type);
+  }
+
+  free(batches);
+  return error;
+}
+
+/*
+ * Look up the headers of many objects at once. found_out[i] is set to 1
+ * if oids[i] exists and 0 otherwise; len_out and type_out are optional
+ * and filled in input order for the objects that were found.
+ */
+int git_odb_backend_mysql_read_header_many(int *found_out, size_t *len_out, git_otype *type_out,
+        git_odb_backend *_backend, const git_oid *oids, size_t count)
+{
+  mysql_sharded_backend *backend;
+
+  assert(found_out && _backend && (oids || count == 0));
+
+  if (_backend->free != &mysql_sharded_backend__free)
+    return read_header_many(found_out, len_out, type_out, (mysql_backend *)_backend, oids, count);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  memset(found_out, 0, count * sizeof(*found_out));
+
+  if (sharded_read_header_many(found_out, len_out, type_out, backend, oids, count, 0) < 0)
+    return GIT_ERROR;
+
+  // anything not found on its owner may still sit on the shard it is
+  // being moved away from
+  return sharded_read_header_many(found_out, len_out, type_out, backend, oids, count, 1);
+}
+
+int git_odb_backend_mysql_exists_many(int *found_out, git_odb_backend *_backend, const git_oid *oids, size_t count)
+{
+  return git_odb_backend_mysql_read_header_many(found_out, NULL, NULL, _backend, oids, count);
+}
+
+// oids starting with any byte in first..last sort strictly between the
+// one byte strings {first} and {last + 1}; past 0xff we need something
+// longer than any oid
+static void shard_range_bounds(unsigned char *lo, unsigned long *lo_len,
+        unsigned char *hi, unsigned long *hi_len, unsigned char first, unsigned char last)
+{
+  lo[0] = first;
+  *lo_len = 1;
+
+  if (last < 0xff) {
+    hi[0] = last + 1;
+    *hi_len = 1;
+  } else {
+    memset(hi, 0xff, GIT_OID_RAWSZ + 1);
+    *hi_len = GIT_OID_RAWSZ + 1;
+  }
+}
+
+static int shard_copy_object(mysql_backend *from, mysql_backend *to, const unsigned char *raw)
+{
+  git_oid oid;
+  void *data;
+  size_t len;
+  git_otype type;
+  int error;
+
+  git_oid_fromraw(&oid, raw);
+
+  // an earlier, interrupted move may have got this far already
+  if (mysql_backend__exists((git_odb_backend *)to, &oid))
+    return GIT_OK;
+
+  data = NULL;
+  if (mysql_backend__read(&data, &len, &type, (git_odb_backend *)from, &oid) < 0)
+    return GIT_ERROR;
+
+  error = mysql_backend__write((git_odb_backend *)to, &oid, data ? data : "", len, type);
+  free(data);
+  return error;
+}
+
+static int shard_copy_range(mysql_backend *from, mysql_backend *to, unsigned char first, unsigned char last)
+{
+  static const char *sql_page =
+    "SELECT `oid`, `type`, `size`, `data` FROM `" GIT2_TABLE_NAME "`"
+    " WHERE `oid` > ? AND `oid` < ? ORDER BY `oid` LIMIT " GIT2_XSTR(GIT2_MOVE_PAGE_SIZE) ";";
+
+  // the data is copied as stored, still compressed
+  static const char *sql_copy =
+    "INSERT IGNORE INTO `" GIT2_TABLE_NAME "` VALUES (?, ?, ?, ?);";
+
+  MYSQL_STMT *st_page, *st_copy;
+  MYSQL_BIND bind_buffers[4];
+  MYSQL_BIND result_buffers[4];
+  unsigned char lo[GIT_OID_RAWSZ], hi[GIT_OID_RAWSZ + 1];
+  unsigned long lo_len, hi_len, row_oid_len, data_len;
+  unsigned char row_oid[GIT_OID_RAWSZ];
+  unsigned char row_type;
+  unsigned long long row_size;
+  my_ulonglong rows;
+  char *data;
+  int error, fetch;
+
+  error = GIT_ERROR;
+  data = NULL;
+
+  st_page = init_statement(from->db, sql_page);
+  st_copy = init_statement(to->db, sql_copy);
+  if (st_page == NULL || st_copy == NULL)
+    goto cleanup;
+
+  shard_range_bounds(lo, &lo_len, hi, &hi_len, first, last);
+
+  do {
+    memset(bind_buffers, 0, sizeof(bind_buffers));
+    memset(result_buffers, 0, sizeof(result_buffers));
+
+    bind_buffers[0].buffer = lo;
+    bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[0].length = &lo_len;
+    bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+    bind_buffers[1].buffer = hi;
+    bind_buffers[1].buffer_length = GIT_OID_RAWSZ + 1;
+    bind_buffers[1].length = &hi_len;
+    bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+    result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+    result_buffers[0].buffer = row_oid;
+    result_buffers[0].buffer_length = GIT_OID_RAWSZ;
+    result_buffers[0].length = &row_oid_len;
+
+    result_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+    result_buffers[1].buffer = &row_type;
+    result_buffers[1].is_unsigned = 1;
+
+    result_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+    result_buffers[2].buffer = &row_size;
+    result_buffers[2].is_unsigned = 1;
+
+    result_buffers[3].buffer_type = MYSQL_TYPE_LONG_BLOB;
+    result_buffers[3].buffer = 0;
+    result_buffers[3].buffer_length = 0;
+    result_buffers[3].length = &data_len;
+
+    if (mysql_stmt_bind_param(st_page, bind_buffers) != 0 ||
+        mysql_stmt_execute(st_page) != 0 ||
+        mysql_stmt_store_result(st_page) != 0 ||
+        mysql_stmt_bind_result(st_page, result_buffers) != 0)
+      goto cleanup;
+
+    rows = mysql_stmt_num_rows(st_page);
+
+    while ((fetch = mysql_stmt_fetch(st_page)) == 0 || fetch == MYSQL_DATA_TRUNCATED) {
+      // the next page starts right after this row
+      memcpy(lo, row_oid, GIT_OID_RAWSZ);
+      lo_len = GIT_OID_RAWSZ;
+
+      // chunks live in their own table: copy the object as a whole and
+      // let the new shard chunk it again
+      if (row_type & GIT2_CHUNKED) {
+        if (shard_copy_object(from, to, row_oid) < 0)
+          goto cleanup;
+        continue;
+      }
+
+      data = malloc(data_len > 0 ? data_len : 1);
+      if (data == NULL) {
+        giterr_set_oom();
+        goto cleanup;
+      }
+
+      result_buffers[3].buffer = data;
+      result_buffers[3].buffer_length = data_len;
+      if (data_len > 0 && mysql_stmt_fetch_column(st_page, &result_buffers[3], 3, 0) != 0)
+        goto cleanup;
+
+      memset(bind_buffers, 0, sizeof(bind_buffers));
+
+      bind_buffers[0].buffer = row_oid;
+      bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+      bind_buffers[0].length = &row_oid_len;
+      bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+      bind_buffers[1].buffer = &row_type;
+      bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+      bind_buffers[1].is_unsigned = 1;
+
+      bind_buffers[2].buffer = &row_size;
+      bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+      bind_buffers[2].is_unsigned = 1;
+
+      bind_buffers[3].buffer = data;
+      bind_buffers[3].buffer_length = data_len;
+      bind_buffers[3].length = &data_len;
+      bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+
+      if (mysql_stmt_bind_param(st_copy, bind_buffers) != 0)
+        goto cleanup;
+
+      if (data_len > GIT2_STREAM_CHUNK_SIZE && send_long_data(st_copy, 3, data, data_len) < 0)
+        goto cleanup;
+
+      if (mysql_stmt_execute(st_copy) != 0)
+        goto cleanup;
+
+      mysql_stmt_reset(st_copy);
+
+      free(data);
+      data = NULL;
+    }
+
+    if (fetch != MYSQL_NO_DATA)
+      goto cleanup;
+
+    mysql_stmt_free_result(st_page);
+  } while (rows == GIT2_MOVE_PAGE_SIZE);
+
+  error = GIT_OK;
+
+cleanup:
+  if (error < 0)
+    giterr_set_str(GITERR_ODB, "MySQL odb failed to copy objects between shards");
+
+  free(data);
+  close_statement(st_page);
+  close_statement(st_copy);
+  return error;
+}
+
+static int shard_delete_range(mysql_backend *from, unsigned char first, unsigned char last)
+{
+  // small batches so the source shard is never locked up for long
+  static const char *sql_delete =
+    "DELETE FROM `" GIT2_TABLE_NAME "` WHERE `oid` > ? AND `oid` < ? LIMIT " GIT2_XSTR(GIT2_MOVE_PAGE_SIZE) ";";
+
+  MYSQL_STMT *st_delete;
+  MYSQL_BIND bind_buffers[2];
+  unsigned char lo[GIT_OID_RAWSZ], hi[GIT_OID_RAWSZ + 1];
+  unsigned long lo_len, hi_len;
+  my_ulonglong affected_rows;
+  int error;
+
+  st_delete = init_statement(from->db, sql_delete);
+  if (st_delete == NULL)
+    return GIT_ERROR;
+
+  shard_range_bounds(lo, &lo_len, hi, &hi_len, first, last);
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  bind_buffers[0].buffer = lo;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &lo_len;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_buffers[1].buffer = hi;
+  bind_buffers[1].buffer_length = GIT_OID_RAWSZ + 1;
+  bind_buffers[1].length = &hi_len;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+  error = GIT_ERROR;
+
+  if (mysql_stmt_bind_param(st_delete, bind_buffers) != 0)
+    goto cleanup;
+
+  do {
+    if (mysql_stmt_execute(st_delete) != 0)
+      goto cleanup;
+
+    affected_rows = mysql_stmt_affected_rows(st_delete);
+  } while (affected_rows == GIT2_MOVE_PAGE_SIZE);
+
+  error = GIT_OK;
+
+cleanup:
+  close_statement(st_delete);
+  return error;
+}
+
+static int shard_hash_cmp(const void *a, const void *b)
+{
+  return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+// add the chunks a manifest refers to to a growing list
+static int shard_add_hashes(git_oid **hashes, size_t *count, size_t *size,
+        const unsigned char *manifest, size_t manifest_len)
+{
+  git_oid *grown;
+  size_t i, len;
+
+  if (manifest_len % GIT2_MANIFEST_ENTRY != 0) {
+    giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+    return GIT_ERROR;
+  }
+
+  for (i = 0; i < manifest_len / GIT2_MANIFEST_ENTRY; i++) {
+    if (*count == *size) {
+      *size = *size > 0 ? *size * 2 : GIT2_BATCH_SIZE;
+      grown = realloc(*hashes, *size * sizeof(git_oid));
+      if (grown == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+      }
+
+      *hashes = grown;
+    }
+
+    manifest_entry(manifest, i, &(*hashes)[(*count)++], &len);
+  }
+
+  return GIT_OK;
+}
+
+// the chunks of the chunked objects in first..last, sorted and without
+// duplicates; they are what may be left unused once the range is gone
+static int shard_range_chunks(git_oid **hashes_out, size_t *count_out, mysql_backend *from,
+        unsigned char first, unsigned char last)
+{
+  static const char *sql_manifests =
+    "SELECT UNCOMPRESS(`data`) FROM `" GIT2_TABLE_NAME "`"
+    " WHERE `oid` > ? AND `oid` < ? AND (`type` & " GIT2_XSTR(GIT2_CHUNKED) ") != 0;";
+
+  MYSQL_STMT *st;
+  MYSQL_BIND bind_buffers[2];
+  MYSQL_BIND result_buffers[1];
+  unsigned char lo[GIT_OID_RAWSZ], hi[GIT_OID_RAWSZ + 1];
+  unsigned long lo_len, hi_len, data_len;
+  unsigned char *manifest;
+  git_oid *hashes;
+  size_t count, size, i, j;
+  int error, fetch;
+
+  hashes = NULL;
+  count = size = 0;
+  manifest = NULL;
+  error = GIT_ERROR;
+
+  st = init_statement(from->db, sql_manifests);
+  if (st == NULL)
+    return GIT_ERROR;
+
+  shard_range_bounds(lo, &lo_len, hi, &hi_len, first, last);
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  bind_buffers[0].buffer = lo;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &lo_len;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_buffers[1].buffer = hi;
+  bind_buffers[1].buffer_length = GIT_OID_RAWSZ + 1;
+  bind_buffers[1].length = &hi_len;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_LONG_BLOB;
+  result_buffers[0].buffer = 0;
+  result_buffers[0].buffer_length = 0;
+  result_buffers[0].length = &data_len;
+
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+      mysql_stmt_execute(st) != 0 ||
+      mysql_stmt_store_result(st) != 0 ||
+      mysql_stmt_bind_result(st, result_buffers) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_stmt_error(st));
+    goto cleanup;
+  }
+
+  while ((fetch = mysql_stmt_fetch(st)) == 0 || fetch == MYSQL_DATA_TRUNCATED) {
+    manifest = malloc(data_len > 0 ? data_len : 1);
+    if (manifest == NULL) {
+      giterr_set_oom();
+      goto cleanup;
+    }
+
+    result_buffers[0].buffer = manifest;
+    result_buffers[0].buffer_length = data_len;
+    if (data_len > 0 && mysql_stmt_fetch_column(st, &result_buffers[0], 0, 0) != 0) {
+      giterr_set_str(GITERR_ODB, mysql_stmt_error(st));
+      goto cleanup;
+    }
+
+    if (shard_add_hashes(&hashes, &count, &size, manifest, data_len) < 0)
+      goto cleanup;
+
+    free(manifest);
+    manifest = NULL;
+  }
+
+  if (fetch != MYSQL_NO_DATA) {
+    giterr_set_str(GITERR_ODB, mysql_stmt_error(st));
+    goto cleanup;
+  }
+
+  if (count > 0) {
+    qsort(hashes, count, sizeof(git_oid), shard_hash_cmp);
+
+    for (i = 1, j = 0; i < count; i++) {
+      if (git_oid_cmp(&hashes[i], &hashes[j]) != 0)
+        git_oid_cpy(&hashes[++j], &hashes[i]);
+    }
+
+    count = j + 1;
+  }
+
+  *hashes_out = hashes;
+  *count_out = count;
+  hashes = NULL;
+  error = GIT_OK;
+
+cleanup:
+  free(manifest);
+  free(hashes);
+  close_statement(st);
+  return error;
+}
+
+// delete those of the given chunks that no object left on the shard
+// refers to; chunks are shared, also with objects outside the range
+static int shard_sweep_chunks(mysql_backend *from, const git_oid *hashes, size_t count)
+{
+  static const char *sql_manifests =
+    "SELECT UNCOMPRESS(`data`) FROM `" GIT2_TABLE_NAME "`"
+    " WHERE (`type` & " GIT2_XSTR(GIT2_CHUNKED) ") != 0;";
+
+  static const char *sql_delete =
+    "DELETE FROM `" GIT2_CHUNKS_TABLE_NAME "` WHERE `hash` IN ";
+
+  MYSQL_STMT *st_delete;
+  MYSQL_BIND bind_buffers[GIT2_BATCH_SIZE];
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  unsigned long hash_len;
+  git_oid batch[GIT2_BATCH_SIZE];
+  git_oid hash;
+  char *used, *sql;
+  size_t i, n, len;
+  int error;
+
+  if (count == 0)
+    return GIT_OK;
+
+  used = calloc(count, 1);
+  if (used == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  st_delete = NULL;
+  error = GIT_ERROR;
+
+  // the manifests are streamed; the connection is the move's own, so
+  // nothing else needs it meanwhile
+  if (mysql_real_query(from->db, sql_manifests, strlen(sql_manifests)) != 0 ||
+      (res = mysql_use_result(from->db)) == NULL) {
+    giterr_set_str(GITERR_ODB, mysql_error(from->db));
+    goto cleanup;
+  }
+
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+
+    // keep everything rather than delete a chunk that is still needed
+    if (row[0] == NULL || lengths == NULL || lengths[0] % GIT2_MANIFEST_ENTRY != 0) {
+      giterr_set_str(GITERR_ODB, "MySQL odb chunk manifest is corrupt");
+      mysql_free_result(res);
+      goto cleanup;
+    }
+
+    for (i = 0; i < lengths[0] / GIT2_MANIFEST_ENTRY; i++) {
+      const git_oid *found;
+
+      manifest_entry((const unsigned char *)row[0], i, &hash, &len);
+      found = bsearch(&hash, hashes, count, sizeof(git_oid), shard_hash_cmp);
+      if (found != NULL)
+        used[found - hashes] = 1;
+    }
+  }
+
+  if (mysql_errno(from->db) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(from->db));
+    mysql_free_result(res);
+    goto cleanup;
+  }
+
+  mysql_free_result(res);
+
+  sql = build_in_query(sql_delete, GIT2_BATCH_SIZE);
+  if (sql == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+
+  st_delete = init_statement(from->db, sql);
+  free(sql);
+  if (st_delete == NULL)
+    goto cleanup;
+
+  for (i = 0; i < count; ) {
+    for (n = 0; n < GIT2_BATCH_SIZE && i < count; i++) {
+      if (!used[i])
+        git_oid_cpy(&batch[n++], &hashes[i]);
+    }
+
+    if (n == 0)
+      continue;
+
+    memset(bind_buffers, 0, sizeof(bind_buffers));
+    bind_hashes(bind_buffers, &hash_len, batch, n);
+
+    if (mysql_stmt_bind_param(st_delete, bind_buffers) != 0 ||
+        mysql_stmt_execute(st_delete) != 0) {
+      giterr_set_str(GITERR_ODB, mysql_stmt_error(st_delete));
+      goto cleanup;
+    }
+
+    mysql_stmt_reset(st_delete);
+  }
+
+  error = GIT_OK;
+
+cleanup:
+  close_statement(st_delete);
+  free(used);
+  return error;
+}
+
+// removes first..last from a shard the move has copied it off, along
+// with the chunks nothing else on that shard uses
+static int shard_remove_range(mysql_backend *from, unsigned char first, unsigned char last)
+{
+  git_oid *hashes;
+  size_t count;
+  int error;
+
+  if (shard_range_chunks(&hashes, &count, from, first, last) < 0)
+    return GIT_ERROR;
+
+  error = shard_delete_range(from, first, last);
+  if (error == GIT_OK)
+    error = shard_sweep_chunks(from, hashes, count);
+
+  free(hashes);
+  return error;
+}
+
+// a move copies for a long time while the shards' own connections keep
+// serving reads and writes, so it opens connections of its own
+static int shard_open(mysql_backend **out, mysql_backend *shard)
+{
+  git_odb_backend *copy;
+
+  if (git_odb_backend_mysql(&copy, shard->host, shard->user, shard->passwd, shard->dbname,
+        shard->port, shard->unix_socket, shard->client_flag) < 0)
+    return GIT_ERROR;
+
+  *out = (mysql_backend *)copy;
+  (*out)->chunk_threshold = shard->chunk_threshold;
+  return GIT_OK;
+}
+
+/*
+ * Move the objects whose first oid byte is in first..last to shard `to`.
+ *
+ * New writes for the range go to the new shard right away and reads fall
+ * back to the old one until the copy is complete, so the backend stays
+ * usable throughout. The shard map lives in this process only: roll the
+ * new map out to every other user of the shards before passing
+ * remove_source, which deletes the moved objects from the old shards.
+ * It deletes the chunks of moved objects too, unless an object left on
+ * the old shard still uses them; a big object written to the old shard
+ * while that runs may share a chunk that is deleted under it, so keep
+ * big writes off the old shard until the move returns. A failed move
+ * can simply be retried.
+ */
+int git_odb_backend_mysql_shard_move(git_odb_backend *_backend, unsigned char first, unsigned char last,
+        size_t to, int remove_source)
+{
+  mysql_sharded_backend *backend;
+  mysql_backend *source, *target;
+  int b, end, from, error;
+
+  assert(_backend && first <= last);
+
+  backend = (mysql_sharded_backend *)_backend;
+
+  if (_backend->free != &mysql_sharded_backend__free || to >= backend->count) {
+    giterr_set_str(GITERR_INVALID, "not a sharded MySQL odb or no such shard");
+    return GIT_ERROR;
+  }
+
+  // reads and writes only wait for the map to change, not for the copy
+  pthread_mutex_lock(&backend->move_lock);
+
+  pthread_rwlock_wrlock(&backend->map_lock);
+  for (b = first; b <= last; b++) {
+    if (backend->owner[b] != to) {
+      backend->previous[b] = backend->owner[b];
+      backend->owner[b] = (unsigned char)to;
+    }
+  }
+  pthread_rwlock_unlock(&backend->map_lock);
+
+  error = GIT_ERROR;
+  source = target = NULL;
+
+  if (shard_open(&target, backend->shards[to]) < 0)
+    goto done;
+
+  // copy runs of consecutive prefixes that come from the same shard
+  for (b = first; b <= last; b = end + 1) {
+    from = backend->previous[b];
+
+    for (end = b; end < last && backend->previous[end + 1] == from; end++)
+      /* nothing */;
+
+    if (from < 0)
+      continue;
+
+    if (shard_open(&source, backend->shards[from]) < 0)
+      goto done;
+
+    if (shard_copy_range(source, target, b, end) < 0)
+      goto done;
+
+    if (remove_source && shard_remove_range(source, b, end) < 0)
+      goto done;
+
+    mysql_backend__free((git_odb_backend *)source);
+    source = NULL;
+
+    pthread_rwlock_wrlock(&backend->map_lock);
+    for (; b <= end; b++)
+      backend->previous[b] = -1;
+    pthread_rwlock_unlock(&backend->map_lock);
+
+    b = end;
+  }
+
+  error = GIT_OK;
+
+done:
+  if (source)
+    mysql_backend__free((git_odb_backend *)source);
+  if (target)
+    mysql_backend__free((git_odb_backend *)target);
+
+  pthread_mutex_unlock(&backend->move_lock);
+  return error;
+}
+
+/*
+ * Store objects of at least threshold bytes as content-defined chunks so
+ * that versions of a big file which differ in a few places share most of
+ * their storage; 0 turns this off again. Chunked objects can be read
+ * whatever the setting.
+ */
+int git_odb_backend_mysql_chunking(git_odb_backend *_backend, size_t threshold)
+{
+  mysql_sharded_backend *sharded;
+  mysql_backend *backend;
+  size_t i;
+  int error;
+
+  assert(_backend);
+
+  if (_backend->free == &mysql_sharded_backend__free) {
+    sharded = (mysql_sharded_backend *)_backend;
+
+    for (i = 0; i < sharded->count; i++) {
+      pthread_mutex_lock(&sharded->shards[i]->lock);
+      error = git_odb_backend_mysql_chunking((git_odb_backend *)sharded->shards[i], threshold);
+      pthread_mutex_unlock(&sharded->shards[i]->lock);
+
+      if (error < 0)
+        return GIT_ERROR;
+    }
+
+    return GIT_OK;
+  }
+
+  backend = (mysql_backend *)_backend;
+  backend->chunk_threshold = threshold;
+
+  // create the chunk table now rather than on the first big write
+  return threshold > 0 ? init_chunk_statements(backend) : GIT_OK;
+}
+
+int git_odb_backend_mysql_sharded(git_odb_backend **backend_out, const git_odb_mysql_shard *shards, size_t count)
+{
+  mysql_sharded_backend *backend;
+  git_odb_backend *shard;
+  int covered[256];
+  size_t i;
+  int b;
+
+  assert(backend_out && shards && count > 0 && count <= 256);
+
+  memset(covered, 0, sizeof(covered));
+
+  for (i = 0; i < count; i++) {
+    for (b = shards[i].first; b <= shards[i].last; b++)
+      covered[b]++;
+  }
+
+  for (b = 0; b < 256; b++) {
+    if (covered[b] != 1) {
+      giterr_set_str(GITERR_INVALID, "MySQL odb shard map must cover every oid prefix exactly once");
+      return GIT_ERROR;
+    }
+  }
+
+  backend = calloc(1, sizeof(mysql_sharded_backend));
+  if (backend == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  pthread_rwlock_init(&backend->map_lock, NULL);
+  pthread_mutex_init(&backend->move_lock, NULL);
+
+  backend->shards = calloc(count, sizeof(mysql_backend *));
+  if (backend->shards == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (git_odb_backend_mysql(&shard, shards[i].host, shards[i].user, shards[i].passwd, shards[i].db,
+          shards[i].port, shards[i].unix_socket, shards[i].client_flag) < 0)
+      goto cleanup;
+
+    backend->shards[backend->count++] = (mysql_backend *)shard;
+
+    for (b = shards[i].first; b <= shards[i].last; b++)
+      backend->owner[b] = (unsigned char)i;
+  }
+
+  for (b = 0; b < 256; b++)
+    backend->previous[b] = -1;
+
+  backend->parent.version = GIT_ODB_BACKEND_VERSION;
+  backend->parent.read = &mysql_sharded_backend__read;
+  backend->parent.read_header = &mysql_sharded_backend__read_header;
+  backend->parent.write = &mysql_sharded_backend__write;
+  backend->parent.readstream = &mysql_sharded_backend__readstream;
+  backend->parent.exists = &mysql_sharded_backend__exists;
+  backend->parent.foreach = &mysql_sharded_backend__foreach;
+  backend->parent.free = &mysql_sharded_backend__free;
+
+  // a write stream only learns its oid, and with it its shard, after the
+  // data has been sent; leaving this out makes libgit2 buffer and write()
+  backend->parent.writestream = NULL;
+
+  *backend_out = (git_odb_backend *)backend;
+  return GIT_OK;
+
+cleanup:
+  mysql_sharded_backend__free((git_odb_backend *)backend);
+  return GIT_ERROR;
+}
+
+/* Refdb methods */
+
+static void bind_string(MYSQL_BIND *bind, const char *str, unsigned long *len)
+{
+  *len = str ? strlen(str) : 0;
+  bind->buffer = (void*)str;
+  bind->buffer_length = *len;
+  bind->length = len;
+  bind->buffer_type = MYSQL_TYPE_STRING;
+}
+
+static int refdb_query(MYSQL *db, const char *sql)
+{
+  if (mysql_real_query(db, sql, strlen(sql)) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_error(db));
+    return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+// losing a lock to another writer means the ref changed under the
+// caller, who can read it again and retry; the write procedure signals
+// a ref that doesn't hold the expected value anymore
+static int refdb_error(MYSQL_STMT *st)
+{
+  switch (mysql_stmt_errno(st)) {
+  case ER_DUP_ENTRY:
+    return GIT_EEXISTS;
+  case ER_SIGNAL_EXCEPTION:
+  case ER_LOCK_DEADLOCK:
+  case ER_LOCK_WAIT_TIMEOUT:
+    return GIT_EMODIFIED;
+  default:
+    return GIT_ERROR;
+  }
+}
+
+// run a statement that returns no rows
+static int refdb_execute(MYSQL_STMT *st, MYSQL_BIND *params, my_ulonglong *affected_rows)
+{
+  int error = GIT_OK;
+
+  if (mysql_stmt_bind_param(st, params) != 0 || mysql_stmt_execute(st) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_stmt_error(st));
+    error = refdb_error(st);
+  } else if (affected_rows != NULL) {
+    *affected_rows = mysql_stmt_affected_rows(st);
+  }
+
+  mysql_stmt_reset(st);
+  return error;
+}
+
+// run a CALL of a procedure that returns no rows; its results still end
+// with a status of their own, which has to be read before the statement
+// can be used again
+static int refdb_call(MYSQL_STMT *st, MYSQL_BIND *params)
+{
+  int error = GIT_OK;
+
+  if (mysql_stmt_bind_param(st, params) != 0 || mysql_stmt_execute(st) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_stmt_error(st));
+    error = refdb_error(st);
+  } else {
+    while (mysql_stmt_next_result(st) == 0)
+      ;
+  }
+
+  mysql_stmt_reset(st);
+  return error;
+}
+
+// run a statement and only count the rows it returns
+static int refdb_count(MYSQL_STMT *st, MYSQL_BIND *params, my_ulonglong *num_rows)
+{
+  int error = GIT_OK;
+
+  if (mysql_stmt_bind_param(st, params) != 0 || mysql_stmt_execute(st) != 0 ||
+      mysql_stmt_store_result(st) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_stmt_error(st));
+    error = refdb_error(st);
+  } else {
+    *num_rows = mysql_stmt_num_rows(st);
+  }
+
+  mysql_stmt_free_result(st);
+  mysql_stmt_reset(st);
+  return error;
+}
+
+// statements that must go through together get a transaction of their
+// own, unless a git_transaction already has one open
+static int refdb_begin(mysql_refdb_backend *backend, int *started)
+{
+  *started = 0;
+
+  if (backend->txn_depth > 0)
+    return GIT_OK;
+
+  if (refdb_query(backend->db, "START TRANSACTION;") < 0)
+    return GIT_ERROR;
+
+  *started = 1;
+  return GIT_OK;
+}
+
+static int refdb_end(mysql_refdb_backend *backend, int started, int error)
+{
+  if (error < 0 && backend->txn_depth > 0)
+    backend->txn_failed = 1;
+
+  if (!started)
+    return error;
+
+  if (error < 0) {
+    mysql_rollback(backend->db);
+    return error;
+  }
+
+  if (mysql_commit(backend->db) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_error(backend->db));
+    return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+static int refdb_build_reference(git_reference **out, const char *name, int type, const char *target)
+{
+  git_oid oid;
+
+  if (type == GIT_REF_OID) {
+    if (git_oid_fromstr(&oid, target) < 0)
+      return GIT_ERROR;
+
+    *out = git_reference__alloc(name, &oid, NULL);
+  } else if (type == GIT_REF_SYMBOLIC) {
+    *out = git_reference__alloc_symbolic(name, target);
+  } else {
+    giterr_set_str(GITERR_REFERENCE, "MySQL refdb storage corrupted (unknown ref type returned)");
+    return GIT_ERROR;
+  }
+
+  if (*out == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+// old_id and new_id are NULL for symbolic refs, which are logged with
+// the zero oid
+static int refdb_append_log(mysql_refdb_backend *backend, const char *name, const git_oid *old_id,
+        const git_oid *new_id, const git_signature *who, const char *message)
+{
+  MYSQL_BIND bind_buffers[8];
+  unsigned long name_len, old_id_len, new_id_len, committer_name_len, committer_email_len, message_len;
+  long long time;
+  int offset;
+  my_bool message_is_null;
+  git_oid zero;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(&zero, 0, sizeof(zero));
+
+  if (old_id == NULL)
+    old_id = &zero;
+  if (new_id == NULL)
+    new_id = &zero;
+
+  time = (long long)who->when.time;
+  offset = who->when.offset;
+  message_is_null = (message == NULL);
+
+  bind_string(&bind_buffers[0], name, &name_len);
+
+  old_id_len = GIT_OID_RAWSZ;
+  bind_buffers[1].buffer = (void*)old_id->id;
+  bind_buffers[1].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[1].length = &old_id_len;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+  new_id_len = GIT_OID_RAWSZ;
+  bind_buffers[2].buffer = (void*)new_id->id;
+  bind_buffers[2].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[2].length = &new_id_len;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_string(&bind_buffers[3], who->name, &committer_name_len);
+  bind_string(&bind_buffers[4], who->email, &committer_email_len);
+
+  bind_buffers[5].buffer = &time;
+  bind_buffers[5].buffer_type = MYSQL_TYPE_LONGLONG;
+
+  bind_buffers[6].buffer = &offset;
+  bind_buffers[6].buffer_type = MYSQL_TYPE_LONG;
+
+  bind_string(&bind_buffers[7], message, &message_len);
+  bind_buffers[7].is_null = &message_is_null;
+
+  return refdb_execute(backend->st_reflog_append, bind_buffers, NULL);
+}
+
+int mysql_refdb_backend__exists(int *exists, git_refdb_backend *_backend, const char *ref_name)
+{
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[1];
+  unsigned long name_len;
+  my_ulonglong num_rows;
+  int error;
+
+  assert(exists && ref_name && _backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], ref_name, &name_len);
+
+  error = refdb_count(backend->st_lookup, bind_buffers, &num_rows);
+  if (error == GIT_OK)
+    *exists = (num_rows == 1);
+
+  return error;
+}
+
+int mysql_refdb_backend__lookup(git_reference **out, git_refdb_backend *_backend, const char *ref_name)
+{
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[1];
+  MYSQL_BIND result_buffers[2];
+  unsigned long name_len, target_len;
+  unsigned char type;
+  char target[GIT2_REF_TARGET_MAX + 1];
+  int error;
+
+  assert(out && ref_name && _backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+  error = GIT_ERROR;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  bind_string(&bind_buffers[0], ref_name, &name_len);
+
+  if (mysql_stmt_bind_param(backend->st_lookup, bind_buffers) != 0 ||
+      mysql_stmt_execute(backend->st_lookup) != 0 ||
+      mysql_stmt_store_result(backend->st_lookup) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_stmt_error(backend->st_lookup));
+    goto done;
+  }
+
+  if (mysql_stmt_num_rows(backend->st_lookup) != 1) {
+    giterr_set_str(GITERR_REFERENCE, "MySQL refdb couldn't find ref");
+    error = GIT_ENOTFOUND;
+    goto done;
+  }
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+  result_buffers[0].buffer = &type;
+  result_buffers[0].is_unsigned = 1;
+
+  result_buffers[1].buffer_type = MYSQL_TYPE_STRING;
+  result_buffers[1].buffer = target;
+  result_buffers[1].buffer_length = GIT2_REF_TARGET_MAX;
+  result_buffers[1].length = &target_len;
+
+  if (mysql_stmt_bind_result(backend->st_lookup, result_buffers) != 0 ||
+      mysql_stmt_fetch(backend->st_lookup) != 0) {
+    giterr_set_str(GITERR_REFERENCE, "MySQL refdb storage error");
+    goto done;
+  }
+
+  target[target_len] = '\0';
+  error = refdb_build_reference(out, ref_name, type, target);
+
+done:
+  mysql_stmt_free_result(backend->st_lookup);
+  mysql_stmt_reset(backend->st_lookup);
+  return error;
+}
+
+int mysql_refdb_backend__iterator_next(git_reference **ref, git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter;
+  MYSQL_ROW row;
+
+  assert(ref && _iter);
+  iter = (mysql_refdb_iterator *)_iter;
+
+  while ((row = mysql_fetch_row(iter->res)) != NULL) {
+    if (iter->glob && fnmatch(iter->glob, row[0], 0) != 0)
+      continue;
+
+    return refdb_build_reference(ref, row[0], atoi(row[1]), row[2]);
+  }
+
+  return GIT_ITEROVER;
+}
+
+int mysql_refdb_backend__iterator_next_name(const char **ref_name, git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter;
+  MYSQL_ROW row;
+
+  assert(ref_name && _iter);
+  iter = (mysql_refdb_iterator *)_iter;
+
+  while ((row = mysql_fetch_row(iter->res)) != NULL) {
+    if (iter->glob && fnmatch(iter->glob, row[0], 0) != 0)
+      continue;
+
+    // stays valid until the next call, like the other refdbs' names
+    *ref_name = row[0];
+    return GIT_OK;
+  }
+
+  return GIT_ITEROVER;
+}
+
+void mysql_refdb_backend__iterator_free(git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter;
+
+  assert(_iter);
+  iter = (mysql_refdb_iterator *)_iter;
+
+  if (iter->res)
+    mysql_free_result(iter->res);
+
+  free(iter->glob);
+  free(iter);
+}
+
+int mysql_refdb_backend__iterator(git_reference_iterator **_iter, struct git_refdb_backend *_backend, const char *glob)
+{
+  static const char *sql_iterate =
+    "SELECT `name`, `type`, `target` FROM `" GIT2_REFS_TABLE_NAME "`"
+    " WHERE `name` LIKE '%s' ORDER BY `name`;";
+
+  mysql_refdb_backend *backend;
+  mysql_refdb_iterator *iter;
+  const char *prefix;
+  char *pattern, *escaped, *sql;
+  size_t prefix_len, i, j;
+  int error;
+
+  assert(_iter && _backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+  error = GIT_ERROR;
+  pattern = escaped = sql = NULL;
+
+  iter = calloc(1, sizeof(mysql_refdb_iterator));
+  if (iter == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  if (glob != NULL && (iter->glob = strdup(glob)) == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+
+  // everything up to the first wildcard is a literal prefix, which the
+  // primary key turns into a range scan; fnmatch takes care of the rest
+  prefix = glob ? glob : "refs/";
+  prefix_len = strcspn(prefix, "*?[\\");
+
+  pattern = malloc(prefix_len * 2 + 2);
+  escaped = malloc(prefix_len * 4 + 5);
+  sql = malloc(strlen(sql_iterate) + prefix_len * 4 + 5);
+  if (pattern == NULL || escaped == NULL || sql == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+
+  for (i = 0, j = 0; i < prefix_len; i++) {
+    if (prefix[i] == '%' || prefix[i] == '_')
+      pattern[j++] = '\\';
+    pattern[j++] = prefix[i];
+  }
+  pattern[j++] = '%';
+  pattern[j] = '\0';
+
+  mysql_real_escape_string(backend->db, escaped, pattern, j);
+  sprintf(sql, sql_iterate, escaped);
+
+  if (refdb_query(backend->db, sql) < 0)
+    goto cleanup;
+
+  iter->res = mysql_store_result(backend->db);
+  if (iter->res == NULL) {
+    giterr_set_str(GITERR_REFERENCE, mysql_error(backend->db));
+    goto cleanup;
+  }
+
+  iter->parent.next = &mysql_refdb_backend__iterator_next;
+  iter->parent.next_name = &mysql_refdb_backend__iterator_next_name;
+  iter->parent.free = &mysql_refdb_backend__iterator_free;
+
+  *_iter = (git_reference_iterator *)iter;
+  iter = NULL;
+  error = GIT_OK;
+
+cleanup:
+  if (iter)
+    mysql_refdb_backend__iterator_free((git_reference_iterator *)iter);
+
+  free(pattern);
+  free(escaped);
+  free(sql);
+  return error;
+}
+
+int mysql_refdb_backend__write(git_refdb_backend *_backend, const git_reference *ref, int force, const git_signature *who,
+        const char *message, const git_oid *old, const char *old_target)
+{
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[12];
+  unsigned long name_len, target_len, expected_len, new_id_len, committer_name_len, committer_email_len, message_len;
+  unsigned char type, replace, own;
+  const char *name, *target, *expected;
+  char target_buf[GIT_OID_HEXSZ + 1], expected_buf[GIT_OID_HEXSZ + 1];
+  const git_oid *new_id;
+  git_oid zero;
+  long long time;
+  int offset, error;
+  my_bool expected_is_null, message_is_null;
+  size_t i;
+
+  assert(ref && _backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  name = git_reference_name(ref);
+
+  if (git_reference_target(ref) != NULL) {
+    git_oid_tostr(target_buf, sizeof(target_buf), git_reference_target(ref));
+    target = target_buf;
+    type = GIT_REF_OID;
+  } else {
+    target = git_reference_symbolic_target(ref);
+    type = GIT_REF_SYMBOLIC;
+  }
+
+  expected = NULL;
+  if (old != NULL) {
+    git_oid_tostr(expected_buf, sizeof(expected_buf), old);
+    expected = expected_buf;
+  } else if (old_target != NULL) {
+    expected = old_target;
+  }
+
+  // the whole write is one CALL, see init_refdb: the procedure locks the
+  // ref row, compares it to the expected value, writes it and logs the
+  // change with the old value it read, all in a transaction of its own
+  // unless a git_transaction already has one open
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  bind_string(&bind_buffers[0], name, &name_len);
+
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[1].is_unsigned = 1;
+
+  bind_string(&bind_buffers[2], target, &target_len);
+
+  expected_is_null = (expected == NULL);
+  bind_string(&bind_buffers[3], expected, &expected_len);
+  bind_buffers[3].is_null = &expected_is_null;
 
-  // this should either be 0 or 1
-  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read) == 1) {
-    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-    result_buffers[0].buffer = type_p;
-    result_buffers[0].buffer_length = sizeof(*type_p);
-    memset(type_p, 0, sizeof(*type_p));
+  replace = (force != 0);
+  bind_buffers[4].buffer = &replace;
+  bind_buffers[4].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[4].is_unsigned = 1;
 
-    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-    result_buffers[1].buffer = len_p;
-    result_buffers[1].buffer_length = sizeof(*len_p);
-    memset(len_p, 0, sizeof(*len_p));
+  own = (backend->txn_depth == 0);
+  bind_buffers[5].buffer = &own;
+  bind_buffers[5].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[5].is_unsigned = 1;
 
-    // by setting buffer and buffer_length to 0, this tells libmysql
-    // we want it to set data_len to the *actual* length of that field
-    // this way we can malloc exactly as much memory as we need for the buffer
-    //
-    // come to think of it, we can probably just use the length set in *len_p
-    // once we fetch the result?
-    result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
-    result_buffers[2].buffer = 0;
-    result_buffers[2].buffer_length = 0;
-    result_buffers[2].length = &data_len;
+  // symbolic refs are logged with the zero oid, and a write without a
+  // signature isn't logged at all
+  if (who != NULL) {
+    memset(&zero, 0, sizeof(zero));
+    new_id = git_reference_target(ref) ? git_reference_target(ref) : &zero;
 
-    if(mysql_stmt_bind_result(backend->st_read, result_buffers) != 0)
-      return GIT_ERROR;
+    new_id_len = GIT_OID_RAWSZ;
+    bind_buffers[6].buffer = (void*)new_id->id;
+    bind_buffers[6].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[6].length = &new_id_len;
+    bind_buffers[6].buffer_type = MYSQL_TYPE_BLOB;
 
-    // this should populate the buffers at *type_p, *len_p and &data_len
-    error = mysql_stmt_fetch(backend->st_read);
-    // if(error != 0 || error != MYSQL_DATA_TRUNCATED)
-    //   return GIT_ERROR;
+    bind_string(&bind_buffers[7], who->name, &committer_name_len);
+    bind_string(&bind_buffers[8], who->email, &committer_email_len);
 
-    if (data_len > 0) {
-      *data_p = malloc(data_len);
-      result_buffers[2].buffer = *data_p;
-      result_buffers[2].buffer_length = data_len;
+    time = (long long)who->when.time;
+    bind_buffers[9].buffer = &time;
+    bind_buffers[9].buffer_type = MYSQL_TYPE_LONGLONG;
 
-      if (mysql_stmt_fetch_column(backend->st_read, &result_buffers[2], 2, 0) != 0)
-        return GIT_ERROR;
-    }
+    offset = who->when.offset;
+    bind_buffers[10].buffer = &offset;
+    bind_buffers[10].buffer_type = MYSQL_TYPE_LONG;
 
-    error = GIT_OK;
+    message_is_null = (message == NULL);
+    bind_string(&bind_buffers[11], message, &message_len);
+    bind_buffers[11].is_null = &message_is_null;
   } else {
-    error = GIT_ENOTFOUND;
+    for (i = 6; i < 12; i++)
+      bind_buffers[i].buffer_type = MYSQL_TYPE_NULL;
   }
 
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read) != 0)
-    return 0;
+  error = refdb_call(backend->st_write, bind_buffers);
+  if (error == GIT_EEXISTS)
+    giterr_set_str(GITERR_REFERENCE, "failed to write reference, it already exists");
 
-  return error;
+  return refdb_end(backend, 0, error);
 }
 
-int mysql_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+int mysql_refdb_backend__del(git_refdb_backend *_backend, const char *ref_name, const git_oid *old, const char *old_target)
 {
-  mysql_backend *backend;
-  int found;
-  MYSQL_BIND bind_buffers[1];
-
-  assert(_backend && oid);
-
-  backend = (mysql_backend *)_backend;
-  found = 0;
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[2];
+  unsigned long name_len, expected_len;
+  const char *expected;
+  char expected_buf[GIT_OID_HEXSZ + 1];
+  my_ulonglong affected_rows;
+  int error;
 
-  memset(bind_buffers, 0, sizeof(bind_buffers));
+  assert(ref_name && _backend);
 
-  // bind the oid passed to the statement
-  bind_buffers[0].buffer = (void*)oid->id;
-  bind_buffers[0].buffer_length = 20;
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
-    return 0;
+  backend = (mysql_refdb_backend *)_backend;
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
-    return 0;
+  expected = NULL;
+  if (old != NULL) {
+    git_oid_tostr(expected_buf, sizeof(expected_buf), old);
+    expected = expected_buf;
+  } else if (old_target != NULL) {
+    expected = old_target;
+  }
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
-    return 0;
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], ref_name, &name_len);
+  bind_string(&bind_buffers[1], expected, &expected_len);
 
-  // now lets see if any rows matched our query
-  // this should either be 0 or 1
-  // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
-    found = 1;
+  // the ref and its reflog go in the same statement
+  error = refdb_execute(expected ? backend->st_delete_cas : backend->st_delete, bind_buffers, &affected_rows);
+  if (error == GIT_OK && affected_rows == 0) {
+    if (expected) {
+      giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+      error = GIT_EMODIFIED;
+    } else {
+      giterr_set_str(GITERR_REFERENCE, "MySQL refdb couldn't find ref");
+      error = GIT_ENOTFOUND;
+    }
   }
 
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
-    return 0;
-
-  return found;
+  return refdb_end(backend, 0, error);
 }
 
-int mysql_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+int mysql_refdb_backend__rename(git_reference **out, git_refdb_backend *_backend, const char *old_name,
+        const char *new_name, int force, const git_signature *who, const char *message)
 {
-  int error;
-  mysql_backend *backend;
-  MYSQL_BIND bind_buffers[4];
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[2];
+  unsigned long old_name_len, new_name_len;
   my_ulonglong affected_rows;
+  int error, started;
 
-  assert(oid && _backend && data);
+  assert(out && old_name && new_name && _backend);
 
-  backend = (mysql_backend *)_backend;
+  backend = (mysql_refdb_backend *)_backend;
+  *out = NULL;
+
+  if ((error = refdb_begin(backend, &started)) < 0)
+    return error;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
-  // bind the oid
-  bind_buffers[0].buffer = (void*)oid->id;
-  bind_buffers[0].buffer_length = 20;
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  if (force) {
+    bind_string(&bind_buffers[0], new_name, &new_name_len);
+    if ((error = refdb_execute(backend->st_delete, bind_buffers, NULL)) < 0)
+      goto done;
+  }
 
-  // bind the type
-  bind_buffers[1].buffer = &type;
-  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  bind_string(&bind_buffers[0], new_name, &new_name_len);
+  bind_string(&bind_buffers[1], old_name, &old_name_len);
+
+  error = refdb_execute(backend->st_rename, bind_buffers, &affected_rows);
+  if (error == GIT_EEXISTS) {
+    giterr_set_str(GITERR_REFERENCE, "failed to rename reference, the new name already exists");
+    goto done;
+  } else if (error < 0) {
+    goto done;
+  } else if (affected_rows != 1) {
+    giterr_set_str(GITERR_REFERENCE, "MySQL refdb couldn't find ref");
+    error = GIT_ENOTFOUND;
+    goto done;
+  }
 
-  // bind the size of the data
-  bind_buffers[2].buffer = &len;
-  bind_buffers[2].buffer_type = MYSQL_TYPE_LONG;
+  if ((error = refdb_execute(backend->st_reflog_rename, bind_buffers, NULL)) < 0)
+    goto done;
 
-  // bind the data
-  bind_buffers[3].buffer = (void*)data;
-  bind_buffers[3].buffer_length = len;
-  bind_buffers[3].length = &bind_buffers[3].buffer_length;
-  bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+  if ((error = mysql_refdb_backend__lookup(out, _backend, new_name)) < 0)
+    goto done;
 
-  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0)
-    return GIT_ERROR;
+  if (who != NULL)
+    error = refdb_append_log(backend, new_name, git_reference_target(*out), git_reference_target(*out),
+      who, message);
 
-  // TODO: use the streaming backend API so this actually makes sense to use :P
-  // once we want to use this we should comment out 
-  // if (mysql_stmt_send_long_data(backend->st_write, 2, data, len) != 0)
-  //   return GIT_ERROR;
+done:
+  error = refdb_end(backend, started, error);
+  if (error < 0 && *out != NULL) {
+    git_reference_free(*out);
+    *out = NULL;
+  }
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_write) != 0)
-    return GIT_ERROR;
+  return error;
+}
+
+int mysql_refdb_backend__lock(void **payload_out, git_refdb_backend *_backend, const char *refname)
+{
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[1];
+  unsigned long name_len;
+  my_ulonglong num_rows;
+  char *payload;
+
+  assert(payload_out && _backend && refname);
 
-  // now lets see if the insert worked
-  affected_rows = mysql_stmt_affected_rows(backend->st_write);
-  if (affected_rows != 1)
+  backend = (mysql_refdb_backend *)_backend;
+
+  payload = strdup(refname);
+  if (payload == NULL) {
+    giterr_set_oom();
     return GIT_ERROR;
+  }
 
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
+  // all refs of a git_transaction are updated in the same database
+  // transaction, opened when the first one gets locked
+  if (backend->txn_depth == 0) {
+    if (refdb_query(backend->db, "START TRANSACTION;") < 0) {
+      free(payload);
+      return GIT_ERROR;
+    }
+
+    backend->txn_failed = 0;
+  }
+
+  backend->txn_depth++;
+
+  // take the row lock (or the gap lock for a ref that doesn't exist
+  // yet) right away, so concurrent writers wait for us
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], refname, &name_len);
+
+  if (refdb_count(backend->st_lock, bind_buffers, &num_rows) < 0) {
+    if (--backend->txn_depth == 0)
+      mysql_rollback(backend->db);
+
+    free(payload);
     return GIT_ERROR;
+  }
 
+  *payload_out = payload;
   return GIT_OK;
 }
 
-void mysql_backend__free(git_odb_backend *_backend)
+int mysql_refdb_backend__unlock(git_refdb_backend *_backend, void *payload, int success, int update_reflog,
+        const git_reference *ref, const git_signature *sig, const char *message)
 {
-  mysql_backend *backend;
+  mysql_refdb_backend *backend;
+  int error;
+
+  assert(_backend && payload);
+
+  backend = (mysql_refdb_backend *)_backend;
+  error = GIT_OK;
+
+  // 2 means the ref is to be deleted, any other non-zero value updated
+  if (success == 2)
+    error = mysql_refdb_backend__del(_backend, (const char *)payload, NULL, NULL);
+  else if (success)
+    error = mysql_refdb_backend__write(_backend, ref, 1, update_reflog ? sig : NULL, message, NULL, NULL);
+
+  free(payload);
+
+  if (--backend->txn_depth > 0)
+    return error;
+
+  if (backend->txn_failed) {
+    mysql_rollback(backend->db);
+    if (error == GIT_OK) {
+      giterr_set_str(GITERR_REFERENCE, "MySQL refdb transaction rolled back");
+      error = GIT_ERROR;
+    }
+  } else if (mysql_commit(backend->db) != 0) {
+    giterr_set_str(GITERR_REFERENCE, mysql_error(backend->db));
+    error = GIT_ERROR;
+  }
+
+  return error;
+}
+
+void mysql_refdb_backend__free(git_refdb_backend *_backend)
+{
+  mysql_refdb_backend *backend;
+
   assert(_backend);
-  backend = (mysql_backend *)_backend;
+  backend = (mysql_refdb_backend *)_backend;
 
-  if (backend->st_read)
-    mysql_stmt_close(backend->st_read);
-  if (backend->st_read_header)
-    mysql_stmt_close(backend->st_read_header);
-  if (backend->st_write)
-    mysql_stmt_close(backend->st_write);
+  close_statement(backend->st_lookup);
+  close_statement(backend->st_write);
+  close_statement(backend->st_delete);
+  close_statement(backend->st_delete_cas);
+  close_statement(backend->st_rename);
+  close_statement(backend->st_lock);
+  close_statement(backend->st_has_log);
+  close_statement(backend->st_reflog_append);
+  close_statement(backend->st_reflog_rename);
+  close_statement(backend->st_reflog_delete);
 
-  mysql_close(backend->db);
+  if (backend->db)
+    mysql_close(backend->db);
 
   free(backend);
 }
 
-static int create_table(MYSQL *db)
+/* reflog methods */
+
+int mysql_refdb_backend__has_log(git_refdb_backend *_backend, const char *refname)
 {
-  static const char *sql_create =
-    "CREATE TABLE `" GIT2_TABLE_NAME "` ("
-    "  `oid` binary(20) NOT NULL DEFAULT '',"
-    "  `type` tinyint(1) unsigned NOT NULL,"
-    "  `size` bigint(20) unsigned NOT NULL,"
-    "  `data` longblob NOT NULL,"
-    "  PRIMARY KEY (`oid`),"
-    "  KEY `type` (`type`),"
-    "  KEY `size` (`size`)"
-    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[1];
+  unsigned long name_len;
+  my_ulonglong num_rows;
 
-  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+  assert(_backend && refname);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], refname, &name_len);
+
+  if (refdb_count(backend->st_has_log, bind_buffers, &num_rows) < 0)
     return GIT_ERROR;
 
+  return num_rows > 0;
+}
+
+int mysql_refdb_backend__ensure_log(git_refdb_backend *_backend, const char *refname)
+{
+  // there's nothing to create up front, entries are simply rows
   return GIT_OK;
 }
 
-static int init_db(MYSQL *db)
+int mysql_refdb_backend__reflog_read(git_reflog **out, git_refdb_backend *_backend, const char *name)
 {
-  static const char *sql_check =
-    "SHOW TABLES LIKE '" GIT2_TABLE_NAME "';";
+  // git_reflog is opaque outside of libgit2, so there's no way for us
+  // to build one from the stored entries
+  giterr_set_str(GITERR_REFERENCE, "MySQL refdb can't read reflogs back");
+  return GIT_ERROR;
+}
 
-  MYSQL_RES *res;
-  int error;
-  my_ulonglong num_rows;
+int mysql_refdb_backend__reflog_write(git_refdb_backend *_backend, git_reflog *reflog)
+{
+  giterr_set_str(GITERR_REFERENCE, "MySQL refdb can't rewrite reflogs");
+  return GIT_ERROR;
+}
 
-  if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
-    return GIT_ERROR;
+int mysql_refdb_backend__reflog_rename(git_refdb_backend *_backend, const char *old_name, const char *new_name)
+{
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[2];
+  unsigned long old_name_len, new_name_len;
 
-  res = mysql_store_result(db);
-  if (res == NULL)
-    return GIT_ERROR;
+  assert(_backend && old_name && new_name);
 
-  num_rows = mysql_num_rows(res);
-  if (num_rows == 0) {
-    /* the table was not found */
-    error = create_table(db);
-  } else if (num_rows > 0) {
-    /* the table was found */
-    error = GIT_OK;
-  } else {
-    error = GIT_ERROR;
-  }
+  backend = (mysql_refdb_backend *)_backend;
 
-  mysql_free_result(res);
-  return error;
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], new_name, &new_name_len);
+  bind_string(&bind_buffers[1], old_name, &old_name_len);
+
+  return refdb_execute(backend->st_reflog_rename, bind_buffers, NULL);
 }
 
-static int init_statements(mysql_backend *backend)
+int mysql_refdb_backend__reflog_delete(git_refdb_backend *_backend, const char *name)
 {
-  my_bool truth = 1;
+  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[1];
+  unsigned long name_len;
 
-  static const char *sql_read =
-    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+  assert(_backend && name);
 
-  static const char *sql_read_header =
-    "SELECT `type`, `size` FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+  backend = (mysql_refdb_backend *)_backend;
 
-  static const char *sql_write =
-    "INSERT IGNORE INTO `" GIT2_TABLE_NAME "` VALUES (?, ?, ?, COMPRESS(?));";
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  bind_string(&bind_buffers[0], name, &name_len);
+
+  return refdb_execute(backend->st_reflog_delete, bind_buffers, NULL);
+}
+
+static int init_refdb(MYSQL *db)
+{
+  static const char *sql_create_refs =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFS_TABLE_NAME "` ("
+    "  `name` varbinary(" GIT2_XSTR(GIT2_REF_NAME_MAX) ") NOT NULL,"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `target` varbinary(" GIT2_XSTR(GIT2_REF_TARGET_MAX) ") NOT NULL,"
+    "  PRIMARY KEY (`name`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+  static const char *sql_create_reflog =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFLOG_TABLE_NAME "` ("
+    "  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+    "  `name` varbinary(" GIT2_XSTR(GIT2_REF_NAME_MAX) ") NOT NULL,"
+    "  `old_oid` binary(20) NOT NULL,"
+    "  `new_oid` binary(20) NOT NULL,"
+    "  `committer_name` varbinary(255) NOT NULL,"
+    "  `committer_email` varbinary(255) NOT NULL,"
+    "  `time` bigint(20) NOT NULL,"
+    "  `offset` int(11) NOT NULL,"
+    "  `message` blob,"
+    "  PRIMARY KEY (`id`),"
+    "  KEY `name` (`name`, `id`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
 
+  // a ref write in one round trip, see mysql_refdb_backend__write. The
+  // row is locked before anything else so writers of the same ref queue
+  // up on it, and the old value that gets logged is the one it held then.
+  // A ref that doesn't hold the expected value is signalled, and p_own
+  // says whether the procedure runs in a transaction of its own.
+  static const char *sql_create_write =
+    "CREATE PROCEDURE `" GIT2_REFS_WRITE_PROCEDURE "` ("
+    "  IN `p_name` varbinary(" GIT2_XSTR(GIT2_REF_NAME_MAX) "),"
+    "  IN `p_type` tinyint(1) unsigned,"
+    "  IN `p_target` varbinary(" GIT2_XSTR(GIT2_REF_TARGET_MAX) "),"
+    "  IN `p_expected` varbinary(" GIT2_XSTR(GIT2_REF_TARGET_MAX) "),"
+    "  IN `p_force` tinyint(1) unsigned,"
+    "  IN `p_own` tinyint(1) unsigned,"
+    "  IN `p_new_oid` binary(20),"
+    "  IN `p_committer_name` varbinary(255),"
+    "  IN `p_committer_email` varbinary(255),"
+    "  IN `p_time` bigint(20),"
+    "  IN `p_offset` int(11),"
+    "  IN `p_message` blob)"
+    " BEGIN"
+    "  DECLARE `v_type` tinyint(1) unsigned DEFAULT NULL;"
+    "  DECLARE `v_target` varbinary(" GIT2_XSTR(GIT2_REF_TARGET_MAX) ") DEFAULT NULL;"
+    "  DECLARE CONTINUE HANDLER FOR NOT FOUND BEGIN END;"
+    "  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN"
+    "    IF `p_own` THEN ROLLBACK; END IF;"
+    "    RESIGNAL;"
+    "  END;"
+    "  IF `p_own` THEN START TRANSACTION; END IF;"
+    "  SELECT `type`, `target` INTO `v_type`, `v_target` FROM `" GIT2_REFS_TABLE_NAME "`"
+    "    WHERE `name` = `p_name` FOR UPDATE;"
+    "  IF `p_expected` IS NOT NULL THEN"
+    "    IF `v_target` IS NULL OR `v_target` <> `p_expected` THEN"
+    "      SIGNAL SQLSTATE '45000' SET MESSAGE_TEXT = 'old reference value does not match';"
+    "    END IF;"
+    "    UPDATE `" GIT2_REFS_TABLE_NAME "` SET `type` = `p_type`, `target` = `p_target`"
+    "      WHERE `name` = `p_name`;"
+    "  ELSEIF `p_force` THEN"
+    "    INSERT INTO `" GIT2_REFS_TABLE_NAME "` (`name`, `type`, `target`) VALUES (`p_name`, `p_type`, `p_target`)"
+    "      ON DUPLICATE KEY UPDATE `type` = `p_type`, `target` = `p_target`;"
+    "  ELSE"
+    "    INSERT INTO `" GIT2_REFS_TABLE_NAME "` (`name`, `type`, `target`) VALUES (`p_name`, `p_type`, `p_target`);"
+    "  END IF;"
+    "  IF `p_committer_name` IS NOT NULL THEN"
+    "    INSERT INTO `" GIT2_REFLOG_TABLE_NAME "`"
+    "      (`name`, `old_oid`, `new_oid`, `committer_name`, `committer_email`, `time`, `offset`, `message`)"
+    "      VALUES (`p_name`, IF(`v_type` = 1, UNHEX(`v_target`), UNHEX(REPEAT('0', 40))), `p_new_oid`,"
+    "      `p_committer_name`, `p_committer_email`, `p_time`, `p_offset`, `p_message`);"
+    "  END IF;"
+    "  IF `p_own` THEN COMMIT; END IF;"
+    " END;";
 
-  backend->st_read = mysql_stmt_init(backend->db);
-  if (backend->st_read == NULL)
+  if (refdb_query(db, sql_create_refs) < 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_attr_set(backend->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+  if (refdb_query(db, sql_create_reflog) < 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_prepare(backend->st_read, sql_read, strlen(sql_read)) != 0)
+  // another client may have created it first, which is just as good
+  if (mysql_real_query(db, sql_create_write, strlen(sql_create_write)) != 0 &&
+      mysql_errno(db) != ER_SP_ALREADY_EXISTS) {
+    giterr_set_str(GITERR_REFERENCE, mysql_error(db));
     return GIT_ERROR;
+  }
 
+  return GIT_OK;
+}
 
-  backend->st_read_header = mysql_stmt_init(backend->db);
-  if (backend->st_read_header == NULL)
-    return GIT_ERROR;
+static int init_refdb_statements(mysql_refdb_backend *backend)
+{
+  static const char *sql_lookup =
+    "SELECT `type`, `target` FROM `" GIT2_REFS_TABLE_NAME "` WHERE `name` = ?;";
 
-  if (mysql_stmt_attr_set(backend->st_read_header, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  static const char *sql_write =
+    "CALL `" GIT2_REFS_WRITE_PROCEDURE "`(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
 
-  if (mysql_stmt_prepare(backend->st_read_header, sql_read_header, strlen(sql_read)) != 0)
-    return GIT_ERROR;
+  static const char *sql_delete =
+    "DELETE `r`, `l` FROM `" GIT2_REFS_TABLE_NAME "` AS `r`"
+    " LEFT JOIN `" GIT2_REFLOG_TABLE_NAME "` AS `l` ON `l`.`name` = `r`.`name`"
+    " WHERE `r`.`name` = ?;";
 
+  static const char *sql_delete_cas =
+    "DELETE `r`, `l` FROM `" GIT2_REFS_TABLE_NAME "` AS `r`"
+    " LEFT JOIN `" GIT2_REFLOG_TABLE_NAME "` AS `l` ON `l`.`name` = `r`.`name`"
+    " WHERE `r`.`name` = ? AND `r`.`target` = ?;";
 
-  backend->st_write = mysql_stmt_init(backend->db);
-  if (backend->st_write == NULL)
-    return GIT_ERROR;
+  static const char *sql_rename =
+    "UPDATE `" GIT2_REFS_TABLE_NAME "` SET `name` = ? WHERE `name` = ?;";
 
-  if (mysql_stmt_attr_set(backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  static const char *sql_lock =
+    "SELECT `type`, `target` FROM `" GIT2_REFS_TABLE_NAME "` WHERE `name` = ? FOR UPDATE;";
 
-  if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_read)) != 0)
-    return GIT_ERROR;
+  static const char *sql_has_log =
+    "SELECT 1 FROM `" GIT2_REFLOG_TABLE_NAME "` WHERE `name` = ? LIMIT 1;";
+
+  static const char *sql_reflog_append =
+    "INSERT INTO `" GIT2_REFLOG_TABLE_NAME "`"
+    " (`name`, `old_oid`, `new_oid`, `committer_name`, `committer_email`, `time`, `offset`, `message`)"
+    " VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+
+  static const char *sql_reflog_rename =
+    "UPDATE `" GIT2_REFLOG_TABLE_NAME "` SET `name` = ? WHERE `name` = ?;";
+
+  static const char *sql_reflog_delete =
+    "DELETE FROM `" GIT2_REFLOG_TABLE_NAME "` WHERE `name` = ?;";
 
+  if ((backend->st_lookup = init_statement(backend->db, sql_lookup)) == NULL ||
+      (backend->st_write = init_statement(backend->db, sql_write)) == NULL ||
+      (backend->st_delete = init_statement(backend->db, sql_delete)) == NULL ||
+      (backend->st_delete_cas = init_statement(backend->db, sql_delete_cas)) == NULL ||
+      (backend->st_rename = init_statement(backend->db, sql_rename)) == NULL ||
+      (backend->st_lock = init_statement(backend->db, sql_lock)) == NULL ||
+      (backend->st_has_log = init_statement(backend->db, sql_has_log)) == NULL ||
+      (backend->st_reflog_append = init_statement(backend->db, sql_reflog_append)) == NULL ||
+      (backend->st_reflog_rename = init_statement(backend->db, sql_reflog_rename)) == NULL ||
+      (backend->st_reflog_delete = init_statement(backend->db, sql_reflog_delete)) == NULL)
+    return GIT_ERROR;
 
   return GIT_OK;
 }
 
-int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+int git_refdb_backend_mysql(git_refdb_backend **backend_out, const char *mysql_host,
         const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
         unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
 {
-  mysql_backend *backend;
-  int error;
-  my_bool reconnect;
+  mysql_refdb_backend *backend;
 
-  backend = calloc(1, sizeof(mysql_backend));
+  backend = calloc(1, sizeof(mysql_refdb_backend));
   if (backend == NULL) {
     giterr_set_oom();
     return GIT_ERROR;
   }
 
-  backend->db = mysql_init(backend->db);
-
-  reconnect = 1;
-  // allow libmysql to reconnect gracefully
-  if (mysql_options(backend->db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
+  // a rename checks the number of rows its UPDATE matched, not the
+  // number it had to change; writes CALL a procedure, whose results only
+  // come back to clients that can take more than one
+  backend->db = connect_db(mysql_host, mysql_user, mysql_passwd, mysql_db,
+    mysql_port, mysql_unix_socket, mysql_client_flag | CLIENT_FOUND_ROWS | CLIENT_MULTI_RESULTS);
+  if (backend->db == NULL)
     goto cleanup;
 
-  // make the connection
-  if (mysql_real_connect(backend->db, mysql_host, mysql_user, mysql_passwd, mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) != backend->db)
+  if (init_refdb(backend->db) < 0)
     goto cleanup;
 
-  // check for and possibly create the database
-  error = init_db(backend->db);
-  if (error < 0)
+  if (init_refdb_statements(backend) < 0)
     goto cleanup;
 
-  error = init_statements(backend);
-  if (error < 0)
-    goto cleanup;
+  backend->parent.version = GIT_REFDB_BACKEND_VERSION;
 
-  backend->parent.version = GIT_ODB_BACKEND_VERSION;
-  backend->parent.read = &mysql_backend__read;
-  backend->parent.read_header = &mysql_backend__read_header;
-  backend->parent.write = &mysql_backend__write;
-  backend->parent.exists = &mysql_backend__exists;
-  backend->parent.free = &mysql_backend__free;
+  backend->parent.exists = &mysql_refdb_backend__exists;
+  backend->parent.lookup = &mysql_refdb_backend__lookup;
+  backend->parent.iterator = &mysql_refdb_backend__iterator;
+  backend->parent.write = &mysql_refdb_backend__write;
+  backend->parent.del = &mysql_refdb_backend__del;
+  backend->parent.rename = &mysql_refdb_backend__rename;
+  backend->parent.compress = NULL;
+  backend->parent.lock = &mysql_refdb_backend__lock;
+  backend->parent.unlock = &mysql_refdb_backend__unlock;
+  backend->parent.free = &mysql_refdb_backend__free;
 
-  *backend_out = (git_odb_backend *)backend;
+  backend->parent.has_log = &mysql_refdb_backend__has_log;
+  backend->parent.ensure_log = &mysql_refdb_backend__ensure_log;
+  backend->parent.reflog_read = &mysql_refdb_backend__reflog_read;
+  backend->parent.reflog_write = &mysql_refdb_backend__reflog_write;
+  backend->parent.reflog_rename = &mysql_refdb_backend__reflog_rename;
+  backend->parent.reflog_delete = &mysql_refdb_backend__reflog_delete;
+
+  *backend_out = (git_refdb_backend *)backend;
   return GIT_OK;
 
 cleanup:
-  mysql_backend__free((git_odb_backend *)backend);
+  mysql_refdb_backend__free((git_refdb_backend *)backend);
   return GIT_ERROR;
 }
@@ -0,0 +1,219 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDE_git2_sqlite_h__
+#define INCLUDE_git2_sqlite_h__
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+#define GIT_ODB_SQLITE_OPTIONS_VERSION 1
+
+/* how the database file is opened and tuned, see GIT_ODB_SQLITE_OPTIONS_INIT */
+typedef struct {
+	unsigned int version;
+
+	/* the journal_mode pragma, e.g. "WAL" or "DELETE"; NULL keeps SQLite's default */
+	const char *journal_mode;
+
+	/* the synchronous pragma: 0 OFF, 1 NORMAL, 2 FULL, 3 EXTRA; -1 keeps the default */
+	int synchronous;
+
+	/* bytes of the file to memory map, 0 turns it off, -1 keeps the default */
+	long long mmap_size;
+
+	/* page size for new databases, 0 keeps the default */
+	int page_size;
+
+	/* the cache_size pragma: pages if positive, KiB if negative; 0 keeps the default */
+	int cache_size;
+
+	/* milliseconds to wait for a lock held by another connection */
+	int busy_timeout;
+
+	/* open read-only; immutable also tells SQLite nobody else writes the file */
+	int readonly;
+	int immutable;
+
+	/*
+	 * Group writes into one transaction, committed once this many
+	 * objects or bytes have been written or this many milliseconds have
+	 * passed since the first, whichever comes first; all 0 commits every
+	 * write on its own. All three are checked on write, so a batch is
+	 * only committed for its age by the next write after batch_ms; call
+	 * git_odb_backend_sqlite_flush when writes stop. Writes still pending
+	 * are also committed when the backend is freed.
+	 */
+	size_t batch_objects;
+	size_t batch_bytes;
+	unsigned int batch_ms;
+
+	/*
+	 * Extra read-only connections, each used by one thread at a time, so
+	 * that reads from several threads run in parallel. Reads go through
+	 * the read-write connection instead while batched writes are still
+	 * uncommitted, and always for in-memory databases or with 0 here.
+	 */
+	unsigned int read_connections;
+
+	/*
+	 * Storage: deflate objects at this zlib level, 1-9, 0 to store them
+	 * as they are; and let git_odb_backend_sqlite_write_delta build delta
+	 * chains up to this long, 0 to store every object in full. Setting
+	 * either upgrades the table to a schema older versions of this
+	 * backend can read from but not write to. Reading deltas keeps up to
+	 * delta_cache_size bytes of their bases around.
+	 */
+	int compression;
+	unsigned int delta_depth;
+	size_t delta_cache_size;
+
+	/*
+	 * Keep the whole database in memory, loaded from the file at open if
+	 * it exists, and write it back to the file as a snapshot every
+	 * snapshot_ms milliseconds, on git_odb_backend_sqlite_snapshot and
+	 * when the backend is freed; only if anything changed, and never for
+	 * a read-only open. Writes made since the last snapshot are lost in
+	 * a crash. Reads all go through the one connection.
+	 */
+	int in_memory;
+	unsigned int snapshot_ms;
+
+	/*
+	 * the auto_vacuum pragma: 0 NONE, 1 FULL, 2 INCREMENTAL, which
+	 * git_odb_backend_sqlite_compact needs; -1 keeps the default. It only
+	 * takes for new files, or existing ones after a VACUUM.
+	 */
+	int auto_vacuum;
+} git_odb_sqlite_options;
+
+/*
+ * WAL lets readers go on while a write is in progress, and with it
+ * synchronous NORMAL is still safe against corruption; reads come from
+ * up to 256MiB of memory mapped file instead of read() calls.
+ */
+#define GIT_ODB_SQLITE_OPTIONS_INIT \
+	{ GIT_ODB_SQLITE_OPTIONS_VERSION, "WAL", 1, 256 * 1024 * 1024, 0, 0, 5000, 0, 0, 0, 0, 0, 4, 0, 0, 16 * 1024 * 1024, 0, 0, -1 }
+
+int git_odb_sqlite_init_options(git_odb_sqlite_options *opts, unsigned int version);
+
+/* opens sqlite_db with GIT_ODB_SQLITE_OPTIONS_INIT */
+int git_odb_backend_sqlite(git_odb_backend **backend_out, const char *sqlite_db);
+
+/* opens sqlite_db with the given options, NULL for the defaults */
+int git_odb_backend_sqlite_ext(git_odb_backend **backend_out, const char *sqlite_db,
+	const git_odb_sqlite_options *opts);
+
+/* commit the writes held back by batching or bulk-load mode */
+int git_odb_backend_sqlite_flush(git_odb_backend *backend);
+
+/*
+ * Bulk-load mode for filling a fresh database: writes are held back,
+ * sorted by oid and inserted a large batch at a time with
+ * synchronous=OFF. A crash in the middle can lose or, without WAL,
+ * corrupt the database. read, read_header and exists find objects that
+ * are held back without writing them out; other reads, such as by
+ * prefix, foreach and streams, flush first. bulk_end flushes and
+ * restores the previous synchronous setting.
+ */
+int git_odb_backend_sqlite_bulk_begin(git_odb_backend *backend);
+int git_odb_backend_sqlite_bulk_end(git_odb_backend *backend);
+
+/*
+ * Write an object as a delta against base, an object already in the
+ * database; it is stored in full instead if base is missing, the chain
+ * would get longer than delta_depth or the delta isn't any smaller.
+ * git's own choice of bases (similar paths, previous versions of the
+ * same file) is up to the caller.
+ */
+int git_odb_backend_sqlite_write_delta(git_odb_backend *backend, const git_oid *id, const void *data, size_t len,
+	git_otype type, const git_oid *base);
+
+/*
+ * Write an in-memory database to its file now; the file is replaced
+ * whole, by way of a temporary file next to it.
+ */
+int git_odb_backend_sqlite_snapshot(git_odb_backend *backend);
+
+/*
+ * Give back up to max_pages free pages to the file system, stopping
+ * after about max_ms milliseconds; 0 for no limit. The work is done in
+ * small steps that let reads and writes in between. freed_out, if not
+ * NULL, gets the number of pages given back.
+ */
+int git_odb_backend_sqlite_compact(git_odb_backend *backend, size_t max_pages, unsigned int max_ms,
+	size_t *freed_out);
+
+/* space used by the database, summed over all files of a sharded odb */
+typedef struct {
+	size_t page_size;
+	size_t page_count;
+
+	/* pages that are free but still part of the file */
+	size_t freelist_count;
+
+	/* the auto_vacuum pragma, of the last file for a sharded odb */
+	int auto_vacuum;
+
+	/*
+	 * pages a scan of the object tables reads, and how many of them don't
+	 * follow the one read before them in the file; only a VACUUM puts
+	 * them back in order. Left at 0 unless asked for.
+	 */
+	size_t scan_pages;
+	size_t unordered_pages;
+} git_odb_sqlite_stats;
+
+/*
+ * Fill in out; with fragmentation set also count scan_pages and
+ * unordered_pages, which reads every page of the object tables and
+ * needs an SQLite built with SQLITE_ENABLE_DBSTAT_VTAB.
+ */
+int git_odb_backend_sqlite_stats(git_odb_sqlite_stats *out, git_odb_backend *backend, int fragmentation);
+
+/*
+ * Spread objects over count database files in dir, odb-000.db and up,
+ * by the first byte of their oid. Every file has a writer of its own, so
+ * writes to different files go on in parallel; opts apply to each file,
+ * read_connections and in_memory included. The count is fixed when the
+ * files are created. flush, bulk_begin/end, snapshot, compact, stats
+ * and write_delta work on the result too, but a delta against a base in
+ * another file is written in full.
+ */
+int git_odb_backend_sqlite_sharded(git_odb_backend **backend_out, const char *dir, unsigned int count,
+	const git_odb_sqlite_options *opts);
+
+/*
+ * Refs and reflogs in the git2_refs and git2_reflog tables, which can
+ * live in the same file as the objects. The refdb has a connection of
+ * its own; give it the options the ODB was opened with so they agree on
+ * the journal mode. A git_transaction is one SQLite transaction.
+ */
+int git_refdb_backend_sqlite(git_refdb_backend **backend_out, const char *sqlite_db);
+int git_refdb_backend_sqlite_ext(git_refdb_backend **backend_out, const char *sqlite_db,
+	const git_odb_sqlite_options *opts);
+
+#endif
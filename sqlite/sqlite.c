@@ -24,256 +24,4305 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <git2/sys/refs.h>
+#include <fnmatch.h>
 #include <sqlite3.h>
+#include <zlib.h>
+#include "git2-sqlite.h"
 
 #define GIT2_TABLE_NAME "git2_odb"
+#define GIT2_DATA_TABLE_NAME "git2_odb_data"
+#define GIT2_REFS_TABLE_NAME "git2_refs"
+#define GIT2_REFLOG_TABLE_NAME "git2_reflog"
+
+/*
+ * the newest schema, kept in PRAGMA user_version; databases from before
+ * it have 0, and v3 is only set up when compression or deltas are asked
+ * for, see migrate_v2
+ */
+#define GIT2_SCHEMA_VERSION 3
+
+/* the flags column of v3, how the data column is to be read back */
+#define GIT2_DEFLATED 0x01
+#define GIT2_DELTA 0x02
+
+/* deltas match the base in blocks of this many bytes */
+#define GIT2_DELTA_BLOCK 16
+
+/* chains longer than this are taken for loops in a corrupted database */
+#define GIT2_DELTA_MAX_DEPTH 1024
+
+#define GIT2_CACHE_SLOTS 256
+
+/* oids fetched per query by foreach */
+#define GIT2_FOREACH_PAGE 1024
+
+#define GIT2_STR(x) #x
+#define GIT2_XSTR(x) GIT2_STR(x)
+
+/* objects held back in bulk-load mode before they are sorted and written */
+#define GIT2_BULK_OBJECTS 16384
+#define GIT2_BULK_BYTES (64 * 1024 * 1024)
+
+/* objects held back past the sorted ones before lookups sort them again */
+#define GIT2_BULK_UNSORTED 256
+
+/* pages freed per incremental_vacuum step, between which others get the lock */
+#define GIT2_VACUUM_STEP 128
+
+/* pages copied per snapshot backup step, likewise */
+#define GIT2_BACKUP_STEP 1024
+
+/* times writes may start a stepped snapshot over before it is done in one go */
+#define GIT2_BACKUP_RESTARTS 4
 
 typedef struct {
-	git_odb_backend parent;
+	git_oid oid;
+	git_otype type;
+	size_t len;
+	void *data;
+} sqlite_bulk_entry;
+
+/* a connection and the statements that read through it */
+typedef struct sqlite_reader {
 	sqlite3 *db;
 	sqlite3_stmt *st_read;
-	sqlite3_stmt *st_write;
 	sqlite3_stmt *st_read_header;
+	sqlite3_stmt *st_read_prefix;
+	struct sqlite_reader *next;
+} sqlite_reader;
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+	char *data;
+	size_t len;
+	unsigned long used;
+} sqlite_cache_slot;
+
+typedef struct {
+	git_odb_stream parent;
+	sqlite3_int64 data_id;
+	char *data;
+	size_t size;
+	size_t offset;
+} sqlite_readstream;
+
+typedef struct {
+	git_odb_stream parent;
+	git_otype type;
+	sqlite3_int64 data_id;
+	size_t offset;
+	int finalized;
+} sqlite_writestream;
+
+typedef struct {
+	git_odb_backend parent;
+
+	/* the one read-write connection, only used with write_lock held */
+	sqlite_reader writer;
+	pthread_mutex_t write_lock;
+	sqlite3_stmt *st_write;
+	sqlite3_stmt *st_write_data;
+	sqlite3_stmt *st_delete_data;
+	sqlite3_stmt *st_read_depth;
+
+	/* read-only connections handed out by acquire_reader */
+	sqlite_reader *readers;
+	size_t reader_count;
+	sqlite_reader *idle_readers;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_available;
+
+	/* the table whose `data` column st_read's blob row ids point into */
+	const char *data_table;
+
+	/*
+	 * v2 keeps objects of up to inline_max bytes in the key table and
+	 * bigger ones in GIT2_DATA_TABLE_NAME, see create_table
+	 */
+	int schema_version;
+	size_t inline_max;
+
+	/* how v3 stores objects, see git_odb_sqlite_options */
+	int compression;
+	unsigned int delta_depth;
+
+	/* delta bases, see cache_apply */
+	sqlite_cache_slot cache[GIT2_CACHE_SLOTS];
+	size_t cache_bytes;
+	size_t cache_limit;
+	unsigned long cache_tick;
+	pthread_mutex_t cache_lock;
+
+	/* write batching, see git_odb_sqlite_options */
+	size_t batch_objects;
+	size_t batch_bytes;
+	unsigned int batch_ms;
+	int in_transaction;
+	size_t pending_objects;
+	size_t pending_bytes;
+	struct timespec batch_start;
+
+	/* bulk-load mode, see git_odb_backend_sqlite_bulk_begin */
+	int bulk;
+	int bulk_synchronous;
+	sqlite_bulk_entry *bulk_entries;
+	size_t bulk_count;
+	size_t bulk_sorted;
+	size_t bulk_size;
+	size_t bulk_bytes;
+
+	/*
+	 * in-memory mode, see git_odb_sqlite_options: the file snapshots are
+	 * written to, the change count they were last taken at, whether one
+	 * is being taken, and the thread taking them every snapshot_ms
+	 */
+	char *snapshot_path;
+	int snapshot_changes;
+	int snapshot_busy;
+	pthread_cond_t snapshot_done;
+	unsigned int snapshot_ms;
+	int snapshot_running;
+	int snapshot_stop;
+	pthread_t snapshot_thread;
+	pthread_mutex_t snapshot_lock;
+	pthread_cond_t snapshot_wake;
 } sqlite_backend;
 
-int sqlite_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+typedef struct {
+	git_odb_backend parent;
+	sqlite_backend **shards;
+	unsigned int count;
+} sqlite_sharded_backend;
+
+typedef struct {
+	git_refdb_backend parent;
+	sqlite3 *db;
+	sqlite3_stmt *st_lookup;
+	sqlite3_stmt *st_insert;
+	sqlite3_stmt *st_upsert;
+	sqlite3_stmt *st_update;
+	sqlite3_stmt *st_delete;
+	sqlite3_stmt *st_delete_cas;
+	sqlite3_stmt *st_rename;
+	sqlite3_stmt *st_has_log;
+	sqlite3_stmt *st_reflog_append;
+	sqlite3_stmt *st_reflog_rename;
+	sqlite3_stmt *st_reflog_delete;
+
+	/*
+	 * refs locked by the git_transaction in flight, which all share one
+	 * database transaction that is committed when the last one is unlocked
+	 */
+	size_t txn_depth;
+	int txn_failed;
+} sqlite_refdb_backend;
+
+typedef struct {
+	git_reference_iterator parent;
+	sqlite3_stmt *st;
+	char *glob;
+
+	/* the bounds of the range scan, bound to st */
+	char *prefix;
+	char *end;
+} sqlite_refdb_iterator;
+
+static int bulk_flush(sqlite_backend *backend);
+static int bulk_read(sqlite_backend *backend, const git_oid *oid, void **data_p, size_t *len_p, git_otype *type_p);
+
+static int batch_begin(sqlite_backend *backend);
+static int batch_commit(sqlite_backend *backend);
+
+static int flush(sqlite_backend *backend);
+static int bulk_end(sqlite_backend *backend);
+static void close_reader(sqlite_reader *reader);
+static int snapshot(sqlite_backend *backend);
+
+void sqlite_sharded_backend__free(git_odb_backend *_backend);
+static int sharded_each(git_odb_backend *_backend, int (*fn)(git_odb_backend *));
+static int sharded_write_delta(git_odb_backend *_backend, const git_oid *id, const void *data, size_t len,
+	git_otype type, const git_oid *base);
+
+/*
+ * v1 keys are the raw oid with TEXT affinity, v2 keys are BLOBs; static
+ * bindings are fine everywhere as they are only read while the statement
+ * steps
+ */
+static int bind_oid(sqlite_backend *backend, sqlite3_stmt *st, int index, const git_oid *oid)
+{
+	if (backend->schema_version >= 2)
+		return sqlite3_bind_blob(st, index, oid->id, GIT_OID_RAWSZ, SQLITE_STATIC);
+
+	return sqlite3_bind_text(st, index, (char *)oid->id, GIT_OID_RAWSZ, SQLITE_STATIC);
+}
+
+/*
+ * Hand out a connection to read with. Reads go to the pool of read-only
+ * connections, which run in parallel under WAL; but with writes batched,
+ * some may not be committed yet and only the writer can see them, so
+ * then the writer serves the read and stays locked until release_reader.
+ * Objects held back in bulk-load mode are written out first if the read
+ * has to see them; reads of single objects look through them with
+ * bulk_read instead.
+ */
+static sqlite_reader *acquire_reader(sqlite_backend *backend, int held_back)
+{
+	sqlite_reader *reader;
+
+	if (backend->reader_count == 0 || backend->batch_objects || backend->batch_bytes ||
+		backend->batch_ms || (backend->bulk && held_back)) {
+		pthread_mutex_lock(&backend->write_lock);
+
+		if (held_back && bulk_flush(backend) < 0) {
+			pthread_mutex_unlock(&backend->write_lock);
+			return NULL;
+		}
+
+		if (backend->reader_count == 0 || backend->in_transaction)
+			return &backend->writer;
+
+		pthread_mutex_unlock(&backend->write_lock);
+	}
+
+	pthread_mutex_lock(&backend->pool_lock);
+
+	while (backend->idle_readers == NULL)
+		pthread_cond_wait(&backend->pool_available, &backend->pool_lock);
+
+	reader = backend->idle_readers;
+	backend->idle_readers = reader->next;
+
+	pthread_mutex_unlock(&backend->pool_lock);
+	return reader;
+}
+
+static void release_reader(sqlite_backend *backend, sqlite_reader *reader)
+{
+	if (reader == &backend->writer) {
+		pthread_mutex_unlock(&backend->write_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&backend->pool_lock);
+	reader->next = backend->idle_readers;
+	backend->idle_readers = reader;
+	pthread_cond_signal(&backend->pool_available);
+	pthread_mutex_unlock(&backend->pool_lock);
+}
+
+static int read_blob(sqlite3 *db, const char *table, sqlite3_int64 id, char *out, size_t len, size_t offset)
+{
+	sqlite3_blob *blob;
+	int error;
+
+	if (sqlite3_blob_open(db, "main", table, "data", id, 0, &blob) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	if ((size_t)sqlite3_blob_bytes(blob) < offset + len) {
+		giterr_set_str(GITERR_ODB, "SQLite odb object has the wrong size");
+		sqlite3_blob_close(blob);
+		return GIT_ERROR;
+	}
+
+	error = sqlite3_blob_read(blob, out, (int)len, (int)offset) == SQLITE_OK ? GIT_OK : GIT_ERROR;
+	sqlite3_blob_close(blob);
+	return error;
+}
+
+/*
+ * Deltas use git's pack format: the base and result sizes as varints,
+ * then instructions that either copy a range of the base (high bit set,
+ * the low bits say which offset and size bytes follow) or insert the
+ * 1-127 literal bytes that follow.
+ */
+static size_t put_varint(unsigned char *out, size_t value)
+{
+	size_t i = 0;
+
+	while (value >= 0x80) {
+		out[i++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+
+	out[i++] = (unsigned char)value;
+	return i;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, size_t *out)
+{
+	size_t value = 0;
+	unsigned int shift = 0;
+
+	do {
+		if (*p >= end || shift >= sizeof(size_t) * 8)
+			return GIT_ERROR;
+
+		value |= (size_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+
+	*out = value;
+	return GIT_OK;
+}
+
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+	size_t max;
+} delta_out;
+
+static int delta_insert(delta_out *out, const unsigned char *data, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = len > 0x7f ? 0x7f : len;
+		if (out->len + 1 + n > out->max)
+			return GIT_ERROR;
+
+		out->buf[out->len++] = (unsigned char)n;
+		memcpy(out->buf + out->len, data, n);
+		out->len += n;
+		data += n;
+		len -= n;
+	}
+
+	return GIT_OK;
+}
+
+static int delta_copy(delta_out *out, size_t offset, size_t len)
+{
+	unsigned char *op;
+	size_t n;
+	int i;
+
+	while (len > 0) {
+		n = len > 0xffffff ? 0xffffff : len;
+		if (out->len + 8 > out->max)
+			return GIT_ERROR;
+
+		op = &out->buf[out->len++];
+		*op = 0x80;
+
+		for (i = 0; i < 4; i++) {
+			if ((offset >> (i * 8)) & 0xff) {
+				out->buf[out->len++] = (unsigned char)(offset >> (i * 8));
+				*op |= 1 << i;
+			}
+		}
+
+		for (i = 0; i < 3; i++) {
+			if ((n >> (i * 8)) & 0xff) {
+				out->buf[out->len++] = (unsigned char)(n >> (i * 8));
+				*op |= 0x10 << i;
+			}
+		}
+
+		offset += n;
+		len -= n;
+	}
+
+	return GIT_OK;
+}
+
+static unsigned int delta_hash(const unsigned char *p)
+{
+	uint32_t w[4];
+
+	memcpy(w, p, sizeof(w));
+	return (w[0] * 2654435761u) ^ (w[1] * 2246822519u) ^ (w[2] * 3266489917u) ^ (w[3] * 668265263u);
+}
+
+/*
+ * Index the base in GIT2_DELTA_BLOCK byte blocks and look every position
+ * of the target up in it; matches are grown both ways as far as they
+ * go. Only a delta smaller than the target is any use, so *delta_out is
+ * left NULL as soon as it can't be.
+ */
+static int delta_encode(unsigned char **delta_p, size_t *delta_len, const unsigned char *base, size_t base_len,
+	const unsigned char *target, size_t target_len)
+{
+	delta_out out;
+	uint32_t *index;
+	size_t index_size, i, offset, len, pending;
+	unsigned int h;
+
+	*delta_p = NULL;
+
+	/* below 64 bytes there's no saving to be had, and no room for the header */
+	if (base_len < GIT2_DELTA_BLOCK || target_len < 64 || base_len > UINT32_MAX - 1)
+		return GIT_OK;
+
+	for (index_size = 1; index_size < base_len / GIT2_DELTA_BLOCK; index_size <<= 1)
+		;
+
+	index = calloc(index_size, sizeof(uint32_t));
+	out.buf = malloc(target_len);
+	out.max = target_len - 1;
+	out.len = 0;
+
+	if (index == NULL || out.buf == NULL) {
+		free(index);
+		free(out.buf);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	/* offsets are kept plus one, 0 is an empty slot */
+	for (i = 0; i + GIT2_DELTA_BLOCK <= base_len; i += GIT2_DELTA_BLOCK)
+		index[delta_hash(base + i) & (index_size - 1)] = (uint32_t)(i + 1);
+
+	out.len += put_varint(out.buf, base_len);
+	out.len += put_varint(out.buf + out.len, target_len);
+
+	i = 0;
+	pending = 0;
+
+	while (i + GIT2_DELTA_BLOCK <= target_len) {
+		h = delta_hash(target + i) & (index_size - 1);
+
+		if (index[h] == 0 || memcmp(base + index[h] - 1, target + i, GIT2_DELTA_BLOCK) != 0) {
+			i++;
+			pending++;
+			continue;
+		}
+
+		offset = index[h] - 1;
+		len = GIT2_DELTA_BLOCK;
+
+		while (offset + len < base_len && i + len < target_len && base[offset + len] == target[i + len])
+			len++;
+
+		while (pending > 0 && offset > 0 && base[offset - 1] == target[i - 1]) {
+			offset--;
+			i--;
+			len++;
+			pending--;
+		}
+
+		if (delta_insert(&out, target + i - pending, pending) < 0 || delta_copy(&out, offset, len) < 0)
+			goto not_smaller;
+
+		i += len;
+		pending = 0;
+	}
+
+	pending += target_len - i;
+	if (delta_insert(&out, target + target_len - pending, pending) < 0)
+		goto not_smaller;
+
+	free(index);
+	*delta_p = out.buf;
+	*delta_len = out.len;
+	return GIT_OK;
+
+not_smaller:
+	free(index);
+	free(out.buf);
+	return GIT_OK;
+}
+
+static int delta_apply(char **out_p, size_t *out_len, const char *_base, size_t base_len,
+	const unsigned char *delta, size_t delta_len)
+{
+	const unsigned char *base = (const unsigned char *)_base;
+	const unsigned char *end = delta + delta_len;
+	unsigned char *out;
+	size_t size, pos, offset, len;
+	unsigned char op;
+	int i;
+
+	if (get_varint(&delta, end, &size) < 0 || size != base_len ||
+		get_varint(&delta, end, &size) < 0)
+		goto corrupt;
+
+	out = malloc(size > 0 ? size : 1);
+	if (out == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	pos = 0;
+
+	while (delta < end) {
+		op = *delta++;
+
+		if (op & 0x80) {
+			offset = len = 0;
+
+			for (i = 0; i < 4; i++) {
+				if (op & (1 << i)) {
+					if (delta >= end)
+						goto corrupt_free;
+					offset |= (size_t)*delta++ << (i * 8);
+				}
+			}
+
+			for (i = 0; i < 3; i++) {
+				if (op & (0x10 << i)) {
+					if (delta >= end)
+						goto corrupt_free;
+					len |= (size_t)*delta++ << (i * 8);
+				}
+			}
+
+			if (len == 0)
+				len = 0x10000;
+
+			if (offset > base_len || len > base_len - offset || len > size - pos)
+				goto corrupt_free;
+
+			memcpy(out + pos, base + offset, len);
+		} else if (op != 0) {
+			len = op;
+
+			if (len > (size_t)(end - delta) || len > size - pos)
+				goto corrupt_free;
+
+			memcpy(out + pos, delta, len);
+			delta += len;
+		} else {
+			goto corrupt_free;
+		}
+
+		pos += len;
+	}
+
+	if (pos != size)
+		goto corrupt_free;
+
+	*out_p = (char *)out;
+	*out_len = size;
+	return GIT_OK;
+
+corrupt_free:
+	free(out);
+corrupt:
+	giterr_set_str(GITERR_ODB, "SQLite odb delta is corrupted");
+	return GIT_ERROR;
+}
+
+/*
+ * Deflated data is stored after its inflated size as a varint, so it can
+ * be inflated in one go into a buffer of the right size. *out_p is left
+ * NULL when compressing doesn't make the data any smaller.
+ */
+static int deflate_data(char **out_p, size_t *out_len, const void *data, size_t len, int level)
+{
+	unsigned char *out;
+	uLongf compressed;
+	size_t header;
+
+	*out_p = NULL;
+
+	if (len < 64 || len > ULONG_MAX)
+		return GIT_OK;
+
+	compressed = compressBound((uLong)len);
+	out = malloc(10 + compressed);
+	if (out == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	header = put_varint(out, len);
+
+	if (compress2(out + header, &compressed, data, (uLong)len, level) != Z_OK ||
+		header + compressed >= len) {
+		free(out);
+		return GIT_OK;
+	}
+
+	*out_p = (char *)out;
+	*out_len = header + compressed;
+	return GIT_OK;
+}
+
+static int inflate_data(char **out_p, size_t *out_len, const unsigned char *data, size_t len)
+{
+	const unsigned char *p = data;
+	char *out;
+	size_t size;
+	uLongf inflated;
+
+	if (get_varint(&p, data + len, &size) < 0 || size > ULONG_MAX)
+		goto corrupt;
+
+	out = malloc(size > 0 ? size : 1);
+	if (out == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	inflated = (uLongf)size;
+	if (uncompress((Bytef *)out, &inflated, p, (uLong)(data + len - p)) != Z_OK || inflated != size) {
+		free(out);
+		goto corrupt;
+	}
+
+	*out_p = out;
+	*out_len = size;
+	return GIT_OK;
+
+corrupt:
+	giterr_set_str(GITERR_ODB, "SQLite odb object failed to inflate");
+	return GIT_ERROR;
+}
+
+/*
+ * Delta bases recently resolved, so the objects sharing a base don't
+ * each resolve its chain again. Direct-mapped on the oid; when the size
+ * limit is reached the least recently used slots go first.
+ */
+static sqlite_cache_slot *cache_slot(sqlite_backend *backend, const git_oid *oid)
+{
+	return &backend->cache[(oid->id[0] | oid->id[1] << 8) % GIT2_CACHE_SLOTS];
+}
+
+static void cache_evict(sqlite_backend *backend, sqlite_cache_slot *slot)
+{
+	backend->cache_bytes -= slot->len;
+	free(slot->data);
+	memset(slot, 0, sizeof(*slot));
+}
+
+/* apply a delta to a cached base; 0 if the base isn't cached */
+static int cache_apply(sqlite_backend *backend, const git_oid *base, git_otype *type_p,
+	const unsigned char *delta, size_t delta_len, char **out_p, size_t *out_len)
+{
+	sqlite_cache_slot *slot;
+	int error;
+
+	pthread_mutex_lock(&backend->cache_lock);
+
+	slot = cache_slot(backend, base);
+	if (slot->data == NULL || git_oid_cmp(&slot->oid, base) != 0) {
+		pthread_mutex_unlock(&backend->cache_lock);
+		return 0;
+	}
+
+	slot->used = ++backend->cache_tick;
+	*type_p = slot->type;
+	error = delta_apply(out_p, out_len, slot->data, slot->len, delta, delta_len);
+
+	pthread_mutex_unlock(&backend->cache_lock);
+	return error < 0 ? error : 1;
+}
+
+/* hand data over to the cache, which frees it when it can't keep it */
+static void cache_add(sqlite_backend *backend, const git_oid *oid, git_otype type, char *data, size_t len)
+{
+	sqlite_cache_slot *slot, *lru;
+	size_t i;
+
+	if (len > backend->cache_limit / 4) {
+		free(data);
+		return;
+	}
+
+	pthread_mutex_lock(&backend->cache_lock);
+
+	slot = cache_slot(backend, oid);
+	if (slot->data != NULL)
+		cache_evict(backend, slot);
+
+	while (backend->cache_bytes + len > backend->cache_limit) {
+		lru = NULL;
+		for (i = 0; i < GIT2_CACHE_SLOTS; i++) {
+			if (backend->cache[i].data != NULL && (lru == NULL || backend->cache[i].used < lru->used))
+				lru = &backend->cache[i];
+		}
+
+		cache_evict(backend, lru);
+	}
+
+	git_oid_cpy(&slot->oid, oid);
+	slot->type = type;
+	slot->data = data;
+	slot->len = len;
+	slot->used = ++backend->cache_tick;
+	backend->cache_bytes += len;
+
+	pthread_mutex_unlock(&backend->cache_lock);
+}
+
+/*
+ * st_read returns the data itself for inline objects and the row id of
+ * its blob otherwise; blobs are read straight from their pages, without
+ * SQLite making a copy of its own first
+ */
+static int read_data(sqlite_backend *backend, sqlite_reader *reader, char *out, size_t len)
+{
+	if (len == 0)
+		return GIT_OK;
+
+	if (sqlite3_column_type(reader->st_read, 3) == SQLITE_NULL) {
+		if ((size_t)sqlite3_column_bytes(reader->st_read, 2) != len) {
+			giterr_set_str(GITERR_ODB, "SQLite odb object has the wrong size");
+			return GIT_ERROR;
+		}
+
+		memcpy(out, sqlite3_column_blob(reader->st_read, 2), len);
+		return GIT_OK;
+	}
+
+	return read_blob(reader->db, backend->data_table, sqlite3_column_int64(reader->st_read, 3), out, len, 0);
+}
+
+/* the stored form of a deflated or deltified object, whatever its length */
+static int read_stored(sqlite_backend *backend, sqlite_reader *reader, char **out_p, size_t *out_len)
+{
+	sqlite3_blob *blob;
+	size_t len;
+
+	if (sqlite3_column_type(reader->st_read, 3) == SQLITE_NULL) {
+		len = (size_t)sqlite3_column_bytes(reader->st_read, 2);
+		if ((*out_p = malloc(len > 0 ? len : 1)) == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		memcpy(*out_p, sqlite3_column_blob(reader->st_read, 2), len);
+		*out_len = len;
+		return GIT_OK;
+	}
+
+	if (sqlite3_blob_open(reader->db, "main", backend->data_table, "data",
+			sqlite3_column_int64(reader->st_read, 3), 0, &blob) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(reader->db));
+		return GIT_ERROR;
+	}
+
+	len = (size_t)sqlite3_blob_bytes(blob);
+	if ((*out_p = malloc(len > 0 ? len : 1)) == NULL) {
+		sqlite3_blob_close(blob);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if (sqlite3_blob_read(blob, *out_p, (int)len, 0) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(reader->db));
+		sqlite3_blob_close(blob);
+		free(*out_p);
+		return GIT_ERROR;
+	}
+
+	sqlite3_blob_close(blob);
+	*out_len = len;
+	return GIT_OK;
+}
+
+/*
+ * Read an object whole, resolving its delta chain if it has one. The
+ * row is copied out and st_read reset before going down the chain, as
+ * every link is read with the same statement; depth_left guards against
+ * a chain that loops.
+ */
+static int read_object(sqlite_backend *backend, sqlite_reader *reader, const git_oid *oid,
+	void **data_p, size_t *len_p, git_otype *type_p, int depth_left)
+{
+	char *stored, *inflated, *base_data;
+	size_t stored_len, inflated_len, base_len;
+	git_otype base_type;
+	git_oid base;
+	int flags, error;
+
+	if (bind_oid(backend, reader->st_read, 1, oid) != SQLITE_OK) {
+		sqlite3_reset(reader->st_read);
+		return GIT_ERROR;
+	}
+
+	if (sqlite3_step(reader->st_read) != SQLITE_ROW) {
+		sqlite3_reset(reader->st_read);
+		return GIT_ENOTFOUND;
+	}
+
+	*type_p = (git_otype)sqlite3_column_int(reader->st_read, 0);
+	*len_p = (size_t)sqlite3_column_int64(reader->st_read, 1);
+	flags = sqlite3_column_int(reader->st_read, 4);
+
+	if (flags == 0) {
+		/* stored as is, straight into the caller's buffer */
+		*data_p = malloc(*len_p > 0 ? *len_p : 1);
+		if (*data_p == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+		} else if ((error = read_data(backend, reader, *data_p, *len_p)) < 0) {
+			free(*data_p);
+			*data_p = NULL;
+		}
+
+		sqlite3_reset(reader->st_read);
+		return error;
+	}
+
+	if ((flags & GIT2_DELTA) && sqlite3_column_bytes(reader->st_read, 5) != GIT_OID_RAWSZ) {
+		sqlite3_reset(reader->st_read);
+		giterr_set_str(GITERR_ODB, "SQLite odb delta has no base");
+		return GIT_ERROR;
+	}
+
+	if (flags & GIT2_DELTA)
+		git_oid_fromraw(&base, sqlite3_column_blob(reader->st_read, 5));
+
+	error = read_stored(backend, reader, &stored, &stored_len);
+	sqlite3_reset(reader->st_read);
+
+	if (error < 0)
+		return error;
+
+	if (flags & GIT2_DEFLATED) {
+		error = inflate_data(&inflated, &inflated_len, (unsigned char *)stored, stored_len);
+		free(stored);
+
+		if (error < 0)
+			return error;
+
+		stored = inflated;
+		stored_len = inflated_len;
+	}
+
+	if (!(flags & GIT2_DELTA)) {
+		*data_p = stored;
+		*len_p = stored_len;
+		return GIT_OK;
+	}
+
+	if (depth_left == 0) {
+		free(stored);
+		giterr_set_str(GITERR_ODB, "SQLite odb delta chain is too deep");
+		return GIT_ERROR;
+	}
+
+	error = cache_apply(backend, &base, &base_type, (unsigned char *)stored, stored_len, (char **)data_p, len_p);
+
+	if (error == 0) {
+		error = read_object(backend, reader, &base, (void **)&base_data, &base_len, &base_type, depth_left - 1);
+		if (error == GIT_ENOTFOUND) {
+			giterr_set_str(GITERR_ODB, "SQLite odb delta base is missing");
+			error = GIT_ERROR;
+		}
+
+		if (error == GIT_OK) {
+			error = delta_apply((char **)data_p, len_p, base_data, base_len, (unsigned char *)stored, stored_len);
+			cache_add(backend, &base, base_type, base_data, base_len);
+		}
+	}
+
+	free(stored);
+	return error < 0 ? error : GIT_OK;
+}
+
+int sqlite_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	sqlite_reader *reader;
+	int error;
+
+	assert(len_p && type_p && _backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+
+	if ((error = bulk_read(backend, oid, NULL, len_p, type_p)) != 0)
+		return error < 0 ? error : GIT_OK;
+
+	error = GIT_ERROR;
+
+	if ((reader = acquire_reader(backend, 0)) == NULL)
+		return GIT_ERROR;
+
+	if (bind_oid(backend, reader->st_read_header, 1, oid) == SQLITE_OK) {
+		if (sqlite3_step(reader->st_read_header) == SQLITE_ROW) {
+			*type_p = (git_otype)sqlite3_column_int(reader->st_read_header, 0);
+			*len_p = (size_t)sqlite3_column_int(reader->st_read_header, 1);
+			assert(sqlite3_step(reader->st_read_header) == SQLITE_DONE);
+			error = GIT_OK;
+		} else {
+			error = GIT_ENOTFOUND;
+		}
+	}
+
+	sqlite3_reset(reader->st_read_header);
+	release_reader(backend, reader);
+	return error;
+}
+
+int sqlite_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	sqlite_reader *reader;
+	int error;
+
+	assert(data_p && len_p && type_p && _backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+
+	if ((error = bulk_read(backend, oid, data_p, len_p, type_p)) != 0)
+		return error < 0 ? error : GIT_OK;
+
+	if ((reader = acquire_reader(backend, 0)) == NULL)
+		return GIT_ERROR;
+
+	error = read_object(backend, reader, oid, data_p, len_p, type_p, GIT2_DELTA_MAX_DEPTH);
+
+	release_reader(backend, reader);
+	return error;
+}
+
+/*
+ * Find the one object whose oid starts with the first len hex digits of
+ * short_oid. All such oids sort between the prefix itself and the prefix
+ * plus one in its last digit, so this is a single range scan of the
+ * primary key, cut off as soon as a second match shows ambiguity.
+ */
+static int find_prefix(git_oid *out, sqlite_backend *backend, const git_oid *short_oid, size_t len)
+{
+	sqlite_reader *reader;
+	unsigned char lower[GIT_OID_RAWSZ], upper[GIT_OID_RAWSZ + 1];
+	int bytes, upper_len, i, bound, error, rows;
+
+	assert(len > 0);
+	bytes = (int)(len + 1) / 2;
+
+	memcpy(lower, short_oid->id, bytes);
+	if (len % 2)
+		lower[bytes - 1] &= 0xf0;
+
+	/* add one to the last digit of the prefix, carrying as needed */
+	memcpy(upper, lower, bytes);
+	upper_len = bytes;
+	upper[bytes - 1] += (len % 2) ? 0x10 : 0x01;
+
+	for (i = bytes - 1; i > 0 && upper[i] < lower[i]; i--)
+		upper[i - 1]++;
+
+	/* all digits were f: anything longer than an oid is past them all */
+	if (upper[0] < lower[0]) {
+		memset(upper, 0xff, sizeof(upper));
+		upper_len = sizeof(upper);
+	}
+
+	if ((reader = acquire_reader(backend, 1)) == NULL)
+		return GIT_ERROR;
+
+	/* bounds have to be bound with the same type as the keys to compare */
+	if (backend->schema_version >= 2) {
+		bound = sqlite3_bind_blob(reader->st_read_prefix, 1, lower, bytes, SQLITE_STATIC) == SQLITE_OK &&
+			sqlite3_bind_blob(reader->st_read_prefix, 2, upper, upper_len, SQLITE_STATIC) == SQLITE_OK;
+	} else {
+		bound = sqlite3_bind_text(reader->st_read_prefix, 1, (char *)lower, bytes, SQLITE_STATIC) == SQLITE_OK &&
+			sqlite3_bind_text(reader->st_read_prefix, 2, (char *)upper, upper_len, SQLITE_STATIC) == SQLITE_OK;
+	}
+
+	rows = 0;
+	error = SQLITE_ERROR;
+
+	while (bound && (error = sqlite3_step(reader->st_read_prefix)) == SQLITE_ROW) {
+		if (sqlite3_column_bytes(reader->st_read_prefix, 0) != GIT_OID_RAWSZ) {
+			error = SQLITE_CORRUPT;
+			break;
+		}
+
+		if (rows++ == 0)
+			git_oid_fromraw(out, sqlite3_column_blob(reader->st_read_prefix, 0));
+	}
+
+	sqlite3_reset(reader->st_read_prefix);
+	release_reader(backend, reader);
+
+	if (error != SQLITE_DONE)
+		return GIT_ERROR;
+
+	if (rows == 0)
+		return GIT_ENOTFOUND;
+
+	if (rows > 1) {
+		giterr_set_str(GITERR_ODB, "SQLite odb found multiple objects for the prefix");
+		return GIT_EAMBIGUOUS;
+	}
+
+	return GIT_OK;
+}
+
+int sqlite_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
+					const git_oid *short_oid, size_t len)
+{
+	git_oid oid;
+	int error;
+
+	assert(out_oid && data_p && len_p && type_p && _backend && short_oid);
+
+	if (len >= GIT_OID_HEXSZ) {
+		/* Just match the full identifier */
+		error = sqlite_backend__read(data_p, len_p, type_p, _backend, short_oid);
+		if (error == GIT_OK)
+			git_oid_cpy(out_oid, short_oid);
+
+		return error;
+	}
+
+	if ((error = find_prefix(&oid, (sqlite_backend *)_backend, short_oid, len)) < 0)
+		return error;
+
+	error = sqlite_backend__read(data_p, len_p, type_p, _backend, &oid);
+	if (error == GIT_OK)
+		git_oid_cpy(out_oid, &oid);
+
+	return error;
+}
+
+int sqlite_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	sqlite_reader *reader;
+	int found;
+
+	assert(_backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+
+	if ((found = bulk_read(backend, oid, NULL, NULL, NULL)) != 0)
+		return found > 0;
+
+	if ((reader = acquire_reader(backend, 0)) == NULL)
+		return 0;
+
+	if (bind_oid(backend, reader->st_read_header, 1, oid) == SQLITE_OK) {
+		if (sqlite3_step(reader->st_read_header) == SQLITE_ROW) {
+			found = 1;
+			assert(sqlite3_step(reader->st_read_header) == SQLITE_DONE);
+		}
+	}
+
+	sqlite3_reset(reader->st_read_header);
+	release_reader(backend, reader);
+	return found;
+}
+
+int sqlite_backend__exists_prefix(git_oid *out_oid, git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	assert(out_oid && _backend && short_oid);
+
+	if (len >= GIT_OID_HEXSZ) {
+		if (!sqlite_backend__exists(_backend, short_oid))
+			return GIT_ENOTFOUND;
+
+		git_oid_cpy(out_oid, short_oid);
+		return GIT_OK;
+	}
+
+	return find_prefix(out_oid, (sqlite_backend *)_backend, short_oid, len);
+}
+
+/*
+ * Walk the key table a page at a time, in key order, picking up after the
+ * last oid of the page before. The connection is given back between
+ * pages and the callback only runs once it has, so it can read from the
+ * backend itself.
+ */
+int sqlite_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+	static const char *sql_foreach =
+		"SELECT oid FROM '" GIT2_TABLE_NAME "' WHERE oid > ? ORDER BY oid LIMIT " GIT2_XSTR(GIT2_FOREACH_PAGE) ";";
+
+	sqlite_backend *backend;
+	sqlite_reader *reader;
+	sqlite3_stmt *st;
+	git_oid *page;
+	size_t count, i;
+	int error;
+
+	assert(_backend && cb);
+
+	backend = (sqlite_backend *)_backend;
+
+	page = malloc(GIT2_FOREACH_PAGE * sizeof(git_oid));
+	if (page == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	count = 0;
+
+	do {
+		if ((reader = acquire_reader(backend, 1)) == NULL) {
+			free(page);
+			return GIT_ERROR;
+		}
+
+		error = GIT_ERROR;
+
+		if (sqlite3_prepare_v2(reader->db, sql_foreach, -1, &st, NULL) == SQLITE_OK) {
+			/* nothing sorts before an empty key of the same type */
+			if (count > 0)
+				error = bind_oid(backend, st, 1, &page[count - 1]);
+			else if (backend->schema_version >= 2)
+				error = sqlite3_bind_blob(st, 1, "", 0, SQLITE_STATIC);
+			else
+				error = sqlite3_bind_text(st, 1, "", 0, SQLITE_STATIC);
+
+			count = 0;
+			while (error == SQLITE_OK && (error = sqlite3_step(st)) == SQLITE_ROW) {
+				if (sqlite3_column_bytes(st, 0) != GIT_OID_RAWSZ) {
+					error = SQLITE_CORRUPT;
+					break;
+				}
+
+				git_oid_fromraw(&page[count++], sqlite3_column_blob(st, 0));
+				error = SQLITE_OK;
+			}
+
+			error = (error == SQLITE_DONE) ? GIT_OK : GIT_ERROR;
+			if (error < 0)
+				giterr_set_str(GITERR_ODB, sqlite3_errmsg(reader->db));
+		}
+
+		sqlite3_finalize(st);
+		release_reader(backend, reader);
+
+		for (i = 0; error == GIT_OK && i < count; i++)
+			error = cb(&page[i], payload);
+	} while (error == GIT_OK && count == GIT2_FOREACH_PAGE);
+
+	free(page);
+	return error;
+}
+
+
+static int insert_object_v1(sqlite_backend *backend, const git_oid *id, const void *data, size_t len, git_otype type)
+{
+	int error;
+
+	error = SQLITE_ERROR;
+
+	if (sqlite3_bind_text(backend->st_write, 1, (char *)id->id, 20, SQLITE_STATIC) == SQLITE_OK &&
+		sqlite3_bind_int(backend->st_write, 2, (int)type) == SQLITE_OK &&
+		sqlite3_bind_int(backend->st_write, 3, len) == SQLITE_OK &&
+		sqlite3_bind_blob(backend->st_write, 4, data, len, SQLITE_STATIC) == SQLITE_OK) {
+		error = sqlite3_step(backend->st_write);
+	}
+
+	sqlite3_reset(backend->st_write);
+	return (error == SQLITE_DONE) ? GIT_OK : GIT_ERROR;
+}
+
+/* what goes in a row: the data as stored, and how to read it back */
+typedef struct {
+	const void *data;
+	size_t len;
+	int flags;
+	const git_oid *base;
+	int depth;
+
+	/* the buffers data may point into */
+	char *delta;
+	char *deflated;
+} sqlite_encoded;
+
+static int insert_row(sqlite_backend *backend, const git_oid *id, git_otype type, size_t size,
+	const sqlite_encoded *enc, sqlite3_int64 data_id)
+{
+	int error;
+
+	error = SQLITE_ERROR;
+
+	if (bind_oid(backend, backend->st_write, 1, id) == SQLITE_OK &&
+		sqlite3_bind_int(backend->st_write, 2, (int)type) == SQLITE_OK &&
+		sqlite3_bind_int64(backend->st_write, 3, (sqlite3_int64)size) == SQLITE_OK &&
+		(data_id ? sqlite3_bind_null(backend->st_write, 4) :
+			sqlite3_bind_blob(backend->st_write, 4, enc->data, enc->len, SQLITE_STATIC)) == SQLITE_OK &&
+		(data_id ? sqlite3_bind_int64(backend->st_write, 5, data_id) :
+			sqlite3_bind_null(backend->st_write, 5)) == SQLITE_OK &&
+		(backend->schema_version < 3 || (
+			sqlite3_bind_int(backend->st_write, 6, enc->flags) == SQLITE_OK &&
+			(enc->base ? sqlite3_bind_blob(backend->st_write, 7, enc->base->id, GIT_OID_RAWSZ, SQLITE_STATIC) :
+				sqlite3_bind_null(backend->st_write, 7)) == SQLITE_OK &&
+			sqlite3_bind_int(backend->st_write, 8, enc->depth) == SQLITE_OK))) {
+		error = sqlite3_step(backend->st_write);
+	}
+
+	sqlite3_reset(backend->st_write);
+	return (error == SQLITE_DONE) ? GIT_OK : GIT_ERROR;
+}
+
+static int object_exists(sqlite_backend *backend, const git_oid *id)
+{
+	int exists;
+
+	exists = bind_oid(backend, backend->writer.st_read_header, 1, id) == SQLITE_OK &&
+		sqlite3_step(backend->writer.st_read_header) == SQLITE_ROW;
+	sqlite3_reset(backend->writer.st_read_header);
+
+	return exists;
+}
+
+/*
+ * The chain depth of base, or -1 if a delta against it is not to be:
+ * it's missing, or another link would take the chain past delta_depth.
+ */
+static int delta_base_depth(sqlite_backend *backend, const git_oid *base)
+{
+	int depth = -1;
+
+	if (bind_oid(backend, backend->st_read_depth, 1, base) == SQLITE_OK &&
+		sqlite3_step(backend->st_read_depth) == SQLITE_ROW)
+		depth = sqlite3_column_int(backend->st_read_depth, 0);
+
+	sqlite3_reset(backend->st_read_depth);
+
+	if (depth < 0 || (unsigned int)depth + 1 > backend->delta_depth)
+		return -1;
+
+	return depth;
+}
+
+/*
+ * Store the object as a delta against base if that comes out smaller,
+ * then deflate whatever is to be stored if that does; v2 tables have no
+ * room to say either, so they get the object as is.
+ */
+static int encode_object(sqlite_backend *backend, sqlite_encoded *enc, const void *data, size_t len,
+	const git_oid *base)
+{
+	void *base_data;
+	unsigned char *delta;
+	size_t base_len, delta_len, deflated_len;
+	git_otype base_type;
+	int depth, error;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->data = data;
+	enc->len = len;
+
+	if (backend->schema_version < 3)
+		return GIT_OK;
+
+	if (base != NULL && (depth = delta_base_depth(backend, base)) >= 0) {
+		error = read_object(backend, &backend->writer, base, &base_data, &base_len, &base_type,
+			GIT2_DELTA_MAX_DEPTH);
+		if (error < 0)
+			return error;
+
+		error = delta_encode(&delta, &delta_len, base_data, base_len, data, len);
+		free(base_data);
+
+		if (error < 0)
+			return error;
+
+		if (delta != NULL) {
+			enc->delta = (char *)delta;
+			enc->data = delta;
+			enc->len = delta_len;
+			enc->flags |= GIT2_DELTA;
+			enc->base = base;
+			enc->depth = depth + 1;
+		}
+	}
+
+	if (backend->compression > 0) {
+		if (deflate_data(&enc->deflated, &deflated_len, enc->data, enc->len, backend->compression) < 0)
+			return GIT_ERROR;
+
+		if (enc->deflated != NULL) {
+			enc->data = enc->deflated;
+			enc->len = deflated_len;
+			enc->flags |= GIT2_DEFLATED;
+		}
+	}
+
+	return GIT_OK;
+}
+
+static void encoded_free(sqlite_encoded *enc)
+{
+	free(enc->delta);
+	free(enc->deflated);
+}
+
+static int insert_object(sqlite_backend *backend, const git_oid *id, const void *data, size_t len, git_otype type,
+	const git_oid *base)
+{
+	sqlite_encoded enc;
+	sqlite3_int64 data_id;
+	int error;
+
+	if (backend->schema_version < 2)
+		return insert_object_v1(backend, id, data, len, type);
+
+	/*
+	 * a data row nobody points at would never go away, and encoding is
+	 * too much work to throw away, so look first
+	 */
+	if ((len > backend->inline_max || backend->compression > 0 || base != NULL) && object_exists(backend, id))
+		return GIT_OK;
+
+	if ((error = encode_object(backend, &enc, data, len, base)) < 0) {
+		encoded_free(&enc);
+		return error;
+	}
+
+	if (enc.len <= backend->inline_max) {
+		error = insert_row(backend, id, type, len, &enc, 0);
+		encoded_free(&enc);
+		return error;
+	}
+
+	/* a savepoint works both inside and outside of a batch transaction */
+	if (sqlite3_exec(backend->writer.db, "SAVEPOINT git2_write;", NULL, NULL, NULL) != SQLITE_OK) {
+		encoded_free(&enc);
+		return GIT_ERROR;
+	}
+
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_blob(backend->st_write_data, 1, enc.data, enc.len, SQLITE_STATIC) == SQLITE_OK &&
+		sqlite3_step(backend->st_write_data) == SQLITE_DONE) {
+		data_id = sqlite3_last_insert_rowid(backend->writer.db);
+		error = insert_row(backend, id, type, len, &enc, data_id);
+	}
+
+	sqlite3_reset(backend->st_write_data);
+
+	if (error < 0)
+		sqlite3_exec(backend->writer.db, "ROLLBACK TO git2_write;", NULL, NULL, NULL);
+
+	sqlite3_exec(backend->writer.db, "RELEASE git2_write;", NULL, NULL, NULL);
+	encoded_free(&enc);
+	return error;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql)
+{
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static unsigned int elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned int)((now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+static int batch_begin(sqlite_backend *backend)
+{
+	if (backend->in_transaction)
+		return GIT_OK;
+
+	if (exec_sql(backend->writer.db, "BEGIN;") < 0)
+		return GIT_ERROR;
+
+	backend->in_transaction = 1;
+	backend->pending_objects = 0;
+	backend->pending_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &backend->batch_start);
+	return GIT_OK;
+}
+
+static int batch_commit(sqlite_backend *backend)
+{
+	if (!backend->in_transaction)
+		return GIT_OK;
+
+	if (exec_sql(backend->writer.db, "COMMIT;") < 0) {
+		/* leave nothing half done behind, the writes are lost either way */
+		sqlite3_exec(backend->writer.db, "ROLLBACK;", NULL, NULL, NULL);
+		backend->in_transaction = 0;
+		return GIT_ERROR;
+	}
+
+	backend->in_transaction = 0;
+	return GIT_OK;
+}
+
+static int batch_due(sqlite_backend *backend)
+{
+	return (backend->batch_objects > 0 && backend->pending_objects >= backend->batch_objects) ||
+		(backend->batch_bytes > 0 && backend->pending_bytes >= backend->batch_bytes) ||
+		(backend->batch_ms > 0 && elapsed_ms(&backend->batch_start) >= backend->batch_ms);
+}
+
+static int bulk_compare(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const sqlite_bulk_entry *)a)->oid, &((const sqlite_bulk_entry *)b)->oid);
+}
+
+/* write out the objects held back in bulk-load mode, in oid order */
+static int bulk_flush(sqlite_backend *backend)
+{
+	sqlite_bulk_entry *entry;
+	size_t i;
+	int error;
+
+	if (backend->bulk_count == 0)
+		return GIT_OK;
+
+	/* appending to the b-tree in key order keeps it from splitting pages all over */
+	qsort(backend->bulk_entries, backend->bulk_count, sizeof(sqlite_bulk_entry), bulk_compare);
+
+	error = batch_begin(backend);
+
+	for (i = 0; i < backend->bulk_count; i++) {
+		entry = &backend->bulk_entries[i];
+
+		if (error == GIT_OK)
+			error = insert_object(backend, &entry->oid, entry->data, entry->len, entry->type, NULL);
+
+		free(entry->data);
+	}
+
+	backend->bulk_count = 0;
+	backend->bulk_sorted = 0;
+	backend->bulk_bytes = 0;
+
+	if (error == GIT_OK)
+		error = batch_commit(backend);
+	else
+		batch_commit(backend);
+
+	return error;
+}
+
+/*
+ * Look for oid among the objects held back in bulk-load mode, so reads
+ * don't have to write them all out first. The first bulk_sorted of them
+ * are in oid order and the rest are searched one by one, until there are
+ * enough of those to sort again. Fills in what is asked for and returns
+ * 1 if the object is there, 0 if it isn't and an error code if it can't
+ * be copied.
+ */
+static int bulk_read(sqlite_backend *backend, const git_oid *oid, void **data_p, size_t *len_p, git_otype *type_p)
+{
+	sqlite_bulk_entry key, *entry;
+	size_t i;
+	int found;
+
+	if (!backend->bulk)
+		return 0;
+
+	pthread_mutex_lock(&backend->write_lock);
+
+	if (backend->bulk_count - backend->bulk_sorted > GIT2_BULK_UNSORTED) {
+		qsort(backend->bulk_entries, backend->bulk_count, sizeof(sqlite_bulk_entry), bulk_compare);
+		backend->bulk_sorted = backend->bulk_count;
+	}
+
+	git_oid_cpy(&key.oid, oid);
+	entry = bsearch(&key, backend->bulk_entries, backend->bulk_sorted, sizeof(sqlite_bulk_entry), bulk_compare);
+
+	for (i = backend->bulk_sorted; entry == NULL && i < backend->bulk_count; i++) {
+		if (git_oid_cmp(&backend->bulk_entries[i].oid, oid) == 0)
+			entry = &backend->bulk_entries[i];
+	}
+
+	found = entry != NULL;
+
+	if (found && data_p != NULL) {
+		if ((*data_p = malloc(entry->len > 0 ? entry->len : 1)) == NULL) {
+			giterr_set_oom();
+			found = GIT_ERROR;
+		} else {
+			memcpy(*data_p, entry->data, entry->len);
+		}
+	}
+
+	if (found > 0 && len_p != NULL)
+		*len_p = entry->len;
+	if (found > 0 && type_p != NULL)
+		*type_p = entry->type;
+
+	pthread_mutex_unlock(&backend->write_lock);
+	return found;
+}
+
+static int bulk_add(sqlite_backend *backend, const git_oid *id, const void *data, size_t len, git_otype type)
+{
+	sqlite_bulk_entry *entry;
+
+	if (backend->bulk_count == backend->bulk_size) {
+		size_t size = backend->bulk_size ? backend->bulk_size * 2 : 1024;
+
+		entry = realloc(backend->bulk_entries, size * sizeof(sqlite_bulk_entry));
+		if (entry == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		backend->bulk_entries = entry;
+		backend->bulk_size = size;
+	}
+
+	entry = &backend->bulk_entries[backend->bulk_count];
+	entry->data = malloc(len > 0 ? len : 1);
+	if (entry->data == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	memcpy(entry->data, data, len);
+	git_oid_cpy(&entry->oid, id);
+	entry->type = type;
+	entry->len = len;
+
+	backend->bulk_count++;
+	backend->bulk_bytes += len;
+
+	if (backend->bulk_count >= GIT2_BULK_OBJECTS || backend->bulk_bytes >= GIT2_BULK_BYTES)
+		return bulk_flush(backend);
+
+	return GIT_OK;
+}
+
+static int write_object(sqlite_backend *backend, const git_oid *id, const void *data, size_t len, git_otype type,
+	const git_oid *base)
+{
+	if (backend->bulk && base == NULL)
+		return bulk_add(backend, id, data, len, type);
+
+	/* the base may be among the objects held back */
+	if (base != NULL && bulk_flush(backend) < 0)
+		return GIT_ERROR;
+
+	/* without batching every write is its own transaction */
+	if (!backend->batch_objects && !backend->batch_bytes && !backend->batch_ms)
+		return insert_object(backend, id, data, len, type, base);
+
+	if (batch_begin(backend) < 0)
+		return GIT_ERROR;
+
+	if (insert_object(backend, id, data, len, type, base) < 0)
+		return GIT_ERROR;
+
+	backend->pending_objects++;
+	backend->pending_bytes += len;
+
+	return batch_due(backend) ? batch_commit(backend) : GIT_OK;
+}
+
+int sqlite_backend__write(git_odb_backend *_backend, const git_oid *id, const void *data, size_t len, git_otype type)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(id && _backend && data);
+
+	backend = (sqlite_backend *)_backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = write_object(backend, id, data, len, type, NULL);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+int git_odb_backend_sqlite_write_delta(git_odb_backend *_backend, const git_oid *id, const void *data, size_t len,
+	git_otype type, const git_oid *base)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(id && _backend && data && base);
+
+	if (_backend->free == &sqlite_sharded_backend__free)
+		return sharded_write_delta(_backend, id, data, len, type, base);
+
+	backend = (sqlite_backend *)_backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = write_object(backend, id, data, len, type, base);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+int sqlite_backend__readstream_read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+	sqlite_readstream *stream;
+	sqlite_backend *backend;
+	sqlite_reader *reader;
+	int error;
+
+	assert(_stream && buffer);
+
+	stream = (sqlite_readstream *)_stream;
+	backend = (sqlite_backend *)_stream->backend;
+
+	if (len > stream->size - stream->offset)
+		len = stream->size - stream->offset;
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	if (len == 0)
+		return 0;
+
+	if (stream->data_id != 0) {
+		/*
+		 * a blob handle is tied to its connection, so each piece is read
+		 * through whichever connection is free at the time
+		 */
+		if ((reader = acquire_reader(backend, 1)) == NULL)
+			return GIT_ERROR;
+
+		error = read_blob(reader->db, backend->data_table, stream->data_id, buffer, len, stream->offset);
+		release_reader(backend, reader);
+
+		if (error < 0)
+			return error;
+	} else {
+		memcpy(buffer, stream->data + stream->offset, len);
+	}
+
+	stream->offset += len;
+	return (int)len;
+}
+
+void sqlite_backend__readstream_free(git_odb_stream *_stream)
+{
+	sqlite_readstream *stream;
+	assert(_stream);
+	stream = (sqlite_readstream *)_stream;
+
+	free(stream->data);
+	free(stream);
+}
+
+int sqlite_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	sqlite_readstream *stream;
+	sqlite_reader *reader;
+	git_otype type;
+	int error;
+
+	assert(stream_out && _backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+
+	stream = calloc(1, sizeof(sqlite_readstream));
+	if (stream == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if ((reader = acquire_reader(backend, 1)) == NULL) {
+		free(stream);
+		return GIT_ERROR;
+	}
+
+	error = GIT_ERROR;
+
+	if (bind_oid(backend, reader->st_read, 1, oid) != SQLITE_OK)
+		goto cleanup;
+
+	if (sqlite3_step(reader->st_read) != SQLITE_ROW) {
+		error = GIT_ENOTFOUND;
+		goto cleanup;
+	}
+
+	stream->parent.declared_size = (git_off_t)sqlite3_column_int64(reader->st_read, 1);
+	stream->size = (size_t)stream->parent.declared_size;
+
+	if (sqlite3_column_int(reader->st_read, 4) != 0) {
+		/* deflated or deltified objects can only be had whole */
+		sqlite3_reset(reader->st_read);
+
+		error = read_object(backend, reader, oid, (void **)&stream->data, &stream->size, &type,
+			GIT2_DELTA_MAX_DEPTH);
+		if (error < 0)
+			goto cleanup;
+	} else if (sqlite3_column_type(reader->st_read, 3) != SQLITE_NULL) {
+		/* big objects are read piece by piece as the caller asks for them */
+		stream->data_id = sqlite3_column_int64(reader->st_read, 3);
+	} else {
+		/* inline objects are small, keep a copy */
+		stream->data = malloc(stream->size > 0 ? stream->size : 1);
+		if (stream->data == NULL) {
+			giterr_set_oom();
+			goto cleanup;
+		}
+
+		if (read_data(backend, reader, stream->data, stream->size) < 0)
+			goto cleanup;
+	}
+
+	sqlite3_reset(reader->st_read);
+	release_reader(backend, reader);
+
+	stream->parent.backend = _backend;
+	stream->parent.mode = GIT_STREAM_RDONLY;
+	stream->parent.read = &sqlite_backend__readstream_read;
+	stream->parent.free = &sqlite_backend__readstream_free;
+
+	*stream_out = (git_odb_stream *)stream;
+	return GIT_OK;
+
+cleanup:
+	sqlite3_reset(reader->st_read);
+	release_reader(backend, reader);
+	sqlite_backend__readstream_free((git_odb_stream *)stream);
+	return error;
+}
+
+static int stream_write(git_odb_stream *_stream, const char *data, size_t len)
+{
+	sqlite_writestream *stream;
+	sqlite_backend *backend;
+	sqlite3_blob *blob;
+	int error;
+
+	assert(_stream && data);
+
+	stream = (sqlite_writestream *)_stream;
+	backend = (sqlite_backend *)_stream->backend;
+
+	if (len > (size_t)_stream->declared_size - stream->offset) {
+		giterr_set_str(GITERR_ODB, "SQLite odb stream written past its declared size");
+		return GIT_ERROR;
+	}
+
+	/*
+	 * without batching each piece is committed on its own; with it,
+	 * batching may have committed underneath us
+	 */
+	if ((backend->batch_objects || backend->batch_bytes || backend->batch_ms) && batch_begin(backend) < 0)
+		return GIT_ERROR;
+
+	/*
+	 * the handle is only held for the one write, an open blob handle would
+	 * keep every other write on the connection from committing
+	 */
+	if (sqlite3_blob_open(backend->writer.db, "main", GIT2_DATA_TABLE_NAME, "data", stream->data_id, 1, &blob) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(backend->writer.db));
+		return GIT_ERROR;
+	}
+
+	error = sqlite3_blob_write(blob, data, (int)len, (int)stream->offset) == SQLITE_OK ? GIT_OK : GIT_ERROR;
+	sqlite3_blob_close(blob);
+
+	if (error == GIT_OK)
+		stream->offset += len;
+
+	return error;
+}
+
+int sqlite_backend__writestream_write(git_odb_stream *_stream, const char *data, size_t len)
+{
+	sqlite_backend *backend = (sqlite_backend *)_stream->backend;
+	int error;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = stream_write(_stream, data, len);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+static int stream_finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+	sqlite_writestream *stream;
+	sqlite_backend *backend;
+	sqlite_encoded enc;
+	int exists;
+
+	assert(_stream && oid);
+
+	stream = (sqlite_writestream *)_stream;
+	backend = (sqlite_backend *)_stream->backend;
+
+	if (stream->offset != (size_t)_stream->declared_size) {
+		giterr_set_str(GITERR_ODB, "SQLite odb stream finalized before all data was written");
+		return GIT_ERROR;
+	}
+
+	exists = bind_oid(backend, backend->writer.st_read_header, 1, oid) == SQLITE_OK &&
+		sqlite3_step(backend->writer.st_read_header) == SQLITE_ROW;
+	sqlite3_reset(backend->writer.st_read_header);
+
+	/* already there, free drops the data row */
+	if (exists)
+		return GIT_OK;
+
+	memset(&enc, 0, sizeof(enc));
+
+	/*
+	 * without batching the one INSERT commits on its own, and a failed one
+	 * leaves no transaction open behind it
+	 */
+	if (!backend->batch_objects && !backend->batch_bytes && !backend->batch_ms) {
+		if (insert_row(backend, oid, stream->type, stream->offset, &enc, stream->data_id) < 0)
+			return GIT_ERROR;
+
+		stream->finalized = 1;
+		return GIT_OK;
+	}
+
+	if (batch_begin(backend) < 0)
+		return GIT_ERROR;
+
+	if (insert_row(backend, oid, stream->type, stream->offset, &enc, stream->data_id) < 0)
+		return GIT_ERROR;
+
+	stream->finalized = 1;
+
+	backend->pending_objects++;
+	backend->pending_bytes += stream->offset;
+
+	return batch_due(backend) ? batch_commit(backend) : GIT_OK;
+}
+
+int sqlite_backend__writestream_finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+	sqlite_backend *backend = (sqlite_backend *)_stream->backend;
+	int error;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = stream_finalize_write(_stream, oid);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+static void stream_free(git_odb_stream *_stream)
+{
+	sqlite_writestream *stream;
+	sqlite_backend *backend;
+	assert(_stream);
+	stream = (sqlite_writestream *)_stream;
+	backend = (sqlite_backend *)_stream->backend;
+
+	/* nothing points at the data row of an abandoned or duplicate stream */
+	if (!stream->finalized && stream->data_id != 0) {
+		if (sqlite3_bind_int64(backend->st_delete_data, 1, stream->data_id) == SQLITE_OK)
+			sqlite3_step(backend->st_delete_data);
+
+		sqlite3_reset(backend->st_delete_data);
+	}
+
+	free(stream);
+}
+
+void sqlite_backend__writestream_free(git_odb_stream *_stream)
+{
+	sqlite_backend *backend = (sqlite_backend *)_stream->backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	stream_free(_stream);
+	pthread_mutex_unlock(&backend->write_lock);
+}
+
+/*
+ * The data row is allocated up front at its full size with zeroblob and
+ * filled in place as the data comes in; the key row pointing at it is
+ * only added by finalize_write, once the oid is known. Without batching
+ * no transaction is held open between calls, where other threads' writes
+ * would end up in it uncommitted: the data row is committed right away,
+ * and deleted again by free if the stream is abandoned.
+ */
+int sqlite_backend__writestream(git_odb_stream **stream_out, git_odb_backend *_backend, git_off_t size, git_otype type)
+{
+	sqlite_backend *backend;
+	sqlite_writestream *stream;
+	int error;
+
+	assert(stream_out && _backend && size >= 0);
+
+	backend = (sqlite_backend *)_backend;
+
+	if (size > INT_MAX) {
+		giterr_set_str(GITERR_ODB, "SQLite odb objects are limited to 2GiB");
+		return GIT_ERROR;
+	}
+
+	stream = calloc(1, sizeof(sqlite_writestream));
+	if (stream == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	stream->parent.backend = _backend;
+	stream->parent.mode = GIT_STREAM_WRONLY;
+	stream->parent.declared_size = size;
+	stream->parent.write = &sqlite_backend__writestream_write;
+	stream->parent.finalize_write = &sqlite_backend__writestream_finalize_write;
+	stream->parent.free = &sqlite_backend__writestream_free;
+	stream->type = type;
+
+	pthread_mutex_lock(&backend->write_lock);
+
+	if ((backend->batch_objects || backend->batch_bytes || backend->batch_ms) && batch_begin(backend) < 0)
+		goto cleanup;
+
+	error = SQLITE_ERROR;
+	if (sqlite3_bind_zeroblob(backend->st_write_data, 1, (int)size) == SQLITE_OK)
+		error = sqlite3_step(backend->st_write_data);
+
+	sqlite3_reset(backend->st_write_data);
+
+	if (error != SQLITE_DONE) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(backend->writer.db));
+		goto cleanup;
+	}
+
+	stream->data_id = sqlite3_last_insert_rowid(backend->writer.db);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	*stream_out = (git_odb_stream *)stream;
+	return GIT_OK;
+
+cleanup:
+	stream_free((git_odb_stream *)stream);
+	pthread_mutex_unlock(&backend->write_lock);
+	return GIT_ERROR;
+}
+
+void sqlite_backend__free(git_odb_backend *_backend)
+{
+	sqlite_backend *backend;
+	size_t i;
+	assert(_backend);
+	backend = (sqlite_backend *)_backend;
+
+	if (backend->snapshot_running) {
+		pthread_mutex_lock(&backend->snapshot_lock);
+		backend->snapshot_stop = 1;
+		pthread_cond_signal(&backend->snapshot_wake);
+		pthread_mutex_unlock(&backend->snapshot_lock);
+		pthread_join(backend->snapshot_thread, NULL);
+	}
+
+	/* nothing to report a failure to from here */
+	if (backend->bulk)
+		bulk_end(backend);
+	else
+		flush(backend);
+
+	/* snapshot lets go of write_lock between steps, so it has to hold it */
+	if (backend->snapshot_path != NULL) {
+		pthread_mutex_lock(&backend->write_lock);
+		snapshot(backend);
+		pthread_mutex_unlock(&backend->write_lock);
+	}
+
+	free(backend->snapshot_path);
+
+	free(backend->bulk_entries);
+
+	for (i = 0; i < backend->reader_count; i++)
+		close_reader(&backend->readers[i]);
+
+	free(backend->readers);
+
+	sqlite3_finalize(backend->st_write);
+	sqlite3_finalize(backend->st_write_data);
+	sqlite3_finalize(backend->st_delete_data);
+	sqlite3_finalize(backend->st_read_depth);
+	close_reader(&backend->writer);
+
+	for (i = 0; i < GIT2_CACHE_SLOTS; i++)
+		free(backend->cache[i].data);
+
+	pthread_mutex_destroy(&backend->cache_lock);
+	pthread_cond_destroy(&backend->snapshot_done);
+	pthread_cond_destroy(&backend->snapshot_wake);
+	pthread_mutex_destroy(&backend->snapshot_lock);
+	pthread_cond_destroy(&backend->pool_available);
+	pthread_mutex_destroy(&backend->pool_lock);
+	pthread_mutex_destroy(&backend->write_lock);
+
+	free(backend);
+}
+
+/*
+ * file: URI for a read-only open; '?', '#' and '%' in the path would be
+ * taken for URI syntax and are escaped
+ */
+static char *readonly_uri(const char *path, int immutable)
+{
+	static const char *hex = "0123456789ABCDEF";
+	const char *query = immutable ? "?mode=ro&immutable=1" : "?mode=ro";
+	char *uri, *p;
+
+	uri = malloc(strlen("file:") + strlen(path) * 3 + strlen(query) + 1);
+	if (uri == NULL)
+		return NULL;
+
+	p = uri;
+	memcpy(p, "file:", 5);
+	p += 5;
+
+	for (; *path; path++) {
+		if (*path == '?' || *path == '#' || *path == '%') {
+			*p++ = '%';
+			*p++ = hex[(unsigned char)*path >> 4];
+			*p++ = hex[(unsigned char)*path & 0xf];
+		} else {
+			*p++ = *path;
+		}
+	}
+
+	strcpy(p, query);
+	return uri;
+}
+
+static int open_db(sqlite3 **db_out, const char *path, const git_odb_sqlite_options *opts, int flags)
+{
+	char *uri;
+	int error;
+
+	if (!opts->readonly && !opts->immutable)
+		return sqlite3_open_v2(path, db_out, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | flags, NULL) == SQLITE_OK ?
+			GIT_OK : GIT_ERROR;
+
+	uri = readonly_uri(path, opts->immutable);
+	if (uri == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	error = sqlite3_open_v2(uri, db_out, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI | flags, NULL);
+	free(uri);
+
+	return error == SQLITE_OK ? GIT_OK : GIT_ERROR;
+}
+
+static int set_pragma(sqlite3 *db, const char *name, long long value)
+{
+	char sql[128];
+
+	snprintf(sql, sizeof(sql), "PRAGMA %s = %lld;", name, value);
+
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int configure_db(sqlite3 *db, const git_odb_sqlite_options *opts)
+{
+	char sql[64];
+	const char *c;
+	int readonly;
+
+	readonly = opts->readonly || opts->immutable;
+
+	if (opts->busy_timeout > 0 && sqlite3_busy_timeout(db, opts->busy_timeout) != SQLITE_OK)
+		return GIT_ERROR;
+
+	/*
+	 * the page size only sticks if set before the first table is created,
+	 * and before switching to WAL
+	 */
+	if (!readonly && opts->page_size > 0 && set_pragma(db, "page_size", opts->page_size) < 0)
+		return GIT_ERROR;
+
+	/*
+	 * like the page size, this has to be set before the first table is
+	 * created; an existing file only switches from or to NONE on VACUUM
+	 */
+	if (!readonly && opts->auto_vacuum >= 0 && set_pragma(db, "auto_vacuum", opts->auto_vacuum) < 0)
+		return GIT_ERROR;
+
+	/*
+	 * the journal mode is kept in the file, a read-only open gets whatever
+	 * the writer set up
+	 */
+	if (!readonly && opts->journal_mode != NULL) {
+		for (c = opts->journal_mode; *c; c++) {
+			if (!isalpha((unsigned char)*c) || c - opts->journal_mode > 16) {
+				giterr_set_str(GITERR_INVALID, "invalid SQLite journal mode");
+				return GIT_ERROR;
+			}
+		}
+
+		snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;", opts->journal_mode);
+		if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+			giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+			return GIT_ERROR;
+		}
+	}
+
+	if (opts->synchronous >= 0 && set_pragma(db, "synchronous", opts->synchronous) < 0)
+		return GIT_ERROR;
+
+	if (opts->cache_size != 0 && set_pragma(db, "cache_size", opts->cache_size) < 0)
+		return GIT_ERROR;
+
+	if (opts->mmap_size >= 0 && set_pragma(db, "mmap_size", opts->mmap_size) < 0)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+/*
+ * Schema v2: the key table is clustered on the oid, so a lookup is one
+ * b-tree probe and the key is stored once. Objects small enough to leave
+ * the key table dense are kept inline; bigger ones go to their own table
+ * and only the row id of their data is kept next to the key.
+ */
+static int create_table(sqlite3 *db)
+{
+	static const char *sql_creat =
+		"CREATE TABLE '" GIT2_TABLE_NAME "' ("
+		"'oid' BLOB PRIMARY KEY NOT NULL,"
+		"'type' INTEGER NOT NULL,"
+		"'size' INTEGER NOT NULL,"
+		"'data' BLOB,"
+		"'data_id' INTEGER) WITHOUT ROWID;"
+		"CREATE TABLE '" GIT2_DATA_TABLE_NAME "' ("
+		"'id' INTEGER PRIMARY KEY,"
+		"'data' BLOB NOT NULL);"
+		"PRAGMA user_version = 2;";
+
+	if (sqlite3_exec(db, sql_creat, NULL, NULL, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+/*
+ * Rebuild a v1 table as v2 in one transaction. Big objects keep their
+ * old rowid as the id of their data row, which saves a join to match
+ * the two up again.
+ */
+static int migrate_v1(sqlite_backend *backend)
+{
+	static const char *sql_migrate =
+		"BEGIN;"
+		"CREATE TABLE '" GIT2_DATA_TABLE_NAME "' ("
+		"'id' INTEGER PRIMARY KEY,"
+		"'data' BLOB NOT NULL);"
+		"INSERT INTO '" GIT2_DATA_TABLE_NAME "' (id, data)"
+		" SELECT rowid, data FROM '" GIT2_TABLE_NAME "' WHERE length(data) > %lu;"
+		"CREATE TABLE 'git2_odb_v2' ("
+		"'oid' BLOB PRIMARY KEY NOT NULL,"
+		"'type' INTEGER NOT NULL,"
+		"'size' INTEGER NOT NULL,"
+		"'data' BLOB,"
+		"'data_id' INTEGER) WITHOUT ROWID;"
+		"INSERT OR IGNORE INTO 'git2_odb_v2'"
+		" SELECT CAST(oid AS BLOB), type, size,"
+		" CASE WHEN length(data) > %lu THEN NULL ELSE data END,"
+		" CASE WHEN length(data) > %lu THEN rowid ELSE NULL END"
+		" FROM '" GIT2_TABLE_NAME "';"
+		"DROP TABLE '" GIT2_TABLE_NAME "';"
+		"ALTER TABLE 'git2_odb_v2' RENAME TO '" GIT2_TABLE_NAME "';"
+		"PRAGMA user_version = 2;"
+		"COMMIT;";
+
+	char sql[2048];
+	unsigned long inline_max;
+
+	inline_max = (unsigned long)backend->inline_max;
+	snprintf(sql, sizeof(sql), sql_migrate, inline_max, inline_max, inline_max);
+
+	if (sqlite3_exec(backend->writer.db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(backend->writer.db));
+		sqlite3_exec(backend->writer.db, "ROLLBACK;", NULL, NULL, NULL);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/*
+ * v3 says how each row is stored: deflated, as a delta against the
+ * object in `base` and how long the chain down to a full object is.
+ * Adding columns leaves the rows as they are, and they read back as
+ * stored in full; but code from before v3 can't insert into the table
+ * any more, so only databases meant for compression get it.
+ */
+static int migrate_v2(sqlite_backend *backend)
+{
+	static const char *sql_migrate =
+		"BEGIN;"
+		"ALTER TABLE '" GIT2_TABLE_NAME "' ADD COLUMN 'flags' INTEGER NOT NULL DEFAULT 0;"
+		"ALTER TABLE '" GIT2_TABLE_NAME "' ADD COLUMN 'base' BLOB;"
+		"ALTER TABLE '" GIT2_TABLE_NAME "' ADD COLUMN 'depth' INTEGER NOT NULL DEFAULT 0;"
+		"PRAGMA user_version = 3;"
+		"COMMIT;";
+
+	if (sqlite3_exec(backend->writer.db, sql_migrate, NULL, NULL, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(backend->writer.db));
+		sqlite3_exec(backend->writer.db, "ROLLBACK;", NULL, NULL, NULL);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int query_int(sqlite3 *db, const char *sql, int *out)
+{
+	sqlite3_stmt *st;
+	int error;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	error = GIT_ERROR;
+	if (sqlite3_step(st) == SQLITE_ROW) {
+		*out = sqlite3_column_int(st, 0);
+		error = GIT_OK;
+	}
+
+	sqlite3_finalize(st);
+	return error;
+}
+
+static int init_db(sqlite_backend *backend, int readonly, int encode)
+{
+	static const char *sql_check =
+		"SELECT name FROM sqlite_master WHERE type='table' AND name='" GIT2_TABLE_NAME "';";
+
+	sqlite3_stmt *st_check;
+	int error, page_size, version;
+
+	/*
+	 * keep inline rows within what an index b-tree page holds locally,
+	 * less room for the key and the record header
+	 */
+	if (query_int(backend->writer.db, "PRAGMA page_size;", &page_size) < 0)
+		return GIT_ERROR;
+
+	backend->inline_max = (size_t)((page_size - 12) * 64 / 255 - 23 - 64);
+
+	if (sqlite3_prepare_v2(backend->writer.db, sql_check, -1, &st_check, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	switch (sqlite3_step(st_check)) {
+	case SQLITE_DONE:
+		/* the table was not found */
+		error = create_table(backend->writer.db);
+		backend->schema_version = 2;
+		break;
+
+	case SQLITE_ROW:
+		/* the table was found */
+		error = query_int(backend->writer.db, "PRAGMA user_version;", &version);
+		backend->schema_version = version >= 2 ? version : 1;
+		break;
+
+	default:
+		error = GIT_ERROR;
+		break;
+	}
+
+	sqlite3_finalize(st_check);
+
+	if (error < 0)
+		return error;
+
+	if (backend->schema_version > GIT2_SCHEMA_VERSION) {
+		giterr_set_str(GITERR_ODB, "SQLite odb database has a newer schema than this backend knows");
+		return GIT_ERROR;
+	}
+
+	/* a read-only open has to make do with the old table */
+	if (backend->schema_version < 2 && !readonly) {
+		if (migrate_v1(backend) < 0)
+			return GIT_ERROR;
+
+		backend->schema_version = 2;
+	}
+
+	if (backend->schema_version < 3 && encode && !readonly) {
+		if (migrate_v2(backend) < 0)
+			return GIT_ERROR;
+
+		backend->schema_version = 3;
+	}
+
+	return GIT_OK;
+}
+
+static int prepare_reader(sqlite_reader *reader, int version)
+{
+	/*
+	 * type, size, inline data, row id of the data blob, flags and delta
+	 * base; see read_object
+	 */
+	static const char *sql_read_v1 =
+		"SELECT type, size, NULL, rowid, 0, NULL FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_read_v2 =
+		"SELECT type, size, data, data_id, 0, NULL FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_read_v3 =
+		"SELECT type, size, data, data_id, flags, base FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_read_header =
+		"SELECT type, size FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_read_prefix =
+		"SELECT oid FROM '" GIT2_TABLE_NAME "' WHERE oid >= ? AND oid < ? ORDER BY oid LIMIT 2;";
+
+	const char *sql_read = version >= 3 ? sql_read_v3 : version == 2 ? sql_read_v2 : sql_read_v1;
+
+	if (sqlite3_prepare_v2(reader->db, sql_read, -1, &reader->st_read, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(reader->db, sql_read_header, -1, &reader->st_read_header, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(reader->db, sql_read_prefix, -1, &reader->st_read_prefix, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+static void close_reader(sqlite_reader *reader)
+{
+	sqlite3_finalize(reader->st_read);
+	sqlite3_finalize(reader->st_read_header);
+	sqlite3_finalize(reader->st_read_prefix);
+	sqlite3_close(reader->db);
+}
+
+static int init_statements(sqlite_backend *backend)
+{
+	static const char *sql_write_v1 =
+		"INSERT OR IGNORE INTO '" GIT2_TABLE_NAME "' VALUES (?, ?, ?, ?);";
+
+	static const char *sql_write_v2 =
+		"INSERT OR IGNORE INTO '" GIT2_TABLE_NAME "' VALUES (?, ?, ?, ?, ?);";
+
+	static const char *sql_write_v3 =
+		"INSERT OR IGNORE INTO '" GIT2_TABLE_NAME "' (oid, type, size, data, data_id, flags, base, depth)"
+		" VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+
+	static const char *sql_read_depth =
+		"SELECT depth FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_write_data =
+		"INSERT INTO '" GIT2_DATA_TABLE_NAME "' (data) VALUES (?);";
+
+	static const char *sql_delete_data =
+		"DELETE FROM '" GIT2_DATA_TABLE_NAME "' WHERE id = ?;";
+
+	int v2 = backend->schema_version >= 2, v3 = backend->schema_version >= 3;
+
+	backend->data_table = v2 ? GIT2_DATA_TABLE_NAME : GIT2_TABLE_NAME;
+
+	if (prepare_reader(&backend->writer, backend->schema_version) < 0)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(backend->writer.db, v3 ? sql_write_v3 : v2 ? sql_write_v2 : sql_write_v1, -1,
+			&backend->st_write, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (v3 && sqlite3_prepare_v2(backend->writer.db, sql_read_depth, -1, &backend->st_read_depth, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (v2 && sqlite3_prepare_v2(backend->writer.db, sql_write_data, -1, &backend->st_write_data, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (v2 && sqlite3_prepare_v2(backend->writer.db, sql_delete_data, -1, &backend->st_delete_data, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+static int flush(sqlite_backend *backend)
+{
+	if (bulk_flush(backend) < 0)
+		return GIT_ERROR;
+
+	return batch_commit(backend);
+}
+
+static int bulk_begin(sqlite_backend *backend)
+{
+	sqlite3_stmt *st;
+
+	if (backend->bulk)
+		return GIT_OK;
+
+	if (flush(backend) < 0)
+		return GIT_ERROR;
+
+	/* remember the durability we had so bulk_end can put it back */
+	if (sqlite3_prepare_v2(backend->writer.db, "PRAGMA synchronous;", -1, &st, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	backend->bulk_synchronous = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int(st, 0) : 2;
+	sqlite3_finalize(st);
+
+	if (exec_sql(backend->writer.db, "PRAGMA synchronous = OFF;") < 0)
+		return GIT_ERROR;
+
+	backend->bulk = 1;
+	return GIT_OK;
+}
+
+static int bulk_end(sqlite_backend *backend)
+{
+	char sql[64];
+	int error;
+
+	if (!backend->bulk)
+		return GIT_OK;
+
+	error = flush(backend);
+	backend->bulk = 0;
+
+	snprintf(sql, sizeof(sql), "PRAGMA synchronous = %d;", backend->bulk_synchronous);
+	if (exec_sql(backend->writer.db, sql) < 0)
+		return GIT_ERROR;
+
+	return error;
+}
+
+/*
+ * Each reader has its own read-only connection, used by one thread at a
+ * time; NOMUTEX saves SQLite locking it again on every call. Under WAL
+ * they read in parallel with each other and with the writer.
+ */
+static int open_readers(sqlite_backend *backend, const char *path, const git_odb_sqlite_options *opts)
+{
+	git_odb_sqlite_options reader_opts;
+	sqlite_reader *reader;
+	size_t i;
+
+	/* an in-memory database is private to its connection */
+	if (opts->read_connections == 0 || *path == '\0' || strcmp(path, ":memory:") == 0)
+		return GIT_OK;
+
+	memcpy(&reader_opts, opts, sizeof(reader_opts));
+	reader_opts.readonly = 1;
+
+	backend->readers = calloc(opts->read_connections, sizeof(sqlite_reader));
+	if (backend->readers == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < opts->read_connections; i++) {
+		reader = &backend->readers[i];
+		backend->reader_count++;
+
+		if (open_db(&reader->db, path, &reader_opts, SQLITE_OPEN_NOMUTEX) < 0 ||
+			configure_db(reader->db, &reader_opts) < 0 ||
+			prepare_reader(reader, backend->schema_version) < 0) {
+			if (reader->db != NULL)
+				giterr_set_str(GITERR_ODB, sqlite3_errmsg(reader->db));
+			return GIT_ERROR;
+		}
+
+		reader->next = backend->idle_readers;
+		backend->idle_readers = reader;
+	}
+
+	return GIT_OK;
+}
+
+int git_odb_backend_sqlite_flush(git_odb_backend *_backend)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(_backend);
+
+	if (_backend->free == &sqlite_sharded_backend__free)
+		return sharded_each(_backend, &git_odb_backend_sqlite_flush);
+
+	backend = (sqlite_backend *)_backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = flush(backend);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+int git_odb_backend_sqlite_bulk_begin(git_odb_backend *_backend)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(_backend);
+
+	if (_backend->free == &sqlite_sharded_backend__free)
+		return sharded_each(_backend, &git_odb_backend_sqlite_bulk_begin);
+
+	backend = (sqlite_backend *)_backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = bulk_begin(backend);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+int git_odb_backend_sqlite_bulk_end(git_odb_backend *_backend)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(_backend);
+
+	if (_backend->free == &sqlite_sharded_backend__free)
+		return sharded_each(_backend, &git_odb_backend_sqlite_bulk_end);
+
+	backend = (sqlite_backend *)_backend;
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = bulk_end(backend);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+/*
+ * In-memory mode: the database lives in a private :memory: connection,
+ * filled from the file at open and copied back to it with the backup
+ * API. The copy goes to a temporary file renamed over the old one, so
+ * the file always holds a whole snapshot.
+ *
+ * A snapshot is copied GIT2_BACKUP_STEP pages at a time and lets go of
+ * write_lock between steps, so reads and writes don't wait for all of
+ * it. SQLite starts the copy of an in-memory database over whenever a
+ * write commits in between; after GIT2_BACKUP_RESTARTS of those the rest
+ * is copied in one go, so that busy writers can't keep a snapshot from
+ * ever finishing. backend is NULL when loading, with nobody else around
+ * yet.
+ */
+static int backup_db(sqlite3 *to, sqlite3 *from, sqlite_backend *backend)
+{
+	sqlite3_backup *backup;
+	int error, restarts, remaining;
+
+	backup = sqlite3_backup_init(to, "main", from, "main");
+	if (backup == NULL) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(to));
+		return GIT_ERROR;
+	}
+
+	error = GIT_OK;
+	restarts = 0;
+	remaining = -1;
+
+	while (sqlite3_backup_step(backup,
+		backend && restarts < GIT2_BACKUP_RESTARTS ? GIT2_BACKUP_STEP : -1) == SQLITE_OK) {
+		if (remaining >= 0 && sqlite3_backup_remaining(backup) > remaining)
+			restarts++;
+		remaining = sqlite3_backup_remaining(backup);
+
+		pthread_mutex_unlock(&backend->write_lock);
+		sched_yield();
+		pthread_mutex_lock(&backend->write_lock);
+
+		/* a step can't copy from the middle of a write transaction */
+		if ((error = flush(backend)) < 0)
+			break;
+	}
+
+	if (sqlite3_backup_finish(backup) != SQLITE_OK && error == GIT_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(to));
+		error = GIT_ERROR;
+	}
+
+	return error;
+}
+
+static int load_snapshot(sqlite3 *db, const char *path, int readonly, int *loaded)
+{
+	sqlite3 *file;
+	int error, page_size;
+
+	*loaded = 0;
+
+	if (access(path, F_OK) < 0)
+		return GIT_OK;
+
+	if (sqlite3_open_v2(path, &file, readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(file));
+		sqlite3_close(file);
+		return GIT_ERROR;
+	}
+
+	/* a backup into memory fails unless both sides use the same page size */
+	error = query_int(file, "PRAGMA page_size;", &page_size);
+
+	if (error == GIT_OK)
+		error = set_pragma(db, "page_size", page_size);
+
+	if (error == GIT_OK)
+		error = backup_db(db, file, NULL);
+
+	sqlite3_close(file);
+
+	*loaded = error == GIT_OK;
+	return error;
+}
+
+static int write_snapshot(sqlite_backend *backend)
+{
+	sqlite3 *file;
+	char *tmp;
+	int changes, error;
+
+	if (flush(backend) < 0)
+		return GIT_ERROR;
+
+	if (sqlite3_total_changes(backend->writer.db) == backend->snapshot_changes)
+		return GIT_OK;
+
+	tmp = malloc(strlen(backend->snapshot_path) + strlen(".tmp") + 1);
+	if (tmp == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	strcpy(tmp, backend->snapshot_path);
+	strcat(tmp, ".tmp");
+
+	/* left behind by a snapshot that didn't finish */
+	unlink(tmp);
+
+	error = GIT_ERROR;
+
+	if (sqlite3_open_v2(tmp, &file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(file));
+	else
+		error = backup_db(file, backend->writer.db, backend);
+
+	/* the copy includes what was written while it was being made */
+	changes = sqlite3_total_changes(backend->writer.db);
+
+	if (sqlite3_close(file) != SQLITE_OK)
+		error = GIT_ERROR;
+
+	if (error == GIT_OK && rename(tmp, backend->snapshot_path) < 0) {
+		giterr_set_str(GITERR_OS, "SQLite odb couldn't replace the snapshot file");
+		error = GIT_ERROR;
+	}
+
+	if (error < 0)
+		unlink(tmp);
+	else
+		backend->snapshot_changes = changes;
+
+	free(tmp);
+	return error;
+}
+
+/*
+ * write a snapshot if anything changed since the last; write_lock is
+ * held. Snapshots are taken one at a time: a second one would start over
+ * on the first's temporary file while the first has let go of the lock.
+ */
+static int snapshot(sqlite_backend *backend)
+{
+	int error;
+
+	while (backend->snapshot_busy)
+		pthread_cond_wait(&backend->snapshot_done, &backend->write_lock);
+
+	backend->snapshot_busy = 1;
+	error = write_snapshot(backend);
+	backend->snapshot_busy = 0;
+
+	pthread_cond_broadcast(&backend->snapshot_done);
+	return error;
+}
+
+static void *snapshot_loop(void *payload)
+{
+	sqlite_backend *backend = payload;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&backend->snapshot_lock);
+
+	while (!backend->snapshot_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += backend->snapshot_ms / 1000;
+		deadline.tv_nsec += (long)(backend->snapshot_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!backend->snapshot_stop &&
+			pthread_cond_timedwait(&backend->snapshot_wake, &backend->snapshot_lock, &deadline) == 0)
+			;
+
+		if (backend->snapshot_stop)
+			break;
+
+		pthread_mutex_unlock(&backend->snapshot_lock);
+
+		/* nobody to report a failure to, the next round tries again */
+		pthread_mutex_lock(&backend->write_lock);
+		snapshot(backend);
+		pthread_mutex_unlock(&backend->write_lock);
+
+		pthread_mutex_lock(&backend->snapshot_lock);
+	}
+
+	pthread_mutex_unlock(&backend->snapshot_lock);
+	return NULL;
+}
+
+int git_odb_backend_sqlite_snapshot(git_odb_backend *_backend)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(_backend);
+
+	if (_backend->free == &sqlite_sharded_backend__free)
+		return sharded_each(_backend, &git_odb_backend_sqlite_snapshot);
+
+	backend = (sqlite_backend *)_backend;
+
+	if (backend->snapshot_path == NULL) {
+		giterr_set_str(GITERR_INVALID, "SQLite odb isn't an in-memory database with a snapshot file");
+		return GIT_ERROR;
+	}
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = snapshot(backend);
+	pthread_mutex_unlock(&backend->write_lock);
+
+	return error;
+}
+
+/*
+ * Compaction: with auto_vacuum=INCREMENTAL, pages freed by deletes stay
+ * on the freelist until incremental_vacuum moves them to the end of the
+ * file and truncates it. Each step is a short transaction of its own,
+ * so reads and writes go on in between.
+ */
+static int compact(sqlite_backend *backend, size_t max_pages, unsigned int max_ms, size_t *freed_out)
+{
+	struct timespec start;
+	char sql[64];
+	int mode, before, after, step;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&backend->write_lock);
+	error = flush(backend);
+
+	if (error == GIT_OK)
+		error = query_int(backend->writer.db, "PRAGMA auto_vacuum;", &mode);
+
+	if (error == GIT_OK && mode != 2) {
+		giterr_set_str(GITERR_ODB, "SQLite odb needs auto_vacuum=INCREMENTAL to compact");
+		error = GIT_ERROR;
+	}
+
+	if (error == GIT_OK)
+		error = query_int(backend->writer.db, "PRAGMA freelist_count;", &before);
+
+	pthread_mutex_unlock(&backend->write_lock);
+
+	if (error < 0)
+		return error;
+
+	after = before;
+
+	while (after > 0 && (max_pages == 0 || *freed_out < max_pages)) {
+		if (max_ms > 0 && elapsed_ms(&start) >= max_ms)
+			break;
+
+		step = GIT2_VACUUM_STEP;
+		if (max_pages > 0 && max_pages - *freed_out < (size_t)step)
+			step = (int)(max_pages - *freed_out);
+
+		snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", step);
+
+		pthread_mutex_lock(&backend->write_lock);
+		error = exec_sql(backend->writer.db, sql);
+		if (error == GIT_OK)
+			error = query_int(backend->writer.db, "PRAGMA freelist_count;", &after);
+		pthread_mutex_unlock(&backend->write_lock);
+
+		if (error < 0)
+			return error;
+
+		/* writes in between can free pages of their own, or use them up */
+		*freed_out += before > after ? (size_t)(before - after) : 0;
+		before = after;
+	}
+
+	return GIT_OK;
+}
+
+int git_odb_backend_sqlite_compact(git_odb_backend *_backend, size_t max_pages, unsigned int max_ms, size_t *freed_out)
+{
+	sqlite_sharded_backend *sharded;
+	struct timespec start;
+	unsigned int i, spent;
+	size_t freed;
+	int error;
+
+	assert(_backend);
+
+	freed = 0;
+
+	if (_backend->free != &sqlite_sharded_backend__free) {
+		error = compact((sqlite_backend *)_backend, max_pages, max_ms, &freed);
+	} else {
+		/* the shards share the budget, taking their turns in order */
+		sharded = (sqlite_sharded_backend *)_backend;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		error = GIT_OK;
+
+		for (i = 0; i < sharded->count && error == GIT_OK; i++) {
+			spent = elapsed_ms(&start);
+			if ((max_pages > 0 && freed >= max_pages) || (max_ms > 0 && spent >= max_ms))
+				break;
+
+			error = compact(sharded->shards[i], max_pages ? max_pages - freed : 0,
+				max_ms ? max_ms - spent : 0, &freed);
+		}
+	}
+
+	if (freed_out != NULL)
+		*freed_out = freed;
+
+	return error;
+}
+
+/*
+ * Pages of the object tables a scan reads, leaves and the overflow pages
+ * of big rows, that don't directly follow the one read before them in
+ * the file, each a seek; dbstat lists a b-tree's pages in tree order.
+ */
+static int count_unordered(sqlite3 *db, size_t *scan_pages, size_t *unordered)
+{
+	static const char *sql_pages =
+		"SELECT name, pageno FROM dbstat WHERE pagetype IN ('leaf', 'overflow') "
+		"AND name IN ('" GIT2_TABLE_NAME "', '" GIT2_DATA_TABLE_NAME "') ORDER BY name, path;";
+
+	sqlite3_stmt *st;
+	sqlite3_int64 page, last;
+	int error, table, last_table;
+
+	if (sqlite3_prepare_v2(db, sql_pages, -1, &st, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	last = 0;
+	last_table = -1;
+
+	while ((error = sqlite3_step(st)) == SQLITE_ROW) {
+		table = strcmp((const char *)sqlite3_column_text(st, 0), GIT2_TABLE_NAME) != 0;
+		page = sqlite3_column_int64(st, 1);
+
+		if (table == last_table && page != last + 1)
+			(*unordered)++;
+
+		(*scan_pages)++;
+		last = page;
+		last_table = table;
+	}
+
+	sqlite3_finalize(st);
+
+	if (error != SQLITE_DONE) {
+		giterr_set_str(GITERR_ODB, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int stats(git_odb_sqlite_stats *out, sqlite_backend *backend, int fragmentation)
+{
+	sqlite_reader *reader;
+	int page_size, page_count, freelist, mode;
+	int error;
+
+	if ((reader = acquire_reader(backend, 1)) == NULL)
+		return GIT_ERROR;
+
+	error = query_int(reader->db, "PRAGMA page_size;", &page_size);
+
+	if (error == GIT_OK)
+		error = query_int(reader->db, "PRAGMA page_count;", &page_count);
+
+	if (error == GIT_OK)
+		error = query_int(reader->db, "PRAGMA freelist_count;", &freelist);
+
+	if (error == GIT_OK)
+		error = query_int(reader->db, "PRAGMA auto_vacuum;", &mode);
+
+	if (error == GIT_OK && fragmentation)
+		error = count_unordered(reader->db, &out->scan_pages, &out->unordered_pages);
+
+	release_reader(backend, reader);
+
+	if (error < 0)
+		return error;
+
+	out->page_size = page_size;
+	out->page_count += page_count;
+	out->freelist_count += freelist;
+	out->auto_vacuum = mode;
+	return GIT_OK;
+}
+
+int git_odb_backend_sqlite_stats(git_odb_sqlite_stats *out, git_odb_backend *_backend, int fragmentation)
+{
+	sqlite_sharded_backend *sharded;
+	unsigned int i;
+	int error;
+
+	assert(out && _backend);
+
+	memset(out, 0, sizeof(*out));
+
+	if (_backend->free != &sqlite_sharded_backend__free)
+		return stats(out, (sqlite_backend *)_backend, fragmentation);
+
+	sharded = (sqlite_sharded_backend *)_backend;
+
+	for (i = 0; i < sharded->count; i++) {
+		if ((error = stats(out, sharded->shards[i], fragmentation)) < 0)
+			return error;
+	}
+
+	return GIT_OK;
+}
+
+int git_odb_sqlite_init_options(git_odb_sqlite_options *opts, unsigned int version)
+{
+	git_odb_sqlite_options defaults = GIT_ODB_SQLITE_OPTIONS_INIT;
+
+	if (version != GIT_ODB_SQLITE_OPTIONS_VERSION) {
+		giterr_set_str(GITERR_INVALID, "invalid version for git_odb_sqlite_options");
+		return GIT_ERROR;
+	}
+
+	memcpy(opts, &defaults, sizeof(defaults));
+	return GIT_OK;
+}
+
+int git_odb_backend_sqlite_ext(git_odb_backend **backend_out, const char *sqlite_db,
+	const git_odb_sqlite_options *opts)
+{
+	git_odb_sqlite_options defaults = GIT_ODB_SQLITE_OPTIONS_INIT;
+	sqlite_backend *backend;
+	int error, in_memory, loaded, readonly;
+
+	if (opts == NULL)
+		opts = &defaults;
+
+	if (opts->version != GIT_ODB_SQLITE_OPTIONS_VERSION) {
+		giterr_set_str(GITERR_INVALID, "invalid version for git_odb_sqlite_options");
+		return GIT_ERROR;
+	}
+
+	readonly = opts->readonly || opts->immutable;
+	in_memory = opts->in_memory && *sqlite_db != '\0' && strcmp(sqlite_db, ":memory:") != 0;
+
+	backend = calloc(1, sizeof(sqlite_backend));
+	if (backend == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	pthread_mutex_init(&backend->write_lock, NULL);
+	pthread_mutex_init(&backend->pool_lock, NULL);
+	pthread_cond_init(&backend->pool_available, NULL);
+	pthread_mutex_init(&backend->cache_lock, NULL);
+	pthread_mutex_init(&backend->snapshot_lock, NULL);
+	pthread_cond_init(&backend->snapshot_wake, NULL);
+	pthread_cond_init(&backend->snapshot_done, NULL);
+
+	backend->batch_objects = opts->batch_objects;
+	backend->batch_bytes = opts->batch_bytes;
+	backend->batch_ms = opts->batch_ms;
+	backend->compression = opts->compression;
+	backend->delta_depth = opts->delta_depth;
+	backend->cache_limit = opts->delta_cache_size;
+
+	if (in_memory) {
+		error = sqlite3_open(":memory:", &backend->writer.db) == SQLITE_OK ? GIT_OK : GIT_ERROR;
+		if (error < 0)
+			goto cleanup;
+
+		error = load_snapshot(backend->writer.db, sqlite_db, readonly, &loaded);
+
+		/* what init_db migrates is a change to snapshot */
+		backend->snapshot_changes = loaded ? sqlite3_total_changes(backend->writer.db) : -1;
+	} else {
+		error = open_db(&backend->writer.db, sqlite_db, opts, 0);
+	}
+
+	if (error < 0)
+		goto cleanup;
+
+	error = configure_db(backend->writer.db, opts);
+	if (error < 0)
+		goto cleanup;
+
+	error = init_db(backend, readonly, opts->compression > 0 || opts->delta_depth > 0);
+	if (error < 0)
+		goto cleanup;
+
+	error = init_statements(backend);
+	if (error < 0)
+		goto cleanup;
+
+	/* the other connections couldn't see a private in-memory database */
+	if (!in_memory) {
+		error = open_readers(backend, sqlite_db, opts);
+		if (error < 0)
+			goto cleanup;
+	}
+
+	/*
+	 * a read-only open reads the file into memory and never writes it
+	 * back; a file that wasn't there yet gets its first snapshot even if
+	 * nothing is written
+	 */
+	if (in_memory && !readonly) {
+		backend->snapshot_path = strdup(sqlite_db);
+		if (backend->snapshot_path == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+			goto cleanup;
+		}
+
+		backend->snapshot_ms = opts->snapshot_ms;
+
+		if (backend->snapshot_ms > 0) {
+			if (pthread_create(&backend->snapshot_thread, NULL, &snapshot_loop, backend) != 0) {
+				giterr_set_str(GITERR_OS, "SQLite odb couldn't start the snapshot thread");
+				error = GIT_ERROR;
+				goto cleanup;
+			}
+
+			backend->snapshot_running = 1;
+		}
+	}
+
+	backend->parent.version = GIT_ODB_BACKEND_VERSION;
+	backend->parent.read = &sqlite_backend__read;
+	backend->parent.read_prefix = &sqlite_backend__read_prefix;
+	backend->parent.read_header = &sqlite_backend__read_header;
+	backend->parent.write = &sqlite_backend__write;
+	backend->parent.readstream = &sqlite_backend__readstream;
+	backend->parent.exists = &sqlite_backend__exists;
+	backend->parent.exists_prefix = &sqlite_backend__exists_prefix;
+	backend->parent.foreach = &sqlite_backend__foreach;
+	backend->parent.free = &sqlite_backend__free;
+
+	/*
+	 * streamed objects go to the data table, which v1 doesn't have; and
+	 * they go there as is, so with compression libgit2 is left to buffer
+	 * them and hand them to write instead
+	 */
+	if (backend->schema_version >= 2 && backend->compression == 0)
+		backend->parent.writestream = &sqlite_backend__writestream;
+
+	*backend_out = (git_odb_backend *)backend;
+	return GIT_OK;
+
+cleanup:
+	sqlite_backend__free((git_odb_backend *)backend);
+	return error;
+}
+
+int git_odb_backend_sqlite(git_odb_backend **backend_out, const char *sqlite_db)
+{
+	return git_odb_backend_sqlite_ext(backend_out, sqlite_db, NULL);
+}
+
+/* Sharded odb */
+
+/* shards split the first oid byte into even, contiguous ranges */
+static sqlite_backend *shard_owner(sqlite_sharded_backend *backend, const git_oid *oid)
+{
+	return backend->shards[oid->id[0] * backend->count / 256];
+}
+
+int sqlite_sharded_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	assert(data_p && len_p && type_p && _backend && oid);
+	return sqlite_backend__read(data_p, len_p, type_p,
+		(git_odb_backend *)shard_owner((sqlite_sharded_backend *)_backend, oid), oid);
+}
+
+int sqlite_sharded_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	assert(len_p && type_p && _backend && oid);
+	return sqlite_backend__read_header(len_p, type_p,
+		(git_odb_backend *)shard_owner((sqlite_sharded_backend *)_backend, oid), oid);
+}
+
+/*
+ * the stream keeps pointing at the shard it came from, which is the
+ * backend its read and free work on
+ */
+int sqlite_sharded_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+	assert(stream_out && _backend && oid);
+	return sqlite_backend__readstream(stream_out,
+		(git_odb_backend *)shard_owner((sqlite_sharded_backend *)_backend, oid), oid);
+}
+
+int sqlite_sharded_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	assert(_backend && oid);
+	return sqlite_backend__exists((git_odb_backend *)shard_owner((sqlite_sharded_backend *)_backend, oid), oid);
+}
+
+/*
+ * A prefix of two or more digits names its first byte and with it its
+ * shard; a shorter one can span two, which are asked in turn.
+ */
+int sqlite_sharded_backend__exists_prefix(git_oid *out_oid, git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	sqlite_sharded_backend *backend;
+	unsigned int first, last, i;
+	git_oid found;
+	int error, matches;
+
+	assert(out_oid && _backend && short_oid);
+
+	backend = (sqlite_sharded_backend *)_backend;
+
+	if (len >= 2) {
+		first = last = short_oid->id[0] * backend->count / 256;
+	} else {
+		first = (len ? short_oid->id[0] & 0xf0 : 0x00) * backend->count / 256;
+		last = (len ? short_oid->id[0] | 0x0f : 0xff) * backend->count / 256;
+	}
+
+	matches = 0;
+
+	for (i = first; i <= last; i++) {
+		error = sqlite_backend__exists_prefix(&found, (git_odb_backend *)backend->shards[i], short_oid, len);
+
+		if (error == GIT_ENOTFOUND)
+			continue;
+		if (error < 0)
+			return error;
+
+		if (matches++ > 0) {
+			giterr_set_str(GITERR_ODB, "SQLite odb found multiple objects for the prefix");
+			return GIT_EAMBIGUOUS;
+		}
+
+		git_oid_cpy(out_oid, &found);
+	}
+
+	return matches ? GIT_OK : GIT_ENOTFOUND;
+}
+
+int sqlite_sharded_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	git_oid oid;
+	int error;
+
+	assert(out_oid && data_p && len_p && type_p && _backend && short_oid);
+
+	if ((error = sqlite_sharded_backend__exists_prefix(&oid, _backend, short_oid, len)) < 0)
+		return error;
+
+	if ((error = sqlite_sharded_backend__read(data_p, len_p, type_p, _backend, &oid)) == GIT_OK)
+		git_oid_cpy(out_oid, &oid);
+
+	return error;
+}
+
+/* each shard has its own writer, so writes to different shards run at once */
+int sqlite_sharded_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+	assert(oid && _backend && data);
+	return sqlite_backend__write((git_odb_backend *)shard_owner((sqlite_sharded_backend *)_backend, oid),
+		oid, data, len, type);
+}
+
+/* shards are walked in order, so the oids still come out sorted */
+int sqlite_sharded_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+	sqlite_sharded_backend *backend;
+	unsigned int i;
+	int error;
+
+	assert(_backend && cb);
+
+	backend = (sqlite_sharded_backend *)_backend;
+
+	for (i = 0; i < backend->count; i++) {
+		if ((error = sqlite_backend__foreach((git_odb_backend *)backend->shards[i], cb, payload)) != 0)
+			return error;
+	}
+
+	return GIT_OK;
+}
+
+void sqlite_sharded_backend__free(git_odb_backend *_backend)
+{
+	sqlite_sharded_backend *backend;
+	unsigned int i;
+
+	assert(_backend);
+	backend = (sqlite_sharded_backend *)_backend;
+
+	for (i = 0; i < backend->count; i++) {
+		if (backend->shards[i])
+			sqlite_backend__free((git_odb_backend *)backend->shards[i]);
+	}
+
+	free(backend->shards);
+	free(backend);
+}
+
+/* run one of the public calls on every shard, stopping at the first error */
+static int sharded_each(git_odb_backend *_backend, int (*fn)(git_odb_backend *))
+{
+	sqlite_sharded_backend *backend;
+	unsigned int i;
+	int error;
+
+	backend = (sqlite_sharded_backend *)_backend;
+
+	for (i = 0; i < backend->count; i++) {
+		if ((error = fn((git_odb_backend *)backend->shards[i])) < 0)
+			return error;
+	}
+
+	return GIT_OK;
+}
+
+/* a delta can only point at a base in its own file */
+static int sharded_write_delta(git_odb_backend *_backend, const git_oid *id, const void *data, size_t len,
+	git_otype type, const git_oid *base)
+{
+	sqlite_sharded_backend *backend;
+	sqlite_backend *shard;
+
+	backend = (sqlite_sharded_backend *)_backend;
+	shard = shard_owner(backend, id);
+
+	if (shard_owner(backend, base) != shard)
+		return sqlite_backend__write((git_odb_backend *)shard, id, data, len, type);
+
+	return git_odb_backend_sqlite_write_delta((git_odb_backend *)shard, id, data, len, type, base);
+}
+
+/*
+ * The shard count is kept in every file's application_id, as opening
+ * the files with another count would look for objects in the wrong
+ * ones.
+ */
+static int check_shard(sqlite_backend *shard, unsigned int count, int readonly)
+{
+	int id;
+
+	if (query_int(shard->writer.db, "PRAGMA application_id;", &id) < 0)
+		return GIT_ERROR;
+
+	if (id == 0 && !readonly)
+		return set_pragma(shard->writer.db, "application_id", count);
+
+	if (id != (int)count) {
+		giterr_set_str(GITERR_INVALID, "SQLite odb shard was created with a different number of shards");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int git_odb_backend_sqlite_sharded(git_odb_backend **backend_out, const char *dir, unsigned int count,
+	const git_odb_sqlite_options *opts)
+{
+	git_odb_sqlite_options defaults = GIT_ODB_SQLITE_OPTIONS_INIT;
+	sqlite_sharded_backend *backend;
+	git_odb_backend *shard;
+	char *path;
+	size_t path_len;
+	unsigned int i;
+	int readonly;
+
+	assert(backend_out && dir);
+
+	if (opts == NULL)
+		opts = &defaults;
+
+	if (count == 0 || count > 256) {
+		giterr_set_str(GITERR_INVALID, "SQLite odb needs between 1 and 256 shards");
+		return GIT_ERROR;
+	}
+
+	readonly = opts->readonly || opts->immutable;
+
+	if (!readonly && mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		giterr_set_str(GITERR_OS, "SQLite odb couldn't create the shard directory");
+		return GIT_ERROR;
+	}
+
+	backend = calloc(1, sizeof(sqlite_sharded_backend));
+	if (backend == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	path_len = strlen(dir) + strlen("/odb-000.db") + 1;
+	path = malloc(path_len);
+	backend->shards = calloc(count, sizeof(sqlite_backend *));
+	if (path == NULL || backend->shards == NULL) {
+		giterr_set_oom();
+		goto cleanup;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, path_len, "%s/odb-%03u.db", dir, i);
+
+		if (git_odb_backend_sqlite_ext(&shard, path, opts) < 0)
+			goto cleanup;
+
+		backend->shards[backend->count++] = (sqlite_backend *)shard;
+
+		if (check_shard((sqlite_backend *)shard, count, readonly) < 0)
+			goto cleanup;
+	}
+
+	free(path);
+
+	backend->parent.version = GIT_ODB_BACKEND_VERSION;
+	backend->parent.read = &sqlite_sharded_backend__read;
+	backend->parent.read_prefix = &sqlite_sharded_backend__read_prefix;
+	backend->parent.read_header = &sqlite_sharded_backend__read_header;
+	backend->parent.write = &sqlite_sharded_backend__write;
+	backend->parent.readstream = &sqlite_sharded_backend__readstream;
+	backend->parent.exists = &sqlite_sharded_backend__exists;
+	backend->parent.exists_prefix = &sqlite_sharded_backend__exists_prefix;
+	backend->parent.foreach = &sqlite_sharded_backend__foreach;
+	backend->parent.free = &sqlite_sharded_backend__free;
+
+	/*
+	 * a write stream only learns its oid, and with it its shard, after the
+	 * data has been sent; leaving this out makes libgit2 buffer and write()
+	 */
+	backend->parent.writestream = NULL;
+
+	*backend_out = (git_odb_backend *)backend;
+	return GIT_OK;
+
+cleanup:
+	free(path);
+	sqlite_sharded_backend__free((git_odb_backend *)backend);
+	return GIT_ERROR;
+}
+
+/* Refdb methods */
+
+static int refdb_exec(sqlite3 *db, const char *sql)
+{
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/* run a statement that returns no rows, the caller binds and we reset */
+static int refdb_step(sqlite_refdb_backend *backend, sqlite3_stmt *st)
+{
+	int error;
+
+	switch (sqlite3_step(st)) {
+	case SQLITE_DONE:
+		error = GIT_OK;
+		break;
+
+	case SQLITE_CONSTRAINT:
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		error = GIT_EEXISTS;
+		break;
+
+	default:
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		error = GIT_ERROR;
+		break;
+	}
+
+	sqlite3_reset(st);
+	return error;
+}
+
+/*
+ * Statements that must go through together get a transaction of their
+ * own, unless a git_transaction already has one open. IMMEDIATE takes
+ * the write lock up front: a deferred transaction that reads first can
+ * fail to upgrade when another connection is writing, and the busy
+ * handler can't help with that.
+ */
+static int refdb_begin(sqlite_refdb_backend *backend, int *started)
+{
+	*started = 0;
+
+	if (backend->txn_depth > 0)
+		return GIT_OK;
+
+	if (refdb_exec(backend->db, "BEGIN IMMEDIATE;") < 0)
+		return GIT_ERROR;
+
+	*started = 1;
+	return GIT_OK;
+}
+
+static int refdb_end(sqlite_refdb_backend *backend, int started, int error)
+{
+	if (error < 0 && backend->txn_depth > 0)
+		backend->txn_failed = 1;
+
+	if (!started)
+		return error;
+
+	if (error < 0) {
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		return error;
+	}
+
+	if (refdb_exec(backend->db, "COMMIT;") < 0) {
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int refdb_build_reference(git_reference **out, const char *name, int type, const char *target)
+{
+	git_oid oid;
+
+	if (target == NULL) {
+		giterr_set_str(GITERR_REFERENCE, "SQLite refdb storage corrupted (ref without a target)");
+		return GIT_ERROR;
+	}
+
+	if (type == GIT_REF_OID) {
+		if (git_oid_fromstr(&oid, target) < 0)
+			return GIT_ERROR;
+
+		*out = git_reference__alloc(name, &oid, NULL);
+	} else if (type == GIT_REF_SYMBOLIC) {
+		*out = git_reference__alloc_symbolic(name, target);
+	} else {
+		giterr_set_str(GITERR_REFERENCE, "SQLite refdb storage corrupted (unknown ref type returned)");
+		return GIT_ERROR;
+	}
+
+	if (*out == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int refdb_append_log(sqlite_refdb_backend *backend, const char *name, const git_oid *new_id,
+	const git_signature *who, const char *message)
+{
+	char new_id_str[GIT_OID_HEXSZ + 1];
+	git_oid zero;
+
+	memset(&zero, 0, sizeof(zero));
+	git_oid_tostr(new_id_str, sizeof(new_id_str), new_id ? new_id : &zero);
+
+	/*
+	 * the old id is looked up by the statement itself, from the ref as it
+	 * is before the update that follows in the same transaction
+	 */
+	if (sqlite3_bind_text(backend->st_reflog_append, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_reflog_append, 2, new_id_str, GIT_OID_HEXSZ, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_reflog_append, 3, who->name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_reflog_append, 4, who->email, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_int64(backend->st_reflog_append, 5, (sqlite3_int64)who->when.time) != SQLITE_OK ||
+		sqlite3_bind_int(backend->st_reflog_append, 6, who->when.offset) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_reflog_append, 7, message, -1, SQLITE_STATIC) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		sqlite3_reset(backend->st_reflog_append);
+		return GIT_ERROR;
+	}
+
+	return refdb_step(backend, backend->st_reflog_append);
+}
+
+int sqlite_refdb_backend__exists(int *exists, git_refdb_backend *_backend, const char *ref_name)
+{
+	sqlite_refdb_backend *backend;
+	int error;
+
+	assert(exists && ref_name && _backend);
+
+	backend = (sqlite_refdb_backend *)_backend;
+	error = GIT_OK;
+
+	if (sqlite3_bind_text(backend->st_lookup, 1, ref_name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		error = GIT_ERROR;
+	} else {
+		switch (sqlite3_step(backend->st_lookup)) {
+		case SQLITE_ROW:
+			*exists = 1;
+			break;
+
+		case SQLITE_DONE:
+			*exists = 0;
+			break;
+
+		default:
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			error = GIT_ERROR;
+			break;
+		}
+	}
+
+	sqlite3_reset(backend->st_lookup);
+	return error;
+}
+
+int sqlite_refdb_backend__lookup(git_reference **out, git_refdb_backend *_backend, const char *ref_name)
+{
+	sqlite_refdb_backend *backend;
+	int error;
+
+	assert(out && ref_name && _backend);
+
+	backend = (sqlite_refdb_backend *)_backend;
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_lookup, 1, ref_name, -1, SQLITE_STATIC) == SQLITE_OK) {
+		switch (sqlite3_step(backend->st_lookup)) {
+		case SQLITE_ROW:
+			error = refdb_build_reference(out, ref_name,
+				sqlite3_column_int(backend->st_lookup, 0),
+				(const char *)sqlite3_column_text(backend->st_lookup, 1));
+			break;
+
+		case SQLITE_DONE:
+			giterr_set_str(GITERR_REFERENCE, "SQLite refdb couldn't find ref");
+			error = GIT_ENOTFOUND;
+			break;
+
+		default:
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			break;
+		}
+	}
+
+	sqlite3_reset(backend->st_lookup);
+	return error;
+}
+
+static int refdb_iterator_step(sqlite_refdb_iterator *iter)
+{
+	const char *name;
+	int error;
+
+	while ((error = sqlite3_step(iter->st)) == SQLITE_ROW) {
+		name = (const char *)sqlite3_column_text(iter->st, 0);
+
+		if (iter->glob == NULL || fnmatch(iter->glob, name, 0) == 0)
+			return GIT_OK;
+	}
+
+	if (error != SQLITE_DONE) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(sqlite3_db_handle(iter->st)));
+		return GIT_ERROR;
+	}
+
+	return GIT_ITEROVER;
+}
+
+int sqlite_refdb_backend__iterator_next(git_reference **ref, git_reference_iterator *_iter)
+{
+	sqlite_refdb_iterator *iter;
+	int error;
+
+	assert(ref && _iter);
+	iter = (sqlite_refdb_iterator *)_iter;
+
+	if ((error = refdb_iterator_step(iter)) < 0)
+		return error;
+
+	return refdb_build_reference(ref, (const char *)sqlite3_column_text(iter->st, 0),
+		sqlite3_column_int(iter->st, 1), (const char *)sqlite3_column_text(iter->st, 2));
+}
+
+int sqlite_refdb_backend__iterator_next_name(const char **ref_name, git_reference_iterator *_iter)
 {
-	sqlite_backend *backend;
+	sqlite_refdb_iterator *iter;
 	int error;
 
-	assert(len_p && type_p && _backend && oid);
+	assert(ref_name && _iter);
+	iter = (sqlite_refdb_iterator *)_iter;
 
-	backend = (sqlite_backend *)_backend;
-	error = GIT_ERROR;
+	if ((error = refdb_iterator_step(iter)) < 0)
+		return error;
 
-	if (sqlite3_bind_text(backend->st_read_header, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK) {
-		if (sqlite3_step(backend->st_read_header) == SQLITE_ROW) {
-			*type_p = (git_otype)sqlite3_column_int(backend->st_read_header, 0);
-			*len_p = (size_t)sqlite3_column_int(backend->st_read_header, 1);
-			assert(sqlite3_step(backend->st_read_header) == SQLITE_DONE);
-			error = GIT_OK;
-		} else {
-			error = GIT_ENOTFOUND;
+	/* stays valid until the next call, like the other refdbs' names */
+	*ref_name = (const char *)sqlite3_column_text(iter->st, 0);
+	return GIT_OK;
+}
+
+void sqlite_refdb_backend__iterator_free(git_reference_iterator *_iter)
+{
+	sqlite_refdb_iterator *iter;
+
+	assert(_iter);
+	iter = (sqlite_refdb_iterator *)_iter;
+
+	sqlite3_finalize(iter->st);
+	free(iter->glob);
+	free(iter->prefix);
+	free(iter->end);
+	free(iter);
+}
+
+/*
+ * Everything up to the first wildcard is a literal prefix, which turns
+ * into a range scan on the primary key; fnmatch takes care of the rest.
+ * The end of the range is the prefix with its last byte bumped, which
+ * is where the names starting with it stop in memcmp order; a prefix
+ * with no such end gets an empty BLOB, which sorts after any TEXT.
+ */
+int sqlite_refdb_backend__iterator(git_reference_iterator **_iter, struct git_refdb_backend *_backend, const char *glob)
+{
+	static const char *sql_iterate =
+		"SELECT name, type, target FROM '" GIT2_REFS_TABLE_NAME "'"
+		" WHERE name >= ? AND name < ? ORDER BY name;";
+
+	sqlite_refdb_backend *backend;
+	sqlite_refdb_iterator *iter;
+	const char *prefix;
+	size_t prefix_len, end_len;
+
+	assert(_iter && _backend);
+
+	backend = (sqlite_refdb_backend *)_backend;
+
+	iter = calloc(1, sizeof(sqlite_refdb_iterator));
+	if (iter == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	prefix = glob ? glob : "refs/";
+	prefix_len = strcspn(prefix, "*?[\\");
+
+	if ((glob != NULL && (iter->glob = strdup(glob)) == NULL) ||
+		(iter->prefix = malloc(prefix_len + 1)) == NULL) {
+		giterr_set_oom();
+		goto cleanup;
+	}
+
+	memcpy(iter->prefix, prefix, prefix_len);
+	iter->prefix[prefix_len] = '\0';
+
+	/* a prefix of nothing but 0xff bytes, or none at all, has no end */
+	for (end_len = prefix_len; end_len > 0 && (unsigned char)prefix[end_len - 1] == 0xff; end_len--)
+		;
+
+	if (sqlite3_prepare_v2(backend->db, sql_iterate, -1, &iter->st, NULL) != SQLITE_OK ||
+		sqlite3_bind_text(iter->st, 1, iter->prefix, (int)prefix_len, SQLITE_STATIC) != SQLITE_OK)
+		goto error;
+
+	if (end_len > 0) {
+		iter->end = malloc(end_len);
+		if (iter->end == NULL) {
+			giterr_set_oom();
+			goto cleanup;
 		}
+
+		memcpy(iter->end, prefix, end_len);
+		iter->end[end_len - 1]++;
+
+		if (sqlite3_bind_text(iter->st, 2, iter->end, (int)end_len, SQLITE_STATIC) != SQLITE_OK)
+			goto error;
+	} else if (sqlite3_bind_zeroblob(iter->st, 2, 0) != SQLITE_OK) {
+		goto error;
 	}
 
-	sqlite3_reset(backend->st_read_header);
-	return error;
+	iter->parent.next = &sqlite_refdb_backend__iterator_next;
+	iter->parent.next_name = &sqlite_refdb_backend__iterator_next_name;
+	iter->parent.free = &sqlite_refdb_backend__iterator_free;
+
+	*_iter = (git_reference_iterator *)iter;
+	return GIT_OK;
+
+error:
+	giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+cleanup:
+	sqlite_refdb_backend__iterator_free((git_reference_iterator *)iter);
+	return GIT_ERROR;
 }
 
-int sqlite_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+int sqlite_refdb_backend__write(git_refdb_backend *_backend, const git_reference *ref, int force, const git_signature *who,
+	const char *message, const git_oid *old, const char *old_target)
 {
-	sqlite_backend *backend;
-	int error;
+	sqlite_refdb_backend *backend;
+	sqlite3_stmt *st;
+	const char *name, *target, *expected;
+	char target_buf[GIT_OID_HEXSZ + 1], expected_buf[GIT_OID_HEXSZ + 1];
+	int type, error, started;
 
-	assert(data_p && len_p && type_p && _backend && oid);
+	assert(ref && _backend);
 
-	backend = (sqlite_backend *)_backend;
-	error = GIT_ERROR;
+	backend = (sqlite_refdb_backend *)_backend;
 
-	if (sqlite3_bind_text(backend->st_read, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK) {
-		if (sqlite3_step(backend->st_read) == SQLITE_ROW) {
-			*type_p = (git_otype)sqlite3_column_int(backend->st_read, 0);
-			*len_p = (size_t)sqlite3_column_int(backend->st_read, 1);
-			*data_p = malloc(*len_p);
+	name = git_reference_name(ref);
 
-			if (*data_p == NULL) {
-				giterr_set_oom();
-				error = GIT_ERROR;
-			} else {
-				memcpy(*data_p, sqlite3_column_blob(backend->st_read, 2), *len_p);
-				error = GIT_OK;
-			}
+	if (git_reference_target(ref) != NULL) {
+		git_oid_tostr(target_buf, sizeof(target_buf), git_reference_target(ref));
+		target = target_buf;
+		type = GIT_REF_OID;
+	} else {
+		target = git_reference_symbolic_target(ref);
+		type = GIT_REF_SYMBOLIC;
+	}
+
+	expected = NULL;
+	if (old != NULL) {
+		git_oid_tostr(expected_buf, sizeof(expected_buf), old);
+		expected = expected_buf;
+	} else if (old_target != NULL) {
+		expected = old_target;
+	}
+
+	/* the ref and its log entry change together or not at all */
+	started = 0;
+	if (who != NULL) {
+		if ((error = refdb_begin(backend, &started)) < 0)
+			return error;
+
+		if ((error = refdb_append_log(backend, name, git_reference_target(ref), who, message)) < 0)
+			goto done;
+	}
+
+	if (expected != NULL) {
+		/*
+		 * compare-and-swap: the row only changes if it still holds the
+		 * value the caller based this update on
+		 */
+		st = backend->st_update;
+		if (sqlite3_bind_int(st, 1, type) != SQLITE_OK ||
+			sqlite3_bind_text(st, 2, target, -1, SQLITE_STATIC) != SQLITE_OK ||
+			sqlite3_bind_text(st, 3, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+			sqlite3_bind_text(st, 4, expected, -1, SQLITE_STATIC) != SQLITE_OK) {
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			sqlite3_reset(st);
+			error = GIT_ERROR;
+			goto done;
+		}
+
+		/* changes() counts the rows matched, even if left as they were */
+		error = refdb_step(backend, st);
+		if (error == GIT_OK && sqlite3_changes(backend->db) != 1) {
+			giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+			error = GIT_EMODIFIED;
+		}
+	} else {
+		st = force ? backend->st_upsert : backend->st_insert;
+		if (sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+			sqlite3_bind_int(st, 2, type) != SQLITE_OK ||
+			sqlite3_bind_text(st, 3, target, -1, SQLITE_STATIC) != SQLITE_OK) {
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			sqlite3_reset(st);
+			error = GIT_ERROR;
+			goto done;
+		}
+
+		error = refdb_step(backend, st);
+		if (error == GIT_EEXISTS)
+			giterr_set_str(GITERR_REFERENCE, "failed to write reference, it already exists");
+	}
+
+done:
+	return refdb_end(backend, started, error);
+}
+
+static int refdb_delete_log(sqlite_refdb_backend *backend, const char *name)
+{
+	if (sqlite3_bind_text(backend->st_reflog_delete, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		sqlite3_reset(backend->st_reflog_delete);
+		return GIT_ERROR;
+	}
+
+	return refdb_step(backend, backend->st_reflog_delete);
+}
+
+int sqlite_refdb_backend__del(git_refdb_backend *_backend, const char *ref_name, const git_oid *old, const char *old_target)
+{
+	sqlite_refdb_backend *backend;
+	sqlite3_stmt *st;
+	const char *expected;
+	char expected_buf[GIT_OID_HEXSZ + 1];
+	int error, started;
 
-			assert(sqlite3_step(backend->st_read) == SQLITE_DONE);
+	assert(ref_name && _backend);
+
+	backend = (sqlite_refdb_backend *)_backend;
+
+	expected = NULL;
+	if (old != NULL) {
+		git_oid_tostr(expected_buf, sizeof(expected_buf), old);
+		expected = expected_buf;
+	} else if (old_target != NULL) {
+		expected = old_target;
+	}
+
+	/* the ref and its reflog go in the same transaction */
+	if ((error = refdb_begin(backend, &started)) < 0)
+		return error;
+
+	st = expected ? backend->st_delete_cas : backend->st_delete;
+	if (sqlite3_bind_text(st, 1, ref_name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		(expected && sqlite3_bind_text(st, 2, expected, -1, SQLITE_STATIC) != SQLITE_OK)) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		sqlite3_reset(st);
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	if ((error = refdb_step(backend, st)) < 0)
+		goto done;
+
+	if (sqlite3_changes(backend->db) == 0) {
+		if (expected) {
+			giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+			error = GIT_EMODIFIED;
 		} else {
+			giterr_set_str(GITERR_REFERENCE, "SQLite refdb couldn't find ref");
 			error = GIT_ENOTFOUND;
 		}
+		goto done;
 	}
 
-	sqlite3_reset(backend->st_read);
-	return error;
+	error = refdb_delete_log(backend, ref_name);
+
+done:
+	return refdb_end(backend, started, error);
 }
 
-int sqlite_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
-					const git_oid *short_oid, size_t len) {
-	if (len >= GIT_OID_HEXSZ) {
-		/* Just match the full identifier */
-		int error = sqlite_backend__read(data_p, len_p, type_p, _backend, short_oid);
-		if (error == GIT_OK)
-			git_oid_cpy(out_oid, short_oid);
+static int refdb_rename_log(sqlite_refdb_backend *backend, const char *old_name, const char *new_name)
+{
+	if (sqlite3_bind_text(backend->st_reflog_rename, 1, new_name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_reflog_rename, 2, old_name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		sqlite3_reset(backend->st_reflog_rename);
+		return GIT_ERROR;
+	}
+
+	return refdb_step(backend, backend->st_reflog_rename);
+}
+
+int sqlite_refdb_backend__rename(git_reference **out, git_refdb_backend *_backend, const char *old_name,
+	const char *new_name, int force, const git_signature *who, const char *message)
+{
+	sqlite_refdb_backend *backend;
+	int error, started;
 
+	assert(out && old_name && new_name && _backend);
+
+	backend = (sqlite_refdb_backend *)_backend;
+	*out = NULL;
+
+	if ((error = refdb_begin(backend, &started)) < 0)
 		return error;
+
+	if (force) {
+		if (sqlite3_bind_text(backend->st_delete, 1, new_name, -1, SQLITE_STATIC) != SQLITE_OK) {
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			sqlite3_reset(backend->st_delete);
+			error = GIT_ERROR;
+			goto done;
+		}
+
+		if ((error = refdb_step(backend, backend->st_delete)) < 0 ||
+			(error = refdb_delete_log(backend, new_name)) < 0)
+			goto done;
 	}
-	/* not implemented (yet) */
-	return GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_rename, 1, new_name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(backend->st_rename, 2, old_name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+		sqlite3_reset(backend->st_rename);
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	error = refdb_step(backend, backend->st_rename);
+	if (error == GIT_EEXISTS) {
+		giterr_set_str(GITERR_REFERENCE, "failed to rename reference, the new name already exists");
+		goto done;
+	} else if (error < 0) {
+		goto done;
+	} else if (sqlite3_changes(backend->db) != 1) {
+		giterr_set_str(GITERR_REFERENCE, "SQLite refdb couldn't find ref");
+		error = GIT_ENOTFOUND;
+		goto done;
+	}
+
+	if ((error = refdb_rename_log(backend, old_name, new_name)) < 0)
+		goto done;
+
+	if ((error = sqlite_refdb_backend__lookup(out, _backend, new_name)) < 0)
+		goto done;
+
+	if (who != NULL)
+		error = refdb_append_log(backend, new_name, git_reference_target(*out), who, message);
+
+done:
+	error = refdb_end(backend, started, error);
+	if (error < 0 && *out != NULL) {
+		git_reference_free(*out);
+		*out = NULL;
+	}
+
+	return error;
 }
 
-int sqlite_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+/*
+ * All refs of a git_transaction are updated in the same database
+ * transaction, opened when the first one gets locked. SQLite locks the
+ * whole database rather than rows, so the IMMEDIATE transaction is what
+ * keeps other writers out until the last ref is unlocked.
+ */
+int sqlite_refdb_backend__lock(void **payload_out, git_refdb_backend *_backend, const char *refname)
 {
-	sqlite_backend *backend;
-	int found;
+	sqlite_refdb_backend *backend;
+	char *payload;
 
-	assert(_backend && oid);
+	assert(payload_out && _backend && refname);
 
-	backend = (sqlite_backend *)_backend;
-	found = 0;
+	backend = (sqlite_refdb_backend *)_backend;
 
-	if (sqlite3_bind_text(backend->st_read_header, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK) {
-		if (sqlite3_step(backend->st_read_header) == SQLITE_ROW) {
-			found = 1;
-			assert(sqlite3_step(backend->st_read_header) == SQLITE_DONE);
+	payload = strdup(refname);
+	if (payload == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if (backend->txn_depth == 0) {
+		if (refdb_exec(backend->db, "BEGIN IMMEDIATE;") < 0) {
+			free(payload);
+			return GIT_ERROR;
 		}
+
+		backend->txn_failed = 0;
 	}
 
-	sqlite3_reset(backend->st_read_header);
-	return found;
-}
+	backend->txn_depth++;
 
+	*payload_out = payload;
+	return GIT_OK;
+}
 
-int sqlite_backend__write(git_odb_backend *_backend, const git_oid *id, const void *data, size_t len, git_otype type)
+int sqlite_refdb_backend__unlock(git_refdb_backend *_backend, void *payload, int success, int update_reflog,
+	const git_reference *ref, const git_signature *sig, const char *message)
 {
+	sqlite_refdb_backend *backend;
 	int error;
-	sqlite_backend *backend;
 
-	assert(id && _backend && data);
+	assert(_backend && payload);
 
-	backend = (sqlite_backend *)_backend;
+	backend = (sqlite_refdb_backend *)_backend;
+	error = GIT_OK;
 
-	error = SQLITE_ERROR;
+	/* 2 means the ref is to be deleted, any other non-zero value updated */
+	if (success == 2)
+		error = sqlite_refdb_backend__del(_backend, (const char *)payload, NULL, NULL);
+	else if (success)
+		error = sqlite_refdb_backend__write(_backend, ref, 1, update_reflog ? sig : NULL, message, NULL, NULL);
 
-	if (sqlite3_bind_text(backend->st_write, 1, (char *)id->id, 20, SQLITE_TRANSIENT) == SQLITE_OK &&
-		sqlite3_bind_int(backend->st_write, 2, (int)type) == SQLITE_OK &&
-		sqlite3_bind_int(backend->st_write, 3, len) == SQLITE_OK &&
-		sqlite3_bind_blob(backend->st_write, 4, data, len, SQLITE_TRANSIENT) == SQLITE_OK) {
-		error = sqlite3_step(backend->st_write);
+	free(payload);
+
+	if (--backend->txn_depth > 0)
+		return error;
+
+	if (backend->txn_failed) {
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		if (error == GIT_OK) {
+			giterr_set_str(GITERR_REFERENCE, "SQLite refdb transaction rolled back");
+			error = GIT_ERROR;
+		}
+	} else if (refdb_exec(backend->db, "COMMIT;") < 0) {
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		error = GIT_ERROR;
 	}
 
-	sqlite3_reset(backend->st_write);
-	return (error == SQLITE_DONE) ? GIT_OK : GIT_ERROR;
+	return error;
 }
 
-
-void sqlite_backend__free(git_odb_backend *_backend)
+void sqlite_refdb_backend__free(git_refdb_backend *_backend)
 {
-	sqlite_backend *backend;
+	sqlite_refdb_backend *backend;
+
 	assert(_backend);
-	backend = (sqlite_backend *)_backend;
+	backend = (sqlite_refdb_backend *)_backend;
 
-	sqlite3_finalize(backend->st_read);
-	sqlite3_finalize(backend->st_read_header);
-	sqlite3_finalize(backend->st_write);
+	/* a git_transaction left open is abandoned */
+	if (backend->txn_depth > 0)
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+
+	sqlite3_finalize(backend->st_lookup);
+	sqlite3_finalize(backend->st_insert);
+	sqlite3_finalize(backend->st_upsert);
+	sqlite3_finalize(backend->st_update);
+	sqlite3_finalize(backend->st_delete);
+	sqlite3_finalize(backend->st_delete_cas);
+	sqlite3_finalize(backend->st_rename);
+	sqlite3_finalize(backend->st_has_log);
+	sqlite3_finalize(backend->st_reflog_append);
+	sqlite3_finalize(backend->st_reflog_rename);
+	sqlite3_finalize(backend->st_reflog_delete);
 	sqlite3_close(backend->db);
 
 	free(backend);
 }
 
-static int create_table(sqlite3 *db)
+/* reflog methods */
+
+int sqlite_refdb_backend__has_log(git_refdb_backend *_backend, const char *refname)
 {
-	static const char *sql_creat =
-		"CREATE TABLE '" GIT2_TABLE_NAME "' ("
-		"'oid' CHARACTER(20) PRIMARY KEY NOT NULL,"
-		"'type' INTEGER NOT NULL,"
-		"'size' INTEGER NOT NULL,"
-		"'data' BLOB);";
+	sqlite_refdb_backend *backend;
+	int error;
 
-	if (sqlite3_exec(db, sql_creat, NULL, NULL, NULL) != SQLITE_OK)
-		return GIT_ERROR;
+	assert(_backend && refname);
 
-	return GIT_OK;
+	backend = (sqlite_refdb_backend *)_backend;
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_has_log, 1, refname, -1, SQLITE_STATIC) == SQLITE_OK) {
+		switch (sqlite3_step(backend->st_has_log)) {
+		case SQLITE_ROW:
+			error = 1;
+			break;
+
+		case SQLITE_DONE:
+			error = 0;
+			break;
+
+		default:
+			giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+			break;
+		}
+	}
+
+	sqlite3_reset(backend->st_has_log);
+	return error;
 }
 
-static int init_db(sqlite3 *db)
+int sqlite_refdb_backend__ensure_log(git_refdb_backend *_backend, const char *refname)
 {
-	static const char *sql_check =
-		"SELECT name FROM sqlite_master WHERE type='table' AND name='" GIT2_TABLE_NAME "';";
+	/* there's nothing to create up front, entries are simply rows */
+	return GIT_OK;
+}
 
-	sqlite3_stmt *st_check;
-	int error;
+int sqlite_refdb_backend__reflog_read(git_reflog **out, git_refdb_backend *_backend, const char *name)
+{
+	/*
+	 * git_reflog is opaque outside of libgit2, so there's no way for us
+	 * to build one from the stored entries
+	 */
+	giterr_set_str(GITERR_REFERENCE, "SQLite refdb can't read reflogs back");
+	return GIT_ERROR;
+}
 
-	if (sqlite3_prepare_v2(db, sql_check, -1, &st_check, NULL) != SQLITE_OK)
-		return GIT_ERROR;
+int sqlite_refdb_backend__reflog_write(git_refdb_backend *_backend, git_reflog *reflog)
+{
+	giterr_set_str(GITERR_REFERENCE, "SQLite refdb can't rewrite reflogs");
+	return GIT_ERROR;
+}
 
-	switch (sqlite3_step(st_check)) {
-	case SQLITE_DONE:
-		/* the table was not found */
-		error = create_table(db);
-		break;
+int sqlite_refdb_backend__reflog_rename(git_refdb_backend *_backend, const char *old_name, const char *new_name)
+{
+	assert(_backend && old_name && new_name);
+	return refdb_rename_log((sqlite_refdb_backend *)_backend, old_name, new_name);
+}
 
-	case SQLITE_ROW:
-		/* the table was found */
-		error = GIT_OK;
-		break;
+int sqlite_refdb_backend__reflog_delete(git_refdb_backend *_backend, const char *name)
+{
+	assert(_backend && name);
+	return refdb_delete_log((sqlite_refdb_backend *)_backend, name);
+}
 
-	default:
-		error = GIT_ERROR;
-		break;
-	}
+/*
+ * Names compare as plain bytes, so the primary key orders refs the way
+ * the iterator's range scan expects. Reflog ids are stored as hex like
+ * ref targets, so appending an entry can copy the old one straight from
+ * the ref.
+ */
+static int init_refdb(sqlite3 *db)
+{
+	static const char *sql_create =
+		"CREATE TABLE IF NOT EXISTS '" GIT2_REFS_TABLE_NAME "' ("
+		"'name' TEXT PRIMARY KEY NOT NULL,"
+		"'type' INTEGER NOT NULL,"
+		"'target' TEXT NOT NULL) WITHOUT ROWID;"
+		"CREATE TABLE IF NOT EXISTS '" GIT2_REFLOG_TABLE_NAME "' ("
+		"'id' INTEGER PRIMARY KEY,"
+		"'name' TEXT NOT NULL,"
+		"'old_oid' TEXT NOT NULL,"
+		"'new_oid' TEXT NOT NULL,"
+		"'committer_name' TEXT NOT NULL,"
+		"'committer_email' TEXT NOT NULL,"
+		"'time' INTEGER NOT NULL,"
+		"'offset' INTEGER NOT NULL,"
+		"'message' TEXT);"
+		"CREATE INDEX IF NOT EXISTS '" GIT2_REFLOG_TABLE_NAME "_name' ON '" GIT2_REFLOG_TABLE_NAME "' (name, id);";
 
-	sqlite3_finalize(st_check);
-	return error;
+	return refdb_exec(db, sql_create);
 }
 
-static int init_statements(sqlite_backend *backend)
+static int init_refdb_statements(sqlite_refdb_backend *backend)
 {
-	static const char *sql_read =
-		"SELECT type, size, data FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+	static const char *sql_lookup =
+		"SELECT type, target FROM '" GIT2_REFS_TABLE_NAME "' WHERE name = ?;";
 
-	static const char *sql_read_header =
-		"SELECT type, size FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
+	static const char *sql_insert =
+		"INSERT INTO '" GIT2_REFS_TABLE_NAME "' (name, type, target) VALUES (?, ?, ?);";
 
-	static const char *sql_write =
-		"INSERT OR IGNORE INTO '" GIT2_TABLE_NAME "' VALUES (?, ?, ?, ?);";
+	static const char *sql_upsert =
+		"INSERT OR REPLACE INTO '" GIT2_REFS_TABLE_NAME "' (name, type, target) VALUES (?, ?, ?);";
 
-	if (sqlite3_prepare_v2(backend->db, sql_read, -1, &backend->st_read, NULL) != SQLITE_OK)
-		return GIT_ERROR;
+	static const char *sql_update =
+		"UPDATE '" GIT2_REFS_TABLE_NAME "' SET type = ?, target = ? WHERE name = ? AND target = ?;";
 
-	if (sqlite3_prepare_v2(backend->db, sql_read_header, -1, &backend->st_read_header, NULL) != SQLITE_OK)
-		return GIT_ERROR;
+	static const char *sql_delete =
+		"DELETE FROM '" GIT2_REFS_TABLE_NAME "' WHERE name = ?;";
+
+	static const char *sql_delete_cas =
+		"DELETE FROM '" GIT2_REFS_TABLE_NAME "' WHERE name = ? AND target = ?;";
+
+	static const char *sql_rename =
+		"UPDATE '" GIT2_REFS_TABLE_NAME "' SET name = ? WHERE name = ?;";
+
+	static const char *sql_has_log =
+		"SELECT 1 FROM '" GIT2_REFLOG_TABLE_NAME "' WHERE name = ? LIMIT 1;";
 
-	if (sqlite3_prepare_v2(backend->db, sql_write, -1, &backend->st_write, NULL) != SQLITE_OK)
+	/* type 1 is GIT_REF_OID, symbolic refs have no old id to log */
+	static const char *sql_reflog_append =
+		"INSERT INTO '" GIT2_REFLOG_TABLE_NAME "'"
+		" (name, old_oid, new_oid, committer_name, committer_email, time, offset, message)"
+		" VALUES (?1, IFNULL((SELECT target FROM '" GIT2_REFS_TABLE_NAME "' WHERE name = ?1 AND type = 1),"
+		" '0000000000000000000000000000000000000000'), ?2, ?3, ?4, ?5, ?6, ?7);";
+
+	static const char *sql_reflog_rename =
+		"UPDATE '" GIT2_REFLOG_TABLE_NAME "' SET name = ? WHERE name = ?;";
+
+	static const char *sql_reflog_delete =
+		"DELETE FROM '" GIT2_REFLOG_TABLE_NAME "' WHERE name = ?;";
+
+	if (sqlite3_prepare_v2(backend->db, sql_lookup, -1, &backend->st_lookup, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_insert, -1, &backend->st_insert, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_upsert, -1, &backend->st_upsert, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_update, -1, &backend->st_update, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_delete, -1, &backend->st_delete, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_delete_cas, -1, &backend->st_delete_cas, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_rename, -1, &backend->st_rename, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_has_log, -1, &backend->st_has_log, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_reflog_append, -1, &backend->st_reflog_append, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_reflog_rename, -1, &backend->st_reflog_rename, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_reflog_delete, -1, &backend->st_reflog_delete, NULL) != SQLITE_OK) {
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
 		return GIT_ERROR;
+	}
 
 	return GIT_OK;
 }
 
-int git_odb_backend_sqlite(git_odb_backend **backend_out, const char *sqlite_db)
+int git_refdb_backend_sqlite_ext(git_refdb_backend **backend_out, const char *sqlite_db,
+	const git_odb_sqlite_options *opts)
 {
-	sqlite_backend *backend;
-	int error;
+	git_odb_sqlite_options defaults = GIT_ODB_SQLITE_OPTIONS_INIT;
+	sqlite_refdb_backend *backend;
 
-	backend = calloc(1, sizeof(sqlite_backend));
+	if (opts == NULL)
+		opts = &defaults;
+
+	if (opts->version != GIT_ODB_SQLITE_OPTIONS_VERSION) {
+		giterr_set_str(GITERR_INVALID, "invalid version for git_odb_sqlite_options");
+		return GIT_ERROR;
+	}
+
+	backend = calloc(1, sizeof(sqlite_refdb_backend));
 	if (backend == NULL) {
 		giterr_set_oom();
 		return GIT_ERROR;
 	}
 
-	if (sqlite3_open(sqlite_db, &backend->db) != SQLITE_OK)
+	if (open_db(&backend->db, sqlite_db, opts, 0) < 0) {
+		giterr_set_str(GITERR_REFERENCE, "SQLite refdb storage couldn't open the database");
 		goto cleanup;
+	}
 
-	error = init_db(backend->db);
-	if (error < 0)
+	if (configure_db(backend->db, opts) < 0)
 		goto cleanup;
 
-	error = init_statements(backend);
-	if (error < 0)
+	/* a read-only open has to find the tables there already */
+	if (!opts->readonly && !opts->immutable && init_refdb(backend->db) < 0)
 		goto cleanup;
 
-	backend->parent.version = GIT_ODB_BACKEND_VERSION;
-	backend->parent.read = &sqlite_backend__read;
-	backend->parent.read_prefix = &sqlite_backend__read_prefix;
-	backend->parent.read_header = &sqlite_backend__read_header;
-	backend->parent.write = &sqlite_backend__write;
-	backend->parent.exists = &sqlite_backend__exists;
-	backend->parent.free = &sqlite_backend__free;
+	if (init_refdb_statements(backend) < 0)
+		goto cleanup;
 
-	*backend_out = (git_odb_backend *)backend;
+	backend->parent.version = GIT_REFDB_BACKEND_VERSION;
+	backend->parent.exists = &sqlite_refdb_backend__exists;
+	backend->parent.lookup = &sqlite_refdb_backend__lookup;
+	backend->parent.iterator = &sqlite_refdb_backend__iterator;
+	backend->parent.write = &sqlite_refdb_backend__write;
+	backend->parent.del = &sqlite_refdb_backend__del;
+	backend->parent.rename = &sqlite_refdb_backend__rename;
+	backend->parent.compress = NULL;
+	backend->parent.has_log = &sqlite_refdb_backend__has_log;
+	backend->parent.ensure_log = &sqlite_refdb_backend__ensure_log;
+	backend->parent.free = &sqlite_refdb_backend__free;
+	backend->parent.reflog_read = &sqlite_refdb_backend__reflog_read;
+	backend->parent.reflog_write = &sqlite_refdb_backend__reflog_write;
+	backend->parent.reflog_rename = &sqlite_refdb_backend__reflog_rename;
+	backend->parent.reflog_delete = &sqlite_refdb_backend__reflog_delete;
+	backend->parent.lock = &sqlite_refdb_backend__lock;
+	backend->parent.unlock = &sqlite_refdb_backend__unlock;
+
+	*backend_out = (git_refdb_backend *)backend;
 	return GIT_OK;
 
 cleanup:
-	sqlite_backend__free((git_odb_backend *)backend);
-	return error;
+	sqlite_refdb_backend__free((git_refdb_backend *)backend);
+	return GIT_ERROR;
+}
+
+int git_refdb_backend_sqlite(git_refdb_backend **backend_out, const char *sqlite_db)
+{
+	return git_refdb_backend_sqlite_ext(backend_out, sqlite_db, NULL);
 }